@@ -3,7 +3,74 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
+#include "kernel/interrupt.h"
 #include "kernel/malloc.h"
+#include "kernel/thread.h"
+
+/* Requests and scheduling.
+
+   Every read and write becomes a struct block_request, queued on
+   the device that holds the data (partitions pass their
+   requests on to the underlying disk through their "remap"
+   operation).  Each such device has a dispatcher thread that
+   takes requests off its queue one at a time, in the order
+   chosen by the I/O scheduler, and carries them out through the
+   driver.  block_read() and the other synchronous functions
+   simply submit a request and wait for it, so the queue fills
+   up when several threads do I/O at once.
+
+   Most drivers carry out one transfer at a time, in the
+   dispatcher thread.  A driver with a "start" operation instead
+   starts each transfer and reports its completion later with
+   block_complete(), from its interrupt handler, so the
+   dispatcher can keep up to BLOCK_TRANSFER_MAX transfers
+   outstanding on the device.
+
+   When the dispatcher takes a request, it also takes any queued
+   requests in the same direction that continue it or that it
+   continues, up to MERGE_SECTOR_MAX sectors in all, and hands
+   them to the driver as one transfer.
+
+   The scheduler is picked with block_configure_scheduler():
+
+     - "fifo" serves requests in order of arrival.
+
+     - "cscan" is a one-way elevator: it serves the request with
+       the lowest sector at or after the end of the last
+       transfer, wrapping around to the lowest sector of all.
+
+     - "deadline", the default, works like "cscan", but serves
+       the oldest request first once it has waited READ_EXPIRE
+       or WRITE_EXPIRE ticks, so that no request starves.  Reads
+       expire sooner, because a thread is usually waiting on
+       each of them.
+
+   Each device with a queue also keeps statistics that
+   block_print_stats() reports: the number of requests in flight
+   (queued or being transferred), a histogram of how long the
+   driver takes per transfer, by powers of 2 of CPU cycles as
+   counted by the time-stamp counter, and how many transfers
+   started where the previous one ended ("sequential") or
+   elsewhere ("random").
+
+   The "-blktrace=N" option keeps a record of each of the last N
+   completed requests: where it went, which thread submitted it
+   and to which role's device, how long it waited in the queue,
+   and how long the transfer took.  block_dump_trace() prints
+   them, at shutdown and for the iostat system call. */
+
+/* Most sectors in one merged transfer, and most iovecs. */
+#define MERGE_SECTOR_MAX 256
+#define MERGE_IOV_MAX 64
+
+/* Ticks a request may wait under the deadline scheduler. */
+#define READ_EXPIRE (TIMER_FREQ / 10)
+#define WRITE_EXPIRE (TIMER_FREQ / 2)
+
+/* Buckets in a latency histogram.  Bucket I counts transfers
+   that took at least 2**I and less than 2**(I+1) cycles. */
+#define HIST_BUCKETS 40
 
 /* A block device. */
 struct block
@@ -17,10 +84,91 @@ struct block
     const struct block_operations *ops;  /* Driver operations. */
     void *aux;                          /* Extra data owned by driver. */
 
+    /* Protected by LOCK. */
+    struct lock lock;                   /* Protects the members below. */
+    struct list queue;                  /* Queued requests, oldest first. */
+    struct condition queue_nonempty;    /* Signaled when a request arrives. */
+    block_sector_t head;                /* Sector after the last transfer. */
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+    unsigned long long read_req_cnt;    /* Number of read requests. */
+    unsigned long long write_req_cnt;   /* Number of write requests. */
+    unsigned long long dispatch_cnt;    /* Transfers handed to the driver. */
+    unsigned long long merge_cnt;       /* Requests merged into others. */
+    unsigned long long flush_cnt;       /* Cache flushes. */
+    unsigned long long seq_cnt;         /* Transfers starting at HEAD. */
+    unsigned max_in_flight;             /* Peak of IN_FLIGHT. */
+    unsigned long long depth_sum;       /* Sum of IN_FLIGHT at submissions. */
+
+    /* Updated with interrupts off, because block_complete() may
+       run in an interrupt handler. */
+    unsigned in_flight;                 /* Requests queued or in transfer. */
+    unsigned long long read_hist[HIST_BUCKETS];  /* Read latencies. */
+    unsigned long long write_hist[HIST_BUCKETS]; /* Write latencies. */
+    struct list free_transfers;         /* Transfers not in progress. */
+
+    struct transfer *transfers;         /* Array of transfers. */
+    struct semaphore free_transfer_cnt; /* Length of FREE_TRANSFERS. */
+  };
+
+/* A transfer in progress.  PUBLIC, which the driver sees, must
+   be the first member, so that block_complete() can find the
+   rest. */
+struct transfer
+  {
+    struct block_transfer public;       /* What to transfer. */
+    struct block *block;                /* Device. */
+    struct list requests;               /* Requests, in sector order. */
+    size_t request_cnt;                 /* Number of REQUESTS. */
+    uint64_t dispatch_tsc;              /* When handed to the driver. */
+    struct list_elem elem;              /* Element in FREE_TRANSFERS. */
+    struct block_iovec merge_iov[MERGE_IOV_MAX]; /* Merged requests' iovecs. */
+  };
+
+/* An I/O scheduler. */
+struct scheduler
+  {
+    const char *name;
+    /* Returns the queued request to serve next from BLOCK's
+       nonempty queue.  BLOCK's lock is held. */
+    struct block_request *(*pick) (struct block *block);
+  };
+
+static struct block_request *fifo_pick (struct block *);
+static struct block_request *cscan_pick (struct block *);
+static struct block_request *deadline_pick (struct block *);
+
+static const struct scheduler schedulers[] =
+  {
+    {"fifo", fifo_pick},
+    {"cscan", cscan_pick},
+    {"deadline", deadline_pick},
+  };
+
+/* The scheduler used by every device. */
+static const struct scheduler *scheduler = &schedulers[2];
+
+/* A trace record of a completed request. */
+struct trace_record
+  {
+    unsigned long long seq;             /* Request number, from 1. */
+    const struct block *block;          /* Device that did the transfer. */
+    block_sector_t sector;              /* First sector on BLOCK. */
+    size_t sector_cnt;                  /* Number of sectors. */
+    bool write;                         /* Write or read? */
+    enum block_type type;               /* Type of device submitted to. */
+    int tid;                            /* Submitting thread. */
+    char thread_name[16];
+    uint64_t wait;                      /* Cycles spent queued. */
+    uint64_t service;                   /* Cycles spent in transfer. */
   };
 
+/* Ring buffer of the last TRACE_CNT completed requests.  Updated
+   with interrupts off, so that it needs no lock. */
+static size_t trace_cnt;
+static struct trace_record *trace;
+static unsigned long long trace_seq;    /* Requests traced so far. */
+
 /* List of all block devices. */
 static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 
@@ -28,6 +176,17 @@ static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
 static struct block *list_elem_to_block (struct list_elem *);
+static void check_sectors (struct block *, block_sector_t, size_t cnt);
+static void transfer (struct block *, block_sector_t sector,
+                      const struct block_iovec *, size_t iov_cnt,
+                      bool write);
+static thread_func dispatcher NO_RETURN;
+static inline uint64_t read_tsc (void);
+static int log2_bucket (uint64_t cycles);
+static void record_trace (const struct block *, const struct block_request *,
+                          uint64_t done_tsc);
+static void print_histogram (const char *name, const char *what,
+                             const unsigned long long *);
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -99,18 +258,17 @@ block_get_by_name (const char *name)
   return NULL;
 }
 
-/* Verifies that SECTOR is a valid offset within BLOCK.
-   Panics if not. */
-static void
-check_sector (struct block *block, block_sector_t sector)
+/* Returns the total number of sectors in the IOV_CNT elements
+   of IOV. */
+size_t
+block_iovec_sectors (const struct block_iovec *iov, size_t iov_cnt)
 {
-  if (sector >= block->size)
-    {
-      /* We do not use ASSERT because we want to panic here
-         regardless of whether NDEBUG is defined. */
-      PANIC ("Access past end of device %s (sector=%"PRDSNu", "
-             "size=%"PRDSNu")\n", block_name (block), sector, block->size);
-    }
+  size_t cnt = 0;
+  size_t i;
+
+  for (i = 0; i < iov_cnt; i++)
+    cnt += iov[i].sector_cnt;
+  return cnt;
 }
 
 /* Reads sector SECTOR from BLOCK into BUFFER, which must
@@ -120,9 +278,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_read_multiple (block, sector, buffer, 1);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -133,10 +289,191 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  block_write_multiple (block, sector, buffer, 1);
+}
+
+/* Reads CNT sectors, starting at SECTOR, from BLOCK into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes. */
+void
+block_read_multiple (struct block *block, block_sector_t sector,
+                     void *buffer, size_t cnt)
+{
+  struct block_iovec iov;
+
+  iov.buffer = buffer;
+  iov.sector_cnt = cnt;
+  block_readv (block, sector, &iov, 1);
+}
+
+/* Writes CNT sectors, starting at SECTOR, to BLOCK from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes.  Returns
+   after the block device has acknowledged receiving the
+   data. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      const void *buffer, size_t cnt)
+{
+  struct block_iovec iov;
+
+  iov.buffer = (void *) buffer;
+  iov.sector_cnt = cnt;
+  block_writev (block, sector, &iov, 1);
+}
+
+/* Reads consecutive sectors, starting at SECTOR, from BLOCK into
+   the IOV_CNT buffers described by IOV, in order. */
+void
+block_readv (struct block *block, block_sector_t sector,
+             const struct block_iovec *iov, size_t iov_cnt)
+{
+  struct block_request r;
+
+  block_request_init (&r, false, sector, iov, iov_cnt, NULL, NULL);
+  block_submit (block, &r);
+  block_wait (&r);
+}
+
+/* Writes consecutive sectors, starting at SECTOR, to BLOCK from
+   the IOV_CNT buffers described by IOV, in order.  Returns after
+   the block device has acknowledged receiving the data. */
+void
+block_writev (struct block *block, block_sector_t sector,
+              const struct block_iovec *iov, size_t iov_cnt)
+{
+  struct block_request r;
+
+  block_request_init (&r, true, sector, iov, iov_cnt, NULL, NULL);
+  block_submit (block, &r);
+  block_wait (&r);
+}
+
+/* Makes the writes to BLOCK that have completed durable, by
+   having the device write back its volatile write cache, if it
+   has one.  A completed write is only known to have reached the
+   device, not its media, so call this where durability matters,
+   such as when syncing a file system. */
+void
+block_flush (struct block *block)
+{
+  block_sector_t sector = 0;
+
+  while (block->ops->remap != NULL)
+    block = block->ops->remap (block->aux, &sector);
+
+  if (block->ops->flush != NULL)
+    {
+      lock_acquire (&block->lock);
+      block->flush_cnt++;
+      lock_release (&block->lock);
+      block->ops->flush (block->aux);
+    }
+}
+
+/* Initializes R as a request to read (if WRITE is false) or
+   write (if WRITE is true) consecutive sectors, starting at
+   SECTOR, into or from the IOV_CNT buffers described by IOV.
+   When the request completes, DONE, if nonnull, is called with
+   R and AUX.  DONE runs in the device's dispatcher thread or, for
+   a driver that completes transfers asynchronously, in its
+   interrupt handler, so it must not sleep. */
+void
+block_request_init (struct block_request *r, bool write,
+                    block_sector_t sector,
+                    const struct block_iovec *iov, size_t iov_cnt,
+                    block_done_func *done, void *aux)
+{
+  r->write = write;
+  r->sector = sector;
+  r->iov = iov;
+  r->iov_cnt = iov_cnt;
+  r->done = done;
+  r->aux = aux;
+  r->sector_cnt = block_iovec_sectors (iov, iov_cnt);
+  sema_init (&r->completed, 0);
+}
+
+/* Queues request R on BLOCK and returns without waiting for it
+   to complete.  Use block_wait() or R's completion function to
+   find out when it has. */
+void
+block_submit (struct block *block, struct block_request *r)
+{
+  enum intr_level old_level;
+  unsigned in_flight;
+
+  ASSERT (!r->write || block->type != BLOCK_FOREIGN);
+
+  if (r->sector_cnt == 0)
+    {
+      if (r->done != NULL)
+        r->done (r, r->aux);
+      sema_up (&r->completed);
+      return;
+    }
+  check_sectors (block, r->sector, r->sector_cnt);
+  r->type = block->type;
+  r->tid = thread_tid ();
+  strlcpy (r->thread_name, thread_name (), sizeof r->thread_name);
+
+  /* Count the request at every level, and pass it down to the
+     device that has a queue. */
+  for (;;)
+    {
+      lock_acquire (&block->lock);
+      if (r->write)
+        {
+          block->write_cnt += r->sector_cnt;
+          block->write_req_cnt++;
+        }
+      else
+        {
+          block->read_cnt += r->sector_cnt;
+          block->read_req_cnt++;
+        }
+      if (block->ops->remap == NULL)
+        break;
+      lock_release (&block->lock);
+      block = block->ops->remap (block->aux, &r->sector);
+    }
+
+  r->deadline = timer_ticks () + (r->write ? WRITE_EXPIRE : READ_EXPIRE);
+  r->submit_tsc = read_tsc ();
+  old_level = intr_disable ();
+  in_flight = ++block->in_flight;
+  intr_set_level (old_level);
+  if (in_flight > block->max_in_flight)
+    block->max_in_flight = in_flight;
+  block->depth_sum += in_flight;
+  list_push_back (&block->queue, &r->elem);
+  cond_signal (&block->queue_nonempty, &block->lock);
+  lock_release (&block->lock);
+}
+
+/* Waits for request R, which must have been submitted, to
+   complete. */
+void
+block_wait (struct block_request *r)
+{
+  sema_down (&r->completed);
+}
+
+/* Makes every block device use the I/O scheduler with the given
+   NAME.  Returns true if successful, false if there is no such
+   scheduler.  Must be called before any device is
+   registered. */
+bool
+block_configure_scheduler (const char *name)
+{
+  size_t i;
+
+  ASSERT (list_empty (&all_blocks));
+  for (i = 0; i < sizeof schedulers / sizeof *schedulers; i++)
+    if (!strcmp (name, schedulers[i].name))
+      {
+        scheduler = &schedulers[i];
+        return true;
+      }
+  return false;
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -160,22 +497,93 @@ block_type (struct block *block)
   return block->type;
 }
 
-/* Prints statistics for each block device used for a Pintos role. */
+/* Prints statistics for each block device used for a Pintos
+   role, and for the queue of each device that has one. */
 void
 block_print_stats (void)
 {
+  struct list_elem *e;
   int i;
 
-  for (i = 0; i < BLOCK_CNT; i++)
+  for (i = 0; i < BLOCK_ROLE_CNT; i++)
     {
       struct block *block = block_by_role[i];
       if (block != NULL)
         {
-          printf ("%s (%s): %llu reads, %llu writes\n",
+          printf ("%s (%s): %llu reads in %llu requests, "
+                  "%llu writes in %llu requests\n",
                   block->name, block_type_name (block->type),
-                  block->read_cnt, block->write_cnt);
+                  block->read_cnt, block->read_req_cnt,
+                  block->write_cnt, block->write_req_cnt);
         }
     }
+
+  for (e = list_begin (&all_blocks); e != list_end (&all_blocks);
+       e = list_next (e))
+    {
+      struct block *block = list_entry (e, struct block, list_elem);
+      if (block->ops->remap == NULL)
+        {
+          unsigned long long req_cnt = block->read_req_cnt
+                                       + block->write_req_cnt;
+
+          printf ("%s: %s scheduler, %llu transfers, %llu requests merged, "
+                  "%llu flushes\n",
+                  block->name, scheduler->name,
+                  block->dispatch_cnt, block->merge_cnt, block->flush_cnt);
+          printf ("%s: %llu bytes read, %llu bytes written\n",
+                  block->name, block->read_cnt * BLOCK_SECTOR_SIZE,
+                  block->write_cnt * BLOCK_SECTOR_SIZE);
+          printf ("%s: %llu sequential and %llu random transfers, "
+                  "queue depth %llu.%02llu average, %u maximum\n",
+                  block->name, block->seq_cnt,
+                  block->dispatch_cnt - block->seq_cnt,
+                  req_cnt > 0 ? block->depth_sum / req_cnt : 0,
+                  req_cnt > 0 ? block->depth_sum * 100 / req_cnt % 100 : 0,
+                  block->max_in_flight);
+          print_histogram (block->name, "read", block->read_hist);
+          print_histogram (block->name, "write", block->write_hist);
+        }
+    }
+}
+
+/* Keeps a trace of the last RECORD_CNT completed requests, or of
+   none if RECORD_CNT is 0.  Must be called before any block
+   device is registered. */
+void
+block_configure_trace (size_t record_cnt)
+{
+  ASSERT (list_empty (&all_blocks));
+  trace_cnt = record_cnt;
+}
+
+/* Prints the trace of completed requests, oldest first. */
+void
+block_dump_trace (void)
+{
+  unsigned long long first, seq;
+
+  if (trace == NULL)
+    return;
+
+  first = trace_seq > trace_cnt ? trace_seq - trace_cnt : 0;
+  printf ("Block trace: %llu requests, last %llu shown\n",
+          trace_seq, trace_seq - first);
+  for (seq = first; seq < trace_seq; seq++)
+    {
+      struct trace_record t;
+      enum intr_level old_level;
+
+      old_level = intr_disable ();
+      t = trace[seq % trace_cnt];
+      intr_set_level (old_level);
+
+      printf ("%6llu %-8s %c %10"PRDSNu" +%-4zu %-7s tid %3d %-15s "
+              "wait %llu service %llu\n",
+              t.seq, t.block->name, t.write ? 'W' : 'R', t.sector,
+              t.sector_cnt, block_type_name (t.type), t.tid, t.thread_name,
+              t.wait, t.service);
+    }
 }
 
 /* Registers a new block device with the given NAME.  If
@@ -198,8 +606,35 @@ block_register (const char *name, enum block_type type,
   block->size = size;
   block->ops = ops;
   block->aux = aux;
+  lock_init (&block->lock);
+  list_init (&block->queue);
+  cond_init (&block->queue_nonempty);
+  block->head = 0;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  block->read_req_cnt = 0;
+  block->write_req_cnt = 0;
+  block->dispatch_cnt = 0;
+  block->merge_cnt = 0;
+  block->flush_cnt = 0;
+  block->seq_cnt = 0;
+  block->in_flight = 0;
+  block->max_in_flight = 0;
+  block->depth_sum = 0;
+  memset (block->read_hist, 0, sizeof block->read_hist);
+  memset (block->write_hist, 0, sizeof block->write_hist);
+  list_init (&block->free_transfers);
+  block->transfers = NULL;
+  sema_init (&block->free_transfer_cnt, 0);
+
+  /* Allocate the trace on the first registration, because the
+     trace size is configured before malloc() works. */
+  if (trace_cnt > 0 && trace == NULL)
+    {
+      trace = calloc (trace_cnt, sizeof *trace);
+      if (trace == NULL)
+        PANIC ("Failed to allocate block trace of %zu records", trace_cnt);
+    }
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -208,8 +643,65 @@ block_register (const char *name, enum block_type type,
     printf (", %s", extra_info);
   printf ("\n");
 
+  if (ops->remap == NULL)
+    {
+      size_t transfer_cnt = ops->start != NULL ? BLOCK_TRANSFER_MAX : 1;
+      char thread_name[sizeof block->name + 3];
+      size_t i;
+
+      block->transfers = malloc (transfer_cnt * sizeof *block->transfers);
+      if (block->transfers == NULL)
+        PANIC ("Failed to allocate transfers for block device %s",
+               block->name);
+      for (i = 0; i < transfer_cnt; i++)
+        {
+          block->transfers[i].block = block;
+          list_init (&block->transfers[i].requests);
+          list_push_back (&block->free_transfers,
+                          &block->transfers[i].elem);
+          sema_up (&block->free_transfer_cnt);
+        }
+
+      snprintf (thread_name, sizeof thread_name, "io-%s", block->name);
+      thread_create (thread_name, PRI_DEFAULT, dispatcher, block);
+    }
+
   return block;
 }
+
+/* Completes transfer T, which the driver's START operation was
+   given, and the requests that it carried out.  May be called
+   from an interrupt handler. */
+void
+block_complete (struct block_transfer *t_)
+{
+  struct transfer *t = (struct transfer *) t_;
+  struct block *block = t->block;
+  uint64_t done_tsc = read_tsc ();
+  enum intr_level old_level;
+
+  old_level = intr_disable ();
+  (t->public.write ? block->write_hist : block->read_hist)
+    [log2_bucket (done_tsc - t->dispatch_tsc)]++;
+  block->in_flight -= t->request_cnt;
+  intr_set_level (old_level);
+
+  while (!list_empty (&t->requests))
+    {
+      struct block_request *r = list_entry (list_pop_front (&t->requests),
+                                            struct block_request, elem);
+      r->dispatch_tsc = t->dispatch_tsc;
+      record_trace (block, r, done_tsc);
+      if (r->done != NULL)
+        r->done (r, r->aux);
+      sema_up (&r->completed);
+    }
+
+  old_level = intr_disable ();
+  list_push_back (&block->free_transfers, &t->elem);
+  intr_set_level (old_level);
+  sema_up (&block->free_transfer_cnt);
+}
 
 /* Returns the block device corresponding to LIST_ELEM, or a null
    pointer if LIST_ELEM is the list end of all_blocks. */
@@ -221,3 +713,278 @@ list_elem_to_block (struct list_elem *list_elem)
           : NULL);
 }
 
+/* Verifies that the CNT sectors starting at SECTOR lie within
+   BLOCK.  Panics if not. */
+static void
+check_sectors (struct block *block, block_sector_t sector, size_t cnt)
+{
+  if (sector >= block->size || cnt > block->size - sector)
+    {
+      /* We do not use ASSERT because we want to panic here
+         regardless of whether NDEBUG is defined. */
+      PANIC ("Access past end of device %s (sector=%"PRDSNu", "
+             "count=%zu, size=%"PRDSNu")\n",
+             block_name (block), sector, cnt, block->size);
+    }
+}
+
+/* Dispatcher thread for BLOCK_.  Carries out the requests queued
+   on the device, merging adjacent ones. */
+static void
+dispatcher (void *block_)
+{
+  struct block *block = block_;
+
+  for (;;)
+    {
+      struct transfer *t;
+      struct block_request *first;
+      block_sector_t start, end;
+      size_t iov_cnt;
+      enum intr_level old_level;
+      bool merged;
+
+      /* Wait until the driver can take another transfer. */
+      sema_down (&block->free_transfer_cnt);
+      old_level = intr_disable ();
+      t = list_entry (list_pop_front (&block->free_transfers),
+                      struct transfer, elem);
+      intr_set_level (old_level);
+
+      lock_acquire (&block->lock);
+      while (list_empty (&block->queue))
+        cond_wait (&block->queue_nonempty, &block->lock);
+
+      /* Take the next request and whatever requests extend it at
+         either end, keeping T's requests in sector order. */
+      first = scheduler->pick (block);
+      list_remove (&first->elem);
+      list_push_back (&t->requests, &first->elem);
+      start = first->sector;
+      end = first->sector + first->sector_cnt;
+      iov_cnt = first->iov_cnt;
+      do
+        {
+          struct list_elem *e;
+
+          merged = false;
+          for (e = list_begin (&block->queue); e != list_end (&block->queue);
+               e = list_next (e))
+            {
+              struct block_request *r = list_entry (e, struct block_request,
+                                                    elem);
+              if (r->write != first->write
+                  || end - start + r->sector_cnt > MERGE_SECTOR_MAX
+                  || iov_cnt + r->iov_cnt > MERGE_IOV_MAX)
+                continue;
+              if (r->sector == end)
+                {
+                  list_remove (e);
+                  list_push_back (&t->requests, e);
+                  end += r->sector_cnt;
+                }
+              else if (r->sector + r->sector_cnt == start)
+                {
+                  list_remove (e);
+                  list_push_front (&t->requests, e);
+                  start = r->sector;
+                }
+              else
+                continue;
+              iov_cnt += r->iov_cnt;
+              block->merge_cnt++;
+              merged = true;
+              break;
+            }
+        }
+      while (merged);
+      if (start == block->head)
+        block->seq_cnt++;
+      block->head = end;
+      block->dispatch_cnt++;
+      t->request_cnt = list_size (&t->requests);
+      lock_release (&block->lock);
+
+      /* Describe the transfer. */
+      t->public.write = first->write;
+      t->public.sector = start;
+      t->public.sector_cnt = end - start;
+      if (t->request_cnt == 1)
+        {
+          t->public.iov = first->iov;
+          t->public.iov_cnt = first->iov_cnt;
+        }
+      else
+        {
+          struct list_elem *e;
+          size_t n = 0;
+
+          for (e = list_begin (&t->requests); e != list_end (&t->requests);
+               e = list_next (e))
+            {
+              struct block_request *r = list_entry (e, struct block_request,
+                                                    elem);
+              memcpy (t->merge_iov + n, r->iov, r->iov_cnt * sizeof *r->iov);
+              n += r->iov_cnt;
+            }
+          t->public.iov = t->merge_iov;
+          t->public.iov_cnt = n;
+        }
+
+      /* Carry it out. */
+      t->dispatch_tsc = read_tsc ();
+      if (block->ops->start != NULL)
+        block->ops->start (block->aux, &t->public);
+      else
+        {
+          transfer (block, start, t->public.iov, t->public.iov_cnt,
+                    t->public.write);
+          block_complete (&t->public);
+        }
+    }
+}
+
+/* Returns the current value of the CPU's time-stamp counter. */
+static inline uint64_t
+read_tsc (void)
+{
+  uint64_t tsc;
+  asm volatile ("rdtsc" : "=A" (tsc));
+  return tsc;
+}
+
+/* Returns the histogram bucket for a latency of CYCLES. */
+static int
+log2_bucket (uint64_t cycles)
+{
+  int bucket = 0;
+
+  while (cycles > 1 && bucket < HIST_BUCKETS - 1)
+    {
+      cycles >>= 1;
+      bucket++;
+    }
+  return bucket;
+}
+
+/* Adds a record of request R, carried out by BLOCK and completed
+   at DONE_TSC, to the trace, if tracing is on. */
+static void
+record_trace (const struct block *block, const struct block_request *r,
+              uint64_t done_tsc)
+{
+  struct trace_record *t;
+  enum intr_level old_level;
+
+  if (trace == NULL)
+    return;
+
+  old_level = intr_disable ();
+  t = &trace[trace_seq++ % trace_cnt];
+  t->seq = trace_seq;
+  t->block = block;
+  t->sector = r->sector;
+  t->sector_cnt = r->sector_cnt;
+  t->write = r->write;
+  t->type = r->type;
+  t->tid = r->tid;
+  memcpy (t->thread_name, r->thread_name, sizeof t->thread_name);
+  t->wait = r->dispatch_tsc - r->submit_tsc;
+  t->service = done_tsc - r->dispatch_tsc;
+  intr_set_level (old_level);
+}
+
+/* Prints histogram HIST of latencies for WHAT operations on the
+   device named NAME, skipping empty buckets. */
+static void
+print_histogram (const char *name, const char *what,
+                 const unsigned long long *hist)
+{
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++)
+    if (hist[i] > 0)
+      printf ("%s: %s latency %llu-%llu cycles: %llu\n",
+              name, what, 1ULL << i, (2ULL << i) - 1, hist[i]);
+}
+
+/* Has BLOCK's driver read (if WRITE is false) or write (if WRITE
+   is true) consecutive sectors, starting at SECTOR, into or from
+   the IOV_CNT buffers described by IOV.  Uses a single driver
+   call if the driver supports that. */
+static void
+transfer (struct block *block, block_sector_t sector,
+          const struct block_iovec *iov, size_t iov_cnt, bool write)
+{
+  size_t i, j;
+
+  if (write && block->ops->writev != NULL)
+    block->ops->writev (block->aux, sector, iov, iov_cnt);
+  else if (!write && block->ops->readv != NULL)
+    block->ops->readv (block->aux, sector, iov, iov_cnt);
+  else
+    for (i = 0; i < iov_cnt; i++)
+      for (j = 0; j < iov[i].sector_cnt; j++)
+        {
+          uint8_t *buffer = (uint8_t *) iov[i].buffer + j * BLOCK_SECTOR_SIZE;
+          if (write)
+            block->ops->write (block->aux, sector++, buffer);
+          else
+            block->ops->read (block->aux, sector++, buffer);
+        }
+}
+
+/* FIFO scheduler: serves the oldest request. */
+static struct block_request *
+fifo_pick (struct block *block)
+{
+  return list_entry (list_front (&block->queue), struct block_request, elem);
+}
+
+/* C-SCAN scheduler: serves the request with the lowest sector at
+   or after BLOCK's head, or, if there is none, the request with
+   the lowest sector overall. */
+static struct block_request *
+cscan_pick (struct block *block)
+{
+  struct block_request *ahead = NULL, *lowest = NULL;
+  struct list_elem *e;
+
+  for (e = list_begin (&block->queue); e != list_end (&block->queue);
+       e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (r->sector >= block->head
+          && (ahead == NULL || r->sector < ahead->sector))
+        ahead = r;
+      if (lowest == NULL || r->sector < lowest->sector)
+        lowest = r;
+    }
+  return ahead != NULL ? ahead : lowest;
+}
+
+/* Deadline scheduler: serves the oldest request if it has waited
+   too long, and otherwise acts as C-SCAN.  Reads and writes each
+   have their own age limit, so look for the oldest of each. */
+static struct block_request *
+deadline_pick (struct block *block)
+{
+  int64_t now = timer_ticks ();
+  struct list_elem *e;
+  bool read_seen = false, write_seen = false;
+
+  for (e = list_begin (&block->queue);
+       e != list_end (&block->queue) && !(read_seen && write_seen);
+       e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      bool *seen = r->write ? &write_seen : &read_seen;
+      if (!*seen)
+        {
+          if (r->deadline <= now)
+            return r;
+          *seen = true;
+        }
+    }
+  return cscan_pick (block);
+}
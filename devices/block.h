@@ -1,8 +1,11 @@
 #ifndef DEVICES_BLOCK_H
 #define DEVICES_BLOCK_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <list.h>
+#include "kernel/synch.h"
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -49,26 +52,134 @@ struct block *block_get_by_name (const char *name);
 struct block *block_first (void);
 struct block *block_next (struct block *);
 
+/* One piece of a scatter-gather transfer: SECTOR_CNT
+   consecutive sectors' worth of data at BUFFER. */
+struct block_iovec
+  {
+    void *buffer;               /* Data. */
+    size_t sector_cnt;          /* Number of sectors at BUFFER. */
+  };
+
 /* Block device operations. */
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, void *,
+                          size_t cnt);
+void block_write_multiple (struct block *, block_sector_t, const void *,
+                           size_t cnt);
+void block_readv (struct block *, block_sector_t,
+                  const struct block_iovec *, size_t iov_cnt);
+void block_writev (struct block *, block_sector_t,
+                   const struct block_iovec *, size_t iov_cnt);
+void block_flush (struct block *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
-/* Statistics. */
+/* Asynchronous requests. */
+
+struct block_request;
+typedef void block_done_func (struct block_request *, void *aux);
+
+/* A request to read or write consecutive sectors.  The submitter
+   provides the storage for the request and for its iovecs, both
+   of which must stay valid until the request completes.  On
+   submission to a partition, SECTOR is translated to the
+   underlying device's numbering. */
+struct block_request
+  {
+    bool write;                         /* Write (true) or read (false)? */
+    block_sector_t sector;              /* First sector. */
+    const struct block_iovec *iov;      /* Buffers. */
+    size_t iov_cnt;                     /* Number of elements in IOV. */
+    block_done_func *done;              /* Called on completion, or null. */
+    void *aux;                          /* Passed to DONE. */
+
+    /* Owned by the block layer. */
+    struct list_elem elem;              /* Element in a device's queue. */
+    size_t sector_cnt;                  /* Number of sectors in IOV. */
+    int64_t deadline;                   /* Tick by which to dispatch. */
+    struct semaphore completed;         /* Up'd on completion. */
+    enum block_type type;               /* Type of device submitted to. */
+    int tid;                            /* Submitting thread's tid. */
+    char thread_name[16];               /* Submitting thread's name. */
+    uint64_t submit_tsc;                /* Time stamps, in CPU cycles. */
+    uint64_t dispatch_tsc;
+  };
+
+void block_request_init (struct block_request *, bool write, block_sector_t,
+                         const struct block_iovec *, size_t iov_cnt,
+                         block_done_func *, void *aux);
+void block_submit (struct block *, struct block_request *);
+void block_wait (struct block_request *);
+
+/* I/O schedulers. */
+bool block_configure_scheduler (const char *name);
+
+/* Statistics and tracing. */
+void block_configure_trace (size_t record_cnt);
 void block_print_stats (void);
+void block_dump_trace (void);
 
 /* Lower-level interface to block device drivers. */
 
+/* Most transfers that the block layer hands at once to a driver
+   that provides the START operation below. */
+#define BLOCK_TRANSFER_MAX 16
+
+/* A transfer of consecutive sectors, made up of one or more
+   merged requests, handed to a driver's START operation. */
+struct block_transfer
+  {
+    bool write;                         /* Write (true) or read (false)? */
+    block_sector_t sector;              /* First sector. */
+    size_t sector_cnt;                  /* Number of sectors. */
+    const struct block_iovec *iov;      /* Buffers. */
+    size_t iov_cnt;                     /* Number of elements in IOV. */
+  };
+
+/* Driver operations.  READ and WRITE are required, except for
+   devices that provide REMAP or START. */
 struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Optional.  Transfer the sectors described by an array of
+       IOV_CNT iovecs, starting at the given sector, as a single
+       request to the device.  If these are null, the block
+       layer falls back to one call to READ or WRITE per
+       sector. */
+    void (*readv) (void *aux, block_sector_t,
+                   const struct block_iovec *, size_t iov_cnt);
+    void (*writev) (void *aux, block_sector_t,
+                    const struct block_iovec *, size_t iov_cnt);
+
+    /* Optional.  For a device that is a window onto part of
+       another device, such as a partition, returns the other
+       device and translates *SECTOR into its numbering.
+       Requests are then queued on, and scheduled by, the other
+       device, and the operations above are not used. */
+    struct block *(*remap) (void *aux, block_sector_t *sector);
+
+    /* Optional.  For a device that can work on several requests
+       at once, starts the given transfer and returns without
+       waiting for it.  The driver calls block_complete() when
+       the transfer is done, typically from its interrupt
+       handler.  READ, WRITE, READV, and WRITEV are not used. */
+    void (*start) (void *aux, struct block_transfer *);
+
+    /* Optional.  Makes the writes that the device has
+       acknowledged durable, for a device that may hold them in
+       a volatile cache. */
+    void (*flush) (void *aux);
   };
 
+size_t block_iovec_sectors (const struct block_iovec *, size_t iov_cnt);
+
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
                               const struct block_operations *, void *aux);
+void block_complete (struct block_transfer *);
 
 #endif /* devices/block.h */
@@ -3,19 +3,34 @@
 #include <debug.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include "devices/block.h"
 #include "devices/partition.h"
+#include "devices/pci.h"
 #include "devices/timer.h"
 #include "kernel/io.h"
 #include "kernel/interrupt.h"
+#include "kernel/palloc.h"
 #include "kernel/synch.h"
+#include "kernel/vaddr.h"
+#include "kernel/vmalloc.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].
+
+   Data moves by bus-master DMA when the controller is a PCI IDE
+   controller that supports it, as the PIIX emulated by QEMU and
+   Bochs does: the driver hands the controller a table of the
+   physical memory regions to transfer, starts it, and sleeps
+   until the completion interrupt, leaving the CPU to other
+   threads.  Otherwise, or for buffers DMA cannot reach, the
+   driver falls back to programmed I/O, copying every word
+   through the data register itself. */
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
-#define reg_error(CHANNEL) ((CHANNEL)->reg_base + 1)    /* Error. */
+#define reg_error(CHANNEL) ((CHANNEL)->reg_base + 1)    /* Error (r/o). */
+#define reg_features(CHANNEL) reg_error (CHANNEL)       /* Features (w/o). */
 #define reg_nsect(CHANNEL) ((CHANNEL)->reg_base + 2)    /* Sector Count. */
 #define reg_lbal(CHANNEL) ((CHANNEL)->reg_base + 3)     /* LBA 0:7. */
 #define reg_lbam(CHANNEL) ((CHANNEL)->reg_base + 4)     /* LBA 15:8. */
@@ -34,10 +49,31 @@
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
 
+/* Bus master IDE register port addresses, as defined by the
+   "Programming Interface for Bus Master IDE Controller"
+   specification. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD table. */
+
+/* Bus master command register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_READ 0x08        /* Direction: 1=to memory, 0=from memory. */
+
+/* Bus master status register bits. */
+#define BM_STA_ERROR 0x02       /* Transfer failed (write 1 to clear). */
+#define BM_STA_INTR 0x04        /* Device interrupted (write 1 to clear). */
+
+/* PCI IDE programming interface bits. */
+#define PROG_IF_NATIVE0 0x01    /* Primary channel in native mode. */
+#define PROG_IF_NATIVE1 0x04    /* Secondary channel in native mode. */
+#define PROG_IF_BUS_MASTER 0x80 /* Supports bus mastering. */
+
 /* Device Register bits. */
 #define DEV_MBS 0xa0            /* Must be set. */
 #define DEV_LBA 0x40            /* Linear based addressing. */
@@ -49,6 +85,20 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+#define CMD_FLUSH_CACHE 0xe7            /* FLUSH CACHE. */
+#define CMD_SET_FEATURES 0xef           /* SET FEATURES. */
+
+/* SET FEATURES subcommands, written to the Features register. */
+#define FEAT_ENABLE_WRITE_CACHE 0x02    /* Enable volatile write cache. */
+
+/* Most sectors one command can transfer.  A sector count of 0
+   in the Sector Count register stands for this many. */
+#define MAX_SECTOR_CNT 256
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +107,31 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    unsigned multiple;          /* Sectors per interrupt for READ/WRITE
+                                   MULTIPLE, or 0 if not supported. */
+    bool dma;                   /* Transfer data by bus-master DMA? */
+    bool write_cache;           /* Write cache on?  If so, writes are
+                                   durable only after FLUSH CACHE. */
+  };
+
+/* A physical region descriptor, one entry in the table that
+   tells the bus master where to transfer data.  A region may
+   not cross a 64 kB boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address. */
+    uint16_t size;              /* Size in bytes, with 0 meaning 64 kB. */
+    uint16_t flags;             /* PRD_EOT in the table's last entry. */
+  };
+
+#define PRD_EOT 0x8000          /* End of table. */
+#define PRD_CNT (PGSIZE / sizeof (struct prd))  /* Entries per table. */
+
+/* A position within a scatter-gather list. */
+struct iovec_pos
+  {
+    const struct block_iovec *iov;      /* Current element. */
+    size_t sector;                      /* Sector within *IOV. */
   };
 
 /* An ATA channel (aka controller).
@@ -65,12 +140,14 @@ struct channel
   {
     char name[8];               /* Name, e.g. "ide0". */
     uint16_t reg_base;          /* Base I/O port. */
+    uint16_t bm_base;           /* Bus master base I/O port, or 0. */
     uint8_t irq;                /* Interrupt in use. */
 
     struct lock lock;           /* Must acquire to access the controller. */
     bool expecting_interrupt;   /* True if an interrupt is expected, false if
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
+    struct prd *prdt;           /* PRD table, if BM_BASE is nonzero. */
 
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
@@ -81,11 +158,27 @@ static struct channel channels[CHANNEL_CNT];
 
 static struct block_operations ide_operations;
 
+/* Use DMA if the controller supports it? */
+static bool dma_enabled = true;
+
+/* Turn on disks' write caches if they support it? */
+static bool write_cache_enabled = true;
+
+static uint16_t find_bus_master (void);
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
-
-static void select_sector (struct ata_disk *, block_sector_t);
+static void set_multiple_mode (struct ata_disk *, unsigned sector_cnt);
+static void enable_write_cache (struct ata_disk *);
+
+static void select_sectors (struct ata_disk *, block_sector_t, size_t cnt);
+static bool build_prdt (struct channel *, struct iovec_pos *, size_t cnt);
+static bool dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          bool read);
+static void pio_read (struct ata_disk *, block_sector_t, size_t cnt,
+                      struct iovec_pos *);
+static void pio_write (struct ata_disk *, block_sector_t, size_t cnt,
+                       struct iovec_pos *);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -97,10 +190,27 @@ static void select_device_wait (const struct ata_disk *);
 
 static void interrupt_handler (struct intr_frame *);
 
+/* Makes ide_init() use programmed I/O even if the controller
+   supports DMA. */
+void
+ide_disable_dma (void)
+{
+  dma_enabled = false;
+}
+
+/* Makes ide_init() leave disks' write caches off, so that every
+   write is durable once the disk acknowledges it. */
+void
+ide_disable_write_cache (void)
+{
+  write_cache_enabled = false;
+}
+
 /* Initialize the disk subsystem and detect disks. */
 void
 ide_init (void) 
 {
+  uint16_t bm_base = dma_enabled ? find_bus_master () : 0;
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
@@ -126,6 +236,16 @@ ide_init (void)
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+
+      /* Each channel has its own 8 bus master registers. */
+      c->bm_base = 0;
+      c->prdt = NULL;
+      if (bm_base != 0)
+        {
+          c->prdt = palloc_get_page (0);
+          if (c->prdt != NULL)
+            c->bm_base = bm_base + chan_no * 8;
+        }
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +256,9 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 0;
+          d->dma = false;
+          d->write_cache = false;
         }
 
       /* Register interrupt handler. */
@@ -157,6 +280,32 @@ ide_init (void)
 
 /* Disk detection and identification. */
 
+/* Looks for a PCI IDE controller that supports bus mastering
+   and drives both channels at the legacy ports, enables it as a
+   bus master, and returns its bus master base I/O port.  Returns
+   0 if there is no such controller. */
+static uint16_t
+find_bus_master (void)
+{
+  struct pci_device pci;
+  uint16_t base;
+
+  if (!pci_find_class (0x01, 0x01, &pci)
+      || !(pci.prog_if & PROG_IF_BUS_MASTER)
+      || (pci.prog_if & (PROG_IF_NATIVE0 | PROG_IF_NATIVE1)))
+    return 0;
+
+  /* The bus master registers are in I/O space at BAR 4. */
+  if (!(pci_read_config (&pci, PCI_REG_BAR0 + 4 * 4) & 1))
+    return 0;
+  base = pci_read_bar (&pci, 4);
+  if (base == 0)
+    return 0;
+
+  pci_enable_bus_master (&pci);
+  return base;
+}
+
 static char *descramble_ata_string (char *, int size);
 
 /* Resets an ATA channel and waits for any devices present on it
@@ -303,12 +452,70 @@ identify_ata_device (struct ata_disk *d)
       return;
     }
 
+  /* Transfer as many sectors per interrupt as the disk allows.
+     The low byte of word 47 is that maximum, or 0 if READ/WRITE
+     MULTIPLE are not supported. */
+  if ((*(uint16_t *) &id[47 * 2] & 0xff) != 0)
+    set_multiple_mode (d, *(uint16_t *) &id[47 * 2] & 0xff);
+
+  /* Use DMA if the channel has a bus master and bit 8 of word 49
+     says that the disk supports it. */
+  d->dma = c->bm_base != 0 && (*(uint16_t *) &id[49 * 2] & 0x100) != 0;
+  if (d->dma)
+    strlcat (extra_info, ", DMA", sizeof extra_info);
+
+  /* Let the disk acknowledge writes once they reach its cache,
+     if bit 5 of word 82 says that it has one and bit 12 of word
+     83 says that it supports FLUSH CACHE, which block_flush()
+     then relies on. */
+  if (write_cache_enabled
+      && (*(uint16_t *) &id[82 * 2] & 0x20) != 0
+      && (*(uint16_t *) &id[83 * 2] & 0x1000) != 0)
+    enable_write_cache (d);
+  if (d->write_cache)
+    strlcat (extra_info, ", write cache", sizeof extra_info);
+
   /* Register. */
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
                           &ide_operations, d);
   partition_scan (block);
 }
 
+/* Sends a SET MULTIPLE MODE command to disk D, so that READ
+   and WRITE MULTIPLE transfer SECTOR_CNT sectors per interrupt.
+   Sets D's multiple member to SECTOR_CNT if the disk accepts
+   that, and leaves it 0 otherwise. */
+static void
+set_multiple_mode (struct ata_disk *d, unsigned sector_cnt)
+{
+  struct channel *c = d->channel;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), sector_cnt);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if ((inb (reg_alt_status (c)) & STA_ERR) == 0)
+    d->multiple = sector_cnt;
+}
+
+/* Sends a SET FEATURES command to disk D to enable its volatile
+   write cache.  Sets D's write_cache member to true if the disk
+   accepts that, and leaves it false otherwise. */
+static void
+enable_write_cache (struct ata_disk *d)
+{
+  struct channel *c = d->channel;
+
+  select_device_wait (d);
+  outb (reg_features (c), FEAT_ENABLE_WRITE_CACHE);
+  issue_pio_command (c, CMD_SET_FEATURES);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if ((inb (reg_alt_status (c)) & STA_ERR) == 0)
+    d->write_cache = true;
+}
+
 /* Translates STRING, which consists of SIZE bytes in a funky
    format, into a null-terminated string in-place.  Drops
    trailing whitespace and null bytes.  Returns STRING.  */
@@ -337,63 +544,148 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
+/* Returns the buffer for the sector at POS and advances POS to
+   the following sector. */
+static uint8_t *
+next_sector (struct iovec_pos *pos)
+{
+  while (pos->sector >= pos->iov->sector_cnt)
+    {
+      pos->iov++;
+      pos->sector = 0;
+    }
+  return (uint8_t *) pos->iov->buffer + pos->sector++ * BLOCK_SECTOR_SIZE;
+}
+
+/* Reads consecutive sectors, starting at SEC_NO, from disk D
+   into the IOV_CNT buffers described by IOV.  Each command
+   transfers up to MAX_SECTOR_CNT sectors, by DMA if possible.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_readv (void *d_, block_sector_t sec_no,
+           const struct block_iovec *iov, size_t iov_cnt)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  size_t cnt = block_iovec_sectors (iov, iov_cnt);
+  struct iovec_pos pos = { iov, 0 };
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
+  while (cnt > 0)
+    {
+      size_t cmd_cnt = cnt < MAX_SECTOR_CNT ? cnt : MAX_SECTOR_CNT;
+
+      if (d->dma && build_prdt (c, &pos, cmd_cnt))
+        {
+          if (!dma_transfer (d, sec_no, cmd_cnt, true))
+            PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
+        }
+      else
+        pio_read (d, sec_no, cmd_cnt, &pos);
+      sec_no += cmd_cnt;
+      cnt -= cmd_cnt;
+    }
   lock_release (&c->lock);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
+/* Writes consecutive sectors, starting at SEC_NO, to disk D from
+   the IOV_CNT buffers described by IOV, in the same way as
+   ide_readv().  Returns after the disk has acknowledged
+   receiving the data.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+ide_writev (void *d_, block_sector_t sec_no,
+            const struct block_iovec *iov, size_t iov_cnt)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  size_t cnt = block_iovec_sectors (iov, iov_cnt);
+  struct iovec_pos pos = { iov, 0 };
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
+  while (cnt > 0)
+    {
+      size_t cmd_cnt = cnt < MAX_SECTOR_CNT ? cnt : MAX_SECTOR_CNT;
+
+      if (d->dma && build_prdt (c, &pos, cmd_cnt))
+        {
+          if (!dma_transfer (d, sec_no, cmd_cnt, false))
+            PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
+        }
+      else
+        pio_write (d, sec_no, cmd_cnt, &pos);
+      sec_no += cmd_cnt;
+      cnt -= cmd_cnt;
+    }
+  lock_release (&c->lock);
+}
+
+/* Reads sector SEC_NO from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes. */
+static void
+ide_read (void *d, block_sector_t sec_no, void *buffer)
+{
+  struct block_iovec iov = { buffer, 1 };
+  ide_readv (d, sec_no, &iov, 1);
+}
+
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
+   acknowledged receiving the data. */
+static void
+ide_write (void *d, block_sector_t sec_no, const void *buffer)
+{
+  struct block_iovec iov = { (void *) buffer, 1 };
+  ide_writev (d, sec_no, &iov, 1);
+}
+
+/* Writes disk D_'s write cache, if it is on, to the media. */
+static void
+ide_flush (void *d_)
+{
+  struct ata_disk *d = d_;
+  struct channel *c = d->channel;
+
+  if (!d->write_cache)
+    return;
+
+  lock_acquire (&c->lock);
+  select_device_wait (d);
+  issue_pio_command (c, CMD_FLUSH_CACHE);
   sema_down (&c->completion_wait);
+  if (!wait_while_busy (d)
+      || (inb (reg_alt_status (c)) & STA_ERR) != 0)
+    PANIC ("%s: cache flush failed", d->name);
   lock_release (&c->lock);
 }
 
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_readv,
+    ide_writev,
+    NULL,
+    NULL,
+    ide_flush
   };
-
+
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
+   writes SEC_NO and CNT, which must be between 1 and
+   MAX_SECTOR_CNT, to the disk's sector selection registers.  (We
    use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sectors (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt >= 1 && cnt <= MAX_SECTOR_CNT);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt == MAX_SECTOR_CNT ? 0 : cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -401,6 +693,162 @@ select_sector (struct ata_disk *d, block_sector_t sec_no)
         DEV_MBS | DEV_LBA | (d->dev_no == 1 ? DEV_DEV : 0) | (sec_no >> 24));
 }
 
+/* Returns the physical address of kernel virtual address
+   VADDR. */
+static uintptr_t
+buffer_to_phys (const void *vaddr)
+{
+  return is_vmalloc_vaddr (vaddr) ? vmalloc_vtop (vaddr) : vtop (vaddr);
+}
+
+/* Fills in channel C's PRD table with the physical regions of
+   the CNT sectors that start at *POS, and advances *POS past
+   them.  Returns true if successful.  Returns false, leaving
+   *POS unchanged, if the buffers cannot be used for DMA because
+   one is not word-aligned or they are too fragmented for the
+   table. */
+static bool
+build_prdt (struct channel *c, struct iovec_pos *pos, size_t cnt)
+{
+  struct iovec_pos p = *pos;
+  struct prd *prd = NULL;
+  size_t region_size = 0;
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    {
+      const uint8_t *buffer = next_sector (&p);
+      size_t ofs = 0;
+
+      if ((uintptr_t) buffer % 2 != 0)
+        return false;
+
+      /* A sector may span two pages, which need not be adjacent
+         in physical memory.  Extend the current region while
+         memory stays contiguous and short of a 64 kB
+         boundary. */
+      while (ofs < BLOCK_SECTOR_SIZE)
+        {
+          uintptr_t phys = buffer_to_phys (buffer + ofs);
+          size_t chunk = PGSIZE - pg_ofs (buffer + ofs);
+          if (chunk > BLOCK_SECTOR_SIZE - ofs)
+            chunk = BLOCK_SECTOR_SIZE - ofs;
+
+          if (prd != NULL && prd->addr + region_size == phys
+              && phys % 0x10000 != 0)
+            region_size += chunk;
+          else
+            {
+              prd = prd == NULL ? c->prdt : prd + 1;
+              if (prd >= c->prdt + PRD_CNT)
+                return false;
+              prd->addr = phys;
+              prd->flags = 0;
+              region_size = chunk;
+            }
+          prd->size = region_size;      /* 64 kB wraps to 0. */
+          ofs += chunk;
+        }
+    }
+  prd->flags = PRD_EOT;
+  *pos = p;
+  return true;
+}
+
+/* Transfers the CNT sectors starting at SEC_NO between disk D
+   and the regions in its channel's PRD table by DMA, reading
+   from the disk if READ is true and writing to it otherwise.
+   Sleeps until the transfer completes.  Returns true if
+   successful, false on error.  The channel's lock must be
+   held. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              bool read)
+{
+  struct channel *c = d->channel;
+  uint8_t direction = read ? BM_CMD_READ : 0;
+  uint8_t bm_status;
+
+  ASSERT (lock_held_by_current_thread (&c->lock));
+
+  outl (reg_bm_prdt (c), vtop (c->prdt));
+  outb (reg_bm_command (c), direction);
+  outb (reg_bm_status (c), BM_STA_ERROR | BM_STA_INTR);
+
+  select_sectors (d, sec_no, cnt);
+  issue_pio_command (c, read ? CMD_READ_DMA : CMD_WRITE_DMA);
+  outb (reg_bm_command (c), direction | BM_CMD_START);
+  sema_down (&c->completion_wait);
+  outb (reg_bm_command (c), direction);
+
+  bm_status = inb (reg_bm_status (c));
+  outb (reg_bm_status (c), BM_STA_ERROR | BM_STA_INTR);
+  return ((bm_status & BM_STA_ERROR) == 0
+          && (inb (reg_alt_status (c)) & STA_ERR) == 0);
+}
+
+/* Reads the CNT sectors starting at SEC_NO from disk D by
+   programmed I/O into the buffers at *POS, advancing *POS past
+   them.  Takes one interrupt per D->multiple sectors if the disk
+   supports READ MULTIPLE or per sector otherwise.  The channel's
+   lock must be held. */
+static void
+pio_read (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+          struct iovec_pos *pos)
+{
+  struct channel *c = d->channel;
+  size_t per_intr = d->multiple != 0 ? d->multiple : 1;
+  size_t i;
+
+  select_sectors (d, sec_no, cnt);
+  issue_pio_command (c, (d->multiple != 0
+                         ? CMD_READ_MULTIPLE : CMD_READ_SECTOR_RETRY));
+  for (i = 0; i < cnt; i++)
+    {
+      if (i % per_intr == 0)
+        {
+          sema_down (&c->completion_wait);
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk read failed, sector=%"PRDSNu,
+                   d->name, sec_no + i);
+        }
+      input_sector (c, next_sector (pos));
+    }
+}
+
+/* Writes the CNT sectors starting at SEC_NO to disk D by
+   programmed I/O from the buffers at *POS, advancing *POS past
+   them, in the same way as pio_read().  Returns after the disk
+   has acknowledged receiving the data.  The channel's lock must
+   be held. */
+static void
+pio_write (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+           struct iovec_pos *pos)
+{
+  struct channel *c = d->channel;
+  size_t per_intr = d->multiple != 0 ? d->multiple : 1;
+  size_t i;
+
+  select_sectors (d, sec_no, cnt);
+  issue_pio_command (c, (d->multiple != 0
+                         ? CMD_WRITE_MULTIPLE : CMD_WRITE_SECTOR_RETRY));
+  for (i = 0; i < cnt; i++)
+    {
+      if (i % per_intr == 0)
+        {
+          /* The disk interrupts after each block but the last
+             when it is ready for the next one. */
+          if (i > 0)
+            sema_down (&c->completion_wait);
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk write failed, sector=%"PRDSNu,
+                   d->name, sec_no + i);
+        }
+      output_sector (c, next_sector (pos));
+    }
+  sema_down (&c->completion_wait);
+}
+
 /* Writes COMMAND to channel C and prepares for receiving a
    completion interrupt. */
 static void
@@ -1,6 +1,8 @@
 #ifndef DEVICES_IDE_H
 #define DEVICES_IDE_H
 
+void ide_disable_dma (void);
+void ide_disable_write_cache (void);
 void ide_init (void);
 
 #endif /* devices/ide.h */
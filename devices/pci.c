@@ -0,0 +1,192 @@
+#include "devices/pci.h"
+#include <debug.h>
+#include "kernel/io.h"
+
+/* The code in this file reads and writes PCI configuration
+   space through configuration mechanism #1, the pair of I/O
+   ports that every PC chipset since the original PCI ones
+   provides, as described in section 3.2.2.3.2 of the PCI Local
+   Bus Specification. */
+
+/* Configuration mechanism #1 ports. */
+#define CONFIG_ADDRESS 0xcf8    /* Selects bus, device, function, register. */
+#define CONFIG_DATA 0xcfc       /* Reads or writes the selected register. */
+
+/* CONFIG_ADDRESS enable bit. */
+#define CONFIG_ENABLE 0x80000000
+
+/* Limits on PCI addresses. */
+#define BUS_CNT 256
+#define DEV_CNT 32
+#define FUNC_CNT 8
+
+/* A vendor ID that no device has, read back from absent
+   functions. */
+#define NO_VENDOR 0xffff
+
+/* Header type bit: the device has more than one function. */
+#define HEADER_MULTIFUNCTION 0x80
+
+static void select_register (uint8_t bus, uint8_t dev, uint8_t func,
+                             uint8_t reg);
+static uint32_t read_config (uint8_t bus, uint8_t dev, uint8_t func,
+                             uint8_t reg);
+static struct pci_device *scan (struct pci_device *, int bus, int dev,
+                                int func);
+
+/* Searches the PCI bus for the first function whose base class
+   and subclass are CLASS and SUBCLASS.  If one is found, stores
+   it into *D and returns true.  Otherwise, returns false. */
+bool
+pci_find_class (uint8_t class, uint8_t subclass, struct pci_device *d)
+{
+  struct pci_device *p;
+
+  for (p = pci_first (d); p != NULL; p = pci_next (p))
+    if (p->class == class && p->subclass == subclass)
+      return true;
+  return false;
+}
+
+/* Searches the PCI bus for the function numbered INDEX, counting
+   from 0 in bus order, among those whose vendor and device IDs
+   are VENDOR_ID and DEVICE_ID.  If one is found, stores it into
+   *D and returns true.  Otherwise, returns false. */
+bool
+pci_find_device (uint16_t vendor_id, uint16_t device_id, int index,
+                 struct pci_device *d)
+{
+  struct pci_device *p;
+
+  for (p = pci_first (d); p != NULL; p = pci_next (p))
+    if (p->vendor_id == vendor_id && p->device_id == device_id
+        && index-- == 0)
+      return true;
+  return false;
+}
+
+/* Stores the first function on the PCI bus into *D and returns
+   D, or returns a null pointer if there are no PCI devices. */
+struct pci_device *
+pci_first (struct pci_device *d)
+{
+  return scan (d, 0, 0, 0);
+}
+
+/* Stores the function that follows *D on the PCI bus into *D and
+   returns D, or returns a null pointer if *D is the last
+   one. */
+struct pci_device *
+pci_next (struct pci_device *d)
+{
+  if (d->func + 1 < FUNC_CNT
+      && (d->func > 0
+          || (read_config (d->bus, d->dev, 0, PCI_REG_HEADER) >> 16)
+             & HEADER_MULTIFUNCTION))
+    return scan (d, d->bus, d->dev, d->func + 1);
+  else if (d->dev + 1 < DEV_CNT)
+    return scan (d, d->bus, d->dev + 1, 0);
+  else
+    return scan (d, d->bus + 1, 0, 0);
+}
+
+/* Returns the 32-bit configuration register at offset REG, which
+   must be a multiple of 4, in D's configuration space. */
+uint32_t
+pci_read_config (const struct pci_device *d, uint8_t reg)
+{
+  return read_config (d->bus, d->dev, d->func, reg);
+}
+
+/* Writes VALUE to the 32-bit configuration register at offset
+   REG, which must be a multiple of 4, in D's configuration
+   space. */
+void
+pci_write_config (const struct pci_device *d, uint8_t reg, uint32_t value)
+{
+  select_register (d->bus, d->dev, d->func, reg);
+  outl (CONFIG_DATA, value);
+}
+
+/* Returns the base address in D's base address register BAR,
+   numbered 0 through 5, with the flag bits masked off.  For an
+   I/O space BAR this is a port number, for a memory space BAR a
+   physical address. */
+uint32_t
+pci_read_bar (const struct pci_device *d, int bar)
+{
+  uint32_t value;
+
+  ASSERT (bar >= 0 && bar < 6);
+  value = pci_read_config (d, PCI_REG_BAR0 + bar * 4);
+  return value & (value & 1 ? ~0x3u : ~0xfu);
+}
+
+/* Allows D to master the bus, as it must to do DMA. */
+void
+pci_enable_bus_master (const struct pci_device *d)
+{
+  uint32_t command = pci_read_config (d, PCI_REG_COMMAND);
+
+  /* Writing the status half back unchanged is harmless: its bits
+     are read-only or cleared by writing 1, and we keep them 0. */
+  command &= 0xffff;
+  pci_write_config (d, PCI_REG_COMMAND, command | PCI_CMD_MASTER);
+}
+
+/* Points CONFIG_DATA at the 32-bit configuration register at
+   offset REG, which must be a multiple of 4, in the
+   configuration space of function FUNC of device DEV on BUS. */
+static void
+select_register (uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg)
+{
+  ASSERT (reg % 4 == 0);
+  outl (CONFIG_ADDRESS, (CONFIG_ENABLE | ((uint32_t) bus << 16)
+                         | (dev << 11) | (func << 8) | reg));
+}
+
+/* Returns the 32-bit configuration register at offset REG in the
+   configuration space of function FUNC of device DEV on BUS. */
+static uint32_t
+read_config (uint8_t bus, uint8_t dev, uint8_t func, uint8_t reg)
+{
+  select_register (bus, dev, func, reg);
+  return inl (CONFIG_DATA);
+}
+
+/* Searches the PCI bus, starting at function FUNC of device DEV
+   on BUS, for a function that is present.  If one is found,
+   stores it into *D and returns D.  Otherwise, returns a null
+   pointer. */
+static struct pci_device *
+scan (struct pci_device *d, int bus, int dev, int func)
+{
+  for (; bus < BUS_CNT; bus++, dev = 0)
+    for (; dev < DEV_CNT; dev++, func = 0)
+      for (; func < FUNC_CNT; func++)
+        {
+          uint32_t id = read_config (bus, dev, func, PCI_REG_ID);
+          uint32_t class_reg;
+
+          if ((id & 0xffff) != NO_VENDOR)
+            {
+              class_reg = read_config (bus, dev, func, PCI_REG_CLASS);
+              d->bus = bus;
+              d->dev = dev;
+              d->func = func;
+              d->vendor_id = id & 0xffff;
+              d->device_id = id >> 16;
+              d->class = class_reg >> 24;
+              d->subclass = (class_reg >> 16) & 0xff;
+              d->prog_if = (class_reg >> 8) & 0xff;
+              return d;
+            }
+
+          /* Function 0 missing means no device at all.  Single-
+             function devices do not decode the function number,
+             so they would show up eight times. */
+          if (func == 0)
+            break;
+        }
+  return NULL;
+}
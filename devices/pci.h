@@ -0,0 +1,44 @@
+#ifndef DEVICES_PCI_H
+#define DEVICES_PCI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A function of a device on the PCI bus. */
+struct pci_device
+  {
+    uint8_t bus;                /* Bus number. */
+    uint8_t dev;                /* Device number on the bus. */
+    uint8_t func;               /* Function number within the device. */
+    uint16_t vendor_id;         /* Vendor ID. */
+    uint16_t device_id;         /* Device ID. */
+    uint8_t class;              /* Base class code. */
+    uint8_t subclass;           /* Subclass code. */
+    uint8_t prog_if;            /* Programming interface. */
+  };
+
+/* Offsets of configuration space registers common to all
+   devices. */
+#define PCI_REG_ID 0x00         /* Vendor ID (low), device ID (high). */
+#define PCI_REG_COMMAND 0x04    /* Command (low), status (high). */
+#define PCI_REG_CLASS 0x08      /* Revision, prog. interface, subclass, class. */
+#define PCI_REG_HEADER 0x0c     /* Header type in bits 16...23. */
+#define PCI_REG_BAR0 0x10       /* Base address registers 0...5. */
+#define PCI_REG_IRQ 0x3c        /* Interrupt line (low byte). */
+
+/* Command register bits. */
+#define PCI_CMD_IO 0x0001       /* Respond to I/O space accesses. */
+#define PCI_CMD_MEMORY 0x0002   /* Respond to memory space accesses. */
+#define PCI_CMD_MASTER 0x0004   /* May act as a bus master. */
+
+struct pci_device *pci_first (struct pci_device *);
+struct pci_device *pci_next (struct pci_device *);
+bool pci_find_class (uint8_t class, uint8_t subclass, struct pci_device *);
+bool pci_find_device (uint16_t vendor_id, uint16_t device_id, int index,
+                      struct pci_device *);
+uint32_t pci_read_config (const struct pci_device *, uint8_t reg);
+void pci_write_config (const struct pci_device *, uint8_t reg, uint32_t);
+uint32_t pci_read_bar (const struct pci_device *, int bar);
+void pci_enable_bus_master (const struct pci_device *);
+
+#endif /* devices/pci.h */
@@ -0,0 +1,228 @@
+#include "devices/ramdisk.h"
+#include <ctype.h>
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/block.h"
+#include "filesys/cache.h"
+#include "kernel/vaddr.h"
+#include "kernel/vmalloc.h"
+
+/* A RAM disk is a block device whose sectors are kept in kernel
+   memory, allocated with vmalloc() when the disk is registered.
+   Its contents do not survive a reboot, so a file system on one
+   must be formatted with -f, but transfers are just memcpy()
+   calls, which makes RAM disks useful for measuring the file
+   system and virtual memory code without disk noise.
+
+   Each "-ramdisk=[ROLE:]KB" option creates a RAM disk of KB
+   kilobytes.  If ROLE is "filesys", "scratch", or "swap", the
+   disk is given that type and, because RAM disks are registered
+   ahead of the IDE disks, it becomes the default device for the
+   role.  Otherwise it is a raw device, which -filesys, -scratch,
+   or -swap may name explicitly (ram0, ram1, ...).
+
+   RAM disks share the vmalloc range, and the kernel pool behind
+   it, with the buffer cache and other later users, so they may
+   not take all of either: RESERVE_KB of address space is never
+   given to RAM disks, and ramdisk_init() makes sure that as much
+   memory is still free after it allocates them. */
+
+/* Maximum number of RAM disks. */
+#define RAMDISK_MAX 4
+
+/* Kilobytes of vmalloc space and memory kept for other users:
+   the largest buffer cache plus room for the journal and large
+   malloc() blocks. */
+#define RESERVE_KB (CACHE_MAX_SECTORS * BLOCK_SECTOR_SIZE / 1024 + 512)
+
+/* A RAM disk. */
+struct ramdisk
+  {
+    enum block_type type;       /* Type to register as. */
+    block_sector_t size;        /* Size in sectors. */
+    uint8_t *data;              /* BLOCK_SECTOR_SIZE * SIZE bytes. */
+  };
+
+/* RAM disks configured on the command line. */
+static struct ramdisk ramdisks[RAMDISK_MAX];
+static size_t ramdisk_cnt;
+static size_t total_kb;         /* Total size, including guard pages. */
+
+static size_t max_kb (void);
+static block_sector_t parse_size (const char *);
+static struct block_operations ramdisk_operations;
+
+/* Adds a RAM disk described by SPEC, of the form "[ROLE:]KB",
+   to those that ramdisk_init() will create.  Returns false if
+   SPEC is malformed or there are already too many RAM disks.
+   Panics if the RAM disks would not fit in the vmalloc range. */
+bool
+ramdisk_configure (const char *spec)
+{
+  struct ramdisk *rd;
+  const char *colon;
+
+  if (spec == NULL || ramdisk_cnt >= RAMDISK_MAX)
+    return false;
+  rd = &ramdisks[ramdisk_cnt];
+
+  rd->type = BLOCK_RAW;
+  colon = strchr (spec, ':');
+  if (colon != NULL)
+    {
+      size_t len = colon - spec;
+      enum block_type role;
+
+      for (role = BLOCK_FILESYS; role < BLOCK_ROLE_CNT; role++)
+        {
+          const char *name = block_type_name (role);
+          if (strlen (name) == len && !memcmp (name, spec, len))
+            break;
+        }
+      if (role >= BLOCK_ROLE_CNT)
+        return false;
+      rd->type = role;
+      spec = colon + 1;
+    }
+
+  rd->size = parse_size (spec);
+  if (rd->size == 0)
+    return false;
+  total_kb += rd->size / (1024 / BLOCK_SECTOR_SIZE) + PGSIZE / 1024;
+  if (total_kb > max_kb ())
+    PANIC ("RAM disks may total at most %zu kB", max_kb ());
+
+  ramdisk_cnt++;
+  return true;
+}
+
+/* Allocates and registers the RAM disks configured with
+   ramdisk_configure().  Panics if there is not enough memory for
+   them and the RESERVE_KB that must remain free. */
+void
+ramdisk_init (void)
+{
+  void *reserve;
+  size_t i;
+
+  if (ramdisk_cnt == 0)
+    return;
+
+  /* Hold RESERVE_KB of memory while allocating the disks, so that
+     they cannot take it. */
+  reserve = vmalloc (RESERVE_KB * 1024);
+  if (reserve == NULL)
+    PANIC ("not enough memory for RAM disks");
+
+  for (i = 0; i < ramdisk_cnt; i++)
+    {
+      struct ramdisk *rd = &ramdisks[i];
+      size_t bytes = (size_t) rd->size * BLOCK_SECTOR_SIZE;
+      char name[16];
+
+      rd->data = vmalloc (bytes);
+      if (rd->data == NULL)
+        PANIC ("ram%zu: not enough memory for %zu kB RAM disk",
+               i, bytes / 1024);
+      memset (rd->data, 0, bytes);
+
+      snprintf (name, sizeof name, "ram%zu", i);
+      block_register (name, rd->type, "RAM disk", rd->size,
+                      &ramdisk_operations, rd);
+    }
+  vfree (reserve);
+}
+
+/* Returns the number of kilobytes of the vmalloc range that RAM
+   disks may use in total. */
+static size_t
+max_kb (void)
+{
+  return ((uintptr_t) VMALLOC_END - (uintptr_t) VMALLOC_START) / 1024
+         - RESERVE_KB;
+}
+
+/* Returns the number of sectors in S, a size in kilobytes, or 0
+   if S is not a positive number small enough to allocate. */
+static block_sector_t
+parse_size (const char *s)
+{
+  size_t kb = 0;
+
+  if (*s == '\0')
+    return 0;
+  for (; *s != '\0'; s++)
+    {
+      if (!isdigit (*s))
+        return 0;
+      kb = kb * 10 + (*s - '0');
+      if (kb > max_kb ())
+        return 0;
+    }
+  return kb * (1024 / BLOCK_SECTOR_SIZE);
+}
+
+/* Returns the address of SECTOR on RD's disk. */
+static uint8_t *
+sector_data (struct ramdisk *rd, block_sector_t sector)
+{
+  return rd->data + (size_t) sector * BLOCK_SECTOR_SIZE;
+}
+
+/* Reads sector SEC_NO from RAM disk RD_ into BUFFER. */
+static void
+ramdisk_read (void *rd_, block_sector_t sec_no, void *buffer)
+{
+  memcpy (buffer, sector_data (rd_, sec_no), BLOCK_SECTOR_SIZE);
+}
+
+/* Writes BUFFER into sector SEC_NO of RAM disk RD_. */
+static void
+ramdisk_write (void *rd_, block_sector_t sec_no, const void *buffer)
+{
+  memcpy (sector_data (rd_, sec_no), buffer, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads consecutive sectors starting at SEC_NO from RAM disk RD_
+   into the IOV_CNT buffers in IOV. */
+static void
+ramdisk_readv (void *rd_, block_sector_t sec_no,
+               const struct block_iovec *iov, size_t iov_cnt)
+{
+  size_t i;
+
+  for (i = 0; i < iov_cnt; i++)
+    {
+      memcpy (iov[i].buffer, sector_data (rd_, sec_no),
+              iov[i].sector_cnt * BLOCK_SECTOR_SIZE);
+      sec_no += iov[i].sector_cnt;
+    }
+}
+
+/* Writes the IOV_CNT buffers in IOV into consecutive sectors of
+   RAM disk RD_, starting at SEC_NO. */
+static void
+ramdisk_writev (void *rd_, block_sector_t sec_no,
+                const struct block_iovec *iov, size_t iov_cnt)
+{
+  size_t i;
+
+  for (i = 0; i < iov_cnt; i++)
+    {
+      memcpy (sector_data (rd_, sec_no), iov[i].buffer,
+              iov[i].sector_cnt * BLOCK_SECTOR_SIZE);
+      sec_no += iov[i].sector_cnt;
+    }
+}
+
+static struct block_operations ramdisk_operations =
+  {
+    ramdisk_read,
+    ramdisk_write,
+    ramdisk_readv,
+    ramdisk_writev,
+    NULL,
+    NULL,
+    NULL
+  };
@@ -5,11 +5,20 @@
 #include "devices/serial.h"
 #include "devices/timer.h"
 #include "kernel/io.h"
+#include "kernel/malloc.h"
+#include "kernel/palloc.h"
+#include "kernel/slab.h"
 #include "kernel/thread.h"
+#include "kernel/vmalloc.h"
 #include "kernel/exception.h"
 #ifdef FILESYS
 #include "devices/block.h"
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "filesys/inode.h"
+#include "filesys/journal.h"
 #endif
 
 /* Keyboard control register port. */
@@ -118,8 +127,18 @@ print_stats (void)
 {
   timer_print_stats ();
   thread_print_stats ();
+  palloc_print_stats ();
+  malloc_print_stats ();
+  kmem_print_stats ();
+  vmalloc_print_stats ();
 #ifdef FILESYS
   block_print_stats ();
+  block_dump_trace ();
+  cache_print_stats ();
+  dcache_print_stats ();
+  inode_print_stats ();
+  free_map_print_stats ();
+  journal_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
@@ -0,0 +1,410 @@
+#include "devices/virtio-blk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "devices/block.h"
+#include "devices/partition.h"
+#include "devices/pci.h"
+#include "kernel/interrupt.h"
+#include "kernel/io.h"
+#include "kernel/palloc.h"
+#include "kernel/synch.h"
+#include "kernel/vaddr.h"
+#include "kernel/vmalloc.h"
+
+/* The code in this file drives virtio block devices, such as
+   QEMU provides with "-drive if=virtio", through the legacy PCI
+   interface described in section 4.1.4.8 of the Virtio 1.0
+   specification, which is the one that transitional devices
+   offer by default.
+
+   The driver and the device share a "virtqueue" in memory: the
+   driver describes each request by a chain of descriptors, each
+   naming a physical memory region, and puts the head of the
+   chain in the "available" ring; the device carries requests
+   out in any order, DMAing the data, and puts each finished
+   chain's head in the "used" ring, raising an interrupt.  Unlike
+   an IDE disk, then, the device can work on many requests at
+   once, so the driver provides the block layer's "start"
+   operation and completes transfers from its interrupt
+   handler.
+
+   Each transfer occupies one of BLOCK_TRANSFER_MAX slots, which
+   hold the request header, the status byte written back by the
+   device, and an "indirect" table of descriptors for the
+   header, the data, and the status.  The virtqueue's own
+   descriptor I points to slot I's table, so every transfer
+   takes exactly one descriptor in the queue no matter how
+   fragmented its buffers are. */
+
+/* PCI IDs of a transitional virtio block device. */
+#define VIRTIO_VENDOR_ID 0x1af4
+#define VIRTIO_BLK_DEVICE_ID 0x1001
+
+/* Legacy virtio I/O port addresses. */
+#define reg_device_features(D) ((D)->io_base + 0x00) /* Offered features. */
+#define reg_guest_features(D) ((D)->io_base + 0x04)  /* Accepted features. */
+#define reg_queue_pfn(D) ((D)->io_base + 0x08)       /* Queue page number. */
+#define reg_queue_size(D) ((D)->io_base + 0x0c)      /* Queue size (r/o). */
+#define reg_queue_select(D) ((D)->io_base + 0x0e)    /* Selects a queue. */
+#define reg_queue_notify(D) ((D)->io_base + 0x10)    /* Kicks a queue. */
+#define reg_status(D) ((D)->io_base + 0x12)          /* Device status. */
+#define reg_isr(D) ((D)->io_base + 0x13)             /* ISR status. */
+#define reg_capacity(D) ((D)->io_base + 0x14)        /* Sectors, 64 bits. */
+
+/* Device status bits. */
+#define STATUS_ACKNOWLEDGE 0x01 /* Guest has noticed the device. */
+#define STATUS_DRIVER 0x02      /* Guest knows how to drive it. */
+#define STATUS_DRIVER_OK 0x04   /* Driver is ready. */
+#define STATUS_FAILED 0x80      /* Guest has given up on the device. */
+
+/* ISR status bits. */
+#define ISR_QUEUE 0x01          /* A used ring has new entries. */
+
+/* Feature bits. */
+#define F_INDIRECT_DESC 0x10000000  /* Indirect descriptor tables. */
+
+/* Descriptor flags. */
+#define DESC_NEXT 0x01          /* NEXT is valid. */
+#define DESC_WRITE 0x02         /* Device writes, rather than reads. */
+#define DESC_INDIRECT 0x04      /* Region is a table of descriptors. */
+
+/* Request types and status. */
+#define REQ_IN 0                /* Read. */
+#define REQ_OUT 1               /* Write. */
+#define REQ_OK 0                /* Success. */
+
+/* Descriptors in each slot's indirect table, chosen so that a
+   slot fits in half a page. */
+#define INDIRECT_CNT 126
+
+/* Most virtio block devices. */
+#define DISK_CNT 4
+
+/* A virtqueue descriptor. */
+struct desc
+  {
+    uint64_t addr;              /* Physical address. */
+    uint32_t len;               /* Length in bytes. */
+    uint16_t flags;             /* DESC_* flags. */
+    uint16_t next;              /* Next descriptor, if DESC_NEXT. */
+  };
+
+/* The available ring, written by the driver. */
+struct avail
+  {
+    uint16_t flags;
+    uint16_t idx;               /* Where the next entry will go. */
+    uint16_t ring[];            /* Heads of descriptor chains. */
+  };
+
+/* The used ring, written by the device. */
+struct used_elem
+  {
+    uint32_t id;                /* Head of descriptor chain. */
+    uint32_t len;               /* Bytes written into the chain. */
+  };
+
+struct used
+  {
+    uint16_t flags;
+    uint16_t idx;               /* Where the next entry will go. */
+    struct used_elem ring[];
+  };
+
+/* Header at the start of each request. */
+struct req_header
+  {
+    uint32_t type;              /* REQ_IN or REQ_OUT. */
+    uint32_t reserved;
+    uint64_t sector;            /* First sector. */
+  };
+
+/* A transfer slot.  Its physical address is given to the
+   device, so it must be in physically contiguous memory. */
+struct slot
+  {
+    struct desc table[INDIRECT_CNT]; /* Indirect descriptor table. */
+    struct req_header header;        /* Request header. */
+    uint8_t status;                  /* Status, written by device. */
+    struct block_transfer *transfer; /* Transfer, or null if free. */
+  }
+__attribute__ ((aligned (16)));
+
+/* A virtio block device. */
+struct vblk
+  {
+    char name[8];               /* Name, e.g. "vda". */
+    uint16_t io_base;           /* Base I/O port. */
+    uint8_t irq;                /* Interrupt line. */
+    struct block *block;        /* Block device. */
+
+    /* Virtqueue. */
+    uint16_t queue_size;        /* Number of descriptors. */
+    struct desc *desc;          /* Descriptor table. */
+    struct avail *avail;        /* Available ring. */
+    volatile struct used *used; /* Used ring. */
+    uint16_t used_idx;          /* Next used ring entry to examine. */
+
+    struct slot *slots;         /* BLOCK_TRANSFER_MAX transfer slots. */
+  };
+
+static struct vblk disks[DISK_CNT];
+static size_t disk_cnt;
+
+static bool init_disk (struct vblk *, const struct pci_device *);
+static size_t add_buffer (struct slot *, size_t n, uint8_t *buffer,
+                          size_t size, uint16_t flags);
+static uintptr_t buffer_to_phys (const void *);
+static intr_handler_func interrupt_handler;
+static struct block_operations vblk_operations;
+
+/* Finds the virtio block devices on the PCI bus, sets them up,
+   and registers them as block devices. */
+void
+virtio_blk_init (void)
+{
+  bool irq_registered[16] = { false };
+  struct pci_device pci;
+  size_t i;
+
+  for (i = 0; disk_cnt < DISK_CNT
+         && pci_find_device (VIRTIO_VENDOR_ID, VIRTIO_BLK_DEVICE_ID, i, &pci);
+       i++)
+    {
+      struct vblk *d = &disks[disk_cnt];
+      snprintf (d->name, sizeof d->name, "vd%c", 'a' + (int) disk_cnt);
+      if (init_disk (d, &pci))
+        disk_cnt++;
+    }
+
+  /* PCI devices may share an interrupt line, so register one
+     handler per line. */
+  for (i = 0; i < disk_cnt; i++)
+    if (!irq_registered[disks[i].irq])
+      {
+        intr_register_ext (0x20 + disks[i].irq, interrupt_handler, "virtio");
+        irq_registered[disks[i].irq] = true;
+      }
+
+  for (i = 0; i < disk_cnt; i++)
+    {
+      struct vblk *d = &disks[i];
+      uint32_t lo = inl (reg_capacity (d));
+      uint32_t hi = inl (reg_capacity (d) + 4);
+      block_sector_t capacity = hi == 0 ? lo : (block_sector_t) -1;
+
+      d->block = block_register (d->name, BLOCK_RAW, "virtio", capacity,
+                                 &vblk_operations, d);
+      partition_scan (d->block);
+    }
+}
+
+/* Sets up virtio block device D, found at PCI, for use, and
+   returns true if successful.  On failure, prints a message and
+   returns false. */
+static bool
+init_disk (struct vblk *d, const struct pci_device *pci)
+{
+  size_t used_ofs, used_bytes, page_cnt;
+  uint8_t *queue;
+  size_t i;
+
+  if (!(pci_read_config (pci, PCI_REG_BAR0) & 1))
+    {
+      printf ("%s: no I/O port BAR, ignoring\n", d->name);
+      return false;
+    }
+  d->io_base = pci_read_bar (pci, 0);
+  d->irq = pci_read_config (pci, PCI_REG_IRQ) & 0xff;
+  if (d->irq >= 16)
+    {
+      printf ("%s: no interrupt line, ignoring\n", d->name);
+      return false;
+    }
+  pci_enable_bus_master (pci);
+
+  /* Reset the device and negotiate features. */
+  outb (reg_status (d), 0);
+  outb (reg_status (d), STATUS_ACKNOWLEDGE);
+  outb (reg_status (d), STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+  if (!(inl (reg_device_features (d)) & F_INDIRECT_DESC))
+    {
+      printf ("%s: no indirect descriptors, ignoring\n", d->name);
+      goto fail;
+    }
+  outl (reg_guest_features (d), F_INDIRECT_DESC);
+
+  /* Set up queue 0, laid out as the legacy interface requires:
+     descriptors, then the available ring, then, at the next page
+     boundary, the used ring. */
+  outw (reg_queue_select (d), 0);
+  d->queue_size = inw (reg_queue_size (d));
+  if (d->queue_size < BLOCK_TRANSFER_MAX)
+    {
+      printf ("%s: queue too small, ignoring\n", d->name);
+      goto fail;
+    }
+  used_ofs = ROUND_UP (sizeof *d->desc * d->queue_size + sizeof *d->avail
+                       + sizeof *d->avail->ring * d->queue_size
+                       + sizeof (uint16_t), PGSIZE);
+  used_bytes = (sizeof *d->used + sizeof *d->used->ring * d->queue_size
+                + sizeof (uint16_t));
+  page_cnt = DIV_ROUND_UP (used_ofs + used_bytes, PGSIZE);
+  queue = palloc_get_multiple (PAL_ZERO, page_cnt);
+  d->slots = palloc_get_multiple (PAL_ZERO,
+                                  DIV_ROUND_UP (BLOCK_TRANSFER_MAX
+                                                * sizeof *d->slots, PGSIZE));
+  if (queue == NULL || d->slots == NULL)
+    PANIC ("%s: out of memory for virtqueue", d->name);
+  d->desc = (struct desc *) queue;
+  d->avail = (struct avail *) (queue + sizeof *d->desc * d->queue_size);
+  d->used = (struct used *) (queue + used_ofs);
+  d->used_idx = 0;
+  for (i = 0; i < BLOCK_TRANSFER_MAX; i++)
+    {
+      d->desc[i].addr = vtop (d->slots[i].table);
+      d->desc[i].flags = DESC_INDIRECT;
+    }
+  outl (reg_queue_pfn (d), vtop (queue) >> PGBITS);
+
+  outb (reg_status (d), STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_DRIVER_OK);
+  return true;
+
+ fail:
+  outb (reg_status (d), STATUS_FAILED);
+  return false;
+}
+
+/* Starts transfer T on virtio block device D_. */
+static void
+vblk_start (void *d_, struct block_transfer *t)
+{
+  struct vblk *d = d_;
+  struct slot *s = NULL;
+  enum intr_level old_level;
+  uint16_t flags;
+  size_t i, n;
+
+  /* Claim a free slot.  The block layer never has more than
+     BLOCK_TRANSFER_MAX transfers outstanding, so there is one. */
+  old_level = intr_disable ();
+  for (i = 0; i < BLOCK_TRANSFER_MAX; i++)
+    if (d->slots[i].transfer == NULL)
+      {
+        s = &d->slots[i];
+        s->transfer = t;
+        break;
+      }
+  intr_set_level (old_level);
+  ASSERT (s != NULL);
+
+  /* Describe the request: header, data, status. */
+  s->header.type = t->write ? REQ_OUT : REQ_IN;
+  s->header.reserved = 0;
+  s->header.sector = t->sector;
+  s->table[0].addr = vtop (&s->header);
+  s->table[0].len = sizeof s->header;
+  s->table[0].flags = DESC_NEXT;
+  s->table[0].next = 1;
+  n = 1;
+  flags = DESC_NEXT | (t->write ? 0 : DESC_WRITE);
+  for (i = 0; i < t->iov_cnt; i++)
+    n = add_buffer (s, n, t->iov[i].buffer,
+                    t->iov[i].sector_cnt * BLOCK_SECTOR_SIZE, flags);
+  s->status = 0xff;
+  s->table[n].addr = vtop (&s->status);
+  s->table[n].len = 1;
+  s->table[n].flags = DESC_WRITE;
+  s->table[n].next = 0;
+  n++;
+
+  /* Hand it to the device. */
+  d->desc[s - d->slots].len = n * sizeof *s->table;
+  d->avail->ring[d->avail->idx % d->queue_size] = s - d->slots;
+  barrier ();
+  d->avail->idx++;
+  barrier ();
+  outw (reg_queue_notify (d), 0);
+}
+
+/* Adds descriptors with the given FLAGS for the SIZE bytes at
+   BUFFER to slot S's table, starting at index N, and returns
+   the new number of descriptors in the table.  Merges regions
+   that are contiguous in physical memory. */
+static size_t
+add_buffer (struct slot *s, size_t n, uint8_t *buffer, size_t size,
+            uint16_t flags)
+{
+  while (size > 0)
+    {
+      uintptr_t phys = buffer_to_phys (buffer);
+      size_t chunk = PGSIZE - pg_ofs (buffer);
+      if (chunk > size)
+        chunk = size;
+
+      if (n > 1 && s->table[n - 1].addr + s->table[n - 1].len == phys)
+        s->table[n - 1].len += chunk;
+      else
+        {
+          /* Leave room for the status descriptor. */
+          if (n >= INDIRECT_CNT - 1)
+            PANIC ("virtio: transfer of sector %"PRDSNu" too fragmented",
+                   (block_sector_t) s->header.sector);
+          s->table[n].addr = phys;
+          s->table[n].len = chunk;
+          s->table[n].flags = flags;
+          s->table[n].next = n + 1;
+          n++;
+        }
+      buffer += chunk;
+      size -= chunk;
+    }
+  return n;
+}
+
+/* Returns the physical address of kernel virtual address
+   VADDR. */
+static uintptr_t
+buffer_to_phys (const void *vaddr)
+{
+  return is_vmalloc_vaddr (vaddr) ? vmalloc_vtop (vaddr) : vtop (vaddr);
+}
+
+/* Virtio interrupt handler.  Completes the transfers that the
+   devices on the interrupting line have finished. */
+static void
+interrupt_handler (struct intr_frame *f)
+{
+  struct vblk *d;
+
+  for (d = disks; d < disks + disk_cnt; d++)
+    if (d->irq == f->vec_no - 0x20
+        && (inb (reg_isr (d)) & ISR_QUEUE))
+      while (d->used_idx != d->used->idx)
+        {
+          uint32_t id = d->used->ring[d->used_idx % d->queue_size].id;
+          struct slot *s = &d->slots[id];
+          struct block_transfer *t = s->transfer;
+
+          barrier ();
+          if (s->status != REQ_OK)
+            PANIC ("%s: disk %s failed, sector=%"PRDSNu,
+                   d->name, t->write ? "write" : "read", t->sector);
+          s->transfer = NULL;
+          d->used_idx++;
+          block_complete (t);
+        }
+}
+
+static struct block_operations vblk_operations =
+  {
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    vblk_start,
+    NULL
+  };
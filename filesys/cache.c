@@ -0,0 +1,666 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <hash.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/filesys.h"
+#include "kernel/malloc.h"
+#include "kernel/synch.h"
+#include "kernel/thread.h"
+#include "kernel/vmalloc.h"
+
+/* Buffer cache for file system sectors.
+
+   All of the file system's reads and writes of fs_device go
+   through a fixed number of sector-sized cache entries, by
+   default CACHE_MIN_SECTORS of them.  The "-cache=N" kernel
+   command-line option picks another size, clamped to the range
+   CACHE_MIN_SECTORS...CACHE_MAX_SECTORS.
+
+   Writes only mark the entry dirty.  Dirty entries are written
+   back, in order of sector number, by the "flusher" thread
+   every FLUSH_INTERVAL ticks, or sooner once half of the cache
+   is dirty; by cache_flush() and cache_flush_sector(), on
+   request; and when an entry is about to be reused for another
+   sector.  Many small writes to one sector thus usually cost a
+   single disk write, and cache_flush() writes each run of
+   consecutive dirty sectors, up to FLUSH_RUN_MAX of them, with a
+   single request.
+
+   A hash table maps sector numbers to entries.  When a sector
+   that is not cached is needed, the clock algorithm picks an
+   entry to reuse: the hand sweeps over the entries, clearing
+   each one's "accessed" bit, and stops at the first entry whose
+   bit was already clear.
+
+   CACHE_LOCK protects the hash table, the clock hand, and the
+   bookkeeping members of every entry.  The data in an entry is
+   protected by that entry's readers-writer lock instead, so
+   that threads working on different sectors, or only reading
+   the same one, do not wait for each other.  An entry is
+   "pinned" from the time a thread looks it up until it is done
+   with it, and pinned entries are never chosen for reuse.
+
+   Sectors that journal_write_at() changed belong to a journal
+   transaction, and are not written back in place, or reused,
+   until cache_commit() reports that the transaction has been
+   committed to the journal.
+
+   cache_read_ahead() queues a sector to be brought in by the
+   "read-ahead" thread, so that a caller who expects to need it
+   soon does not have to wait for the disk then.  The queue is
+   small, and requests that do not fit are dropped. */
+
+/* Number of sectors the read-ahead queue can hold. */
+#define READ_AHEAD_QUEUE 64
+
+/* Timer ticks between periodic flushes, and between checks of
+   how much of the cache is dirty. */
+#define FLUSH_INTERVAL (5 * TIMER_FREQ)
+#define FLUSH_POLL (TIMER_FREQ / 10)
+
+/* Most sectors cache_flush() writes with one request. */
+#define FLUSH_RUN_MAX 32
+
+/* A cache entry. */
+struct cache_entry
+  {
+    /* Protected by cache_lock. */
+    struct hash_elem hash_elem;         /* Element in CACHE_MAP. */
+    block_sector_t sector;              /* Cached sector. */
+    bool in_use;                        /* Does SECTOR mean anything? */
+    bool accessed;                      /* Used since the hand last passed? */
+    unsigned pin_cnt;                   /* Number of threads using entry. */
+
+    /* Changed only with both CACHE_LOCK and RW held, so that
+       either suffices for reading it. */
+    uint32_t txn;                       /* Last transaction to change DATA. */
+
+    /* Protected by RW. */
+    struct rwlock rw;                   /* Readers-writer lock on data. */
+    bool loaded;                        /* Does DATA hold the sector? */
+    bool dirty;                         /* Does DATA need writing back? */
+    uint8_t *data;                      /* Sector data. */
+  };
+
+static size_t entry_cnt = CACHE_MIN_SECTORS;    /* Number of entries. */
+static struct cache_entry *entries;     /* Array of ENTRY_CNT entries. */
+static size_t hand;                     /* Clock hand. */
+static struct hash cache_map;           /* Maps sectors to entries. */
+static struct lock cache_lock;          /* Protects the above. */
+static struct condition entry_unpinned; /* Signaled when pin_cnt drops to 0,
+                                           or a transaction commits. */
+static size_t dirty_cnt;                /* Number of dirty entries. */
+static uint32_t committed_txn;          /* Last transaction committed. */
+
+/* cache_flush() state. */
+static struct lock flush_lock;          /* One flush at a time. */
+static struct cache_entry **flush_batch; /* Entries being flushed. */
+
+/* Read-ahead queue, also protected by CACHE_LOCK. */
+static block_sector_t ra_queue[READ_AHEAD_QUEUE]; /* Queued sectors. */
+static unsigned ra_head, ra_tail;       /* Next to add, next to remove. */
+static struct condition ra_nonempty;    /* Signaled when a sector is queued. */
+
+/* Statistics. */
+static unsigned long long hit_cnt;      /* Lookups that found the sector. */
+static unsigned long long miss_cnt;     /* Lookups that did not. */
+static unsigned long long evict_cnt;    /* Sectors replaced by others. */
+static unsigned long long ra_cnt;       /* Sectors read ahead. */
+static unsigned long long write_cnt;    /* Sectors written back. */
+
+static unsigned entry_hash (const struct hash_elem *, void *);
+static bool entry_less (const struct hash_elem *, const struct hash_elem *,
+                        void *);
+static struct cache_entry *acquire_entry (block_sector_t, bool write,
+                                          bool load);
+static void release_entry (struct cache_entry *, bool write);
+static void unpin (struct cache_entry *);
+static void mark_dirty (struct cache_entry *, uint32_t txn);
+static bool held (const struct cache_entry *);
+static void write_back (struct cache_entry *);
+static void write_back_run (struct cache_entry **, size_t cnt);
+static struct cache_entry *pick_victim (void);
+static int compare_sectors (const void *, const void *, void *);
+static thread_func read_ahead_thread NO_RETURN;
+static thread_func flusher_thread NO_RETURN;
+
+/* Sets the number of sectors the cache holds to SECTOR_CNT,
+   clamped to the allowed range.  Must be called before
+   cache_init(). */
+void
+cache_configure (size_t sector_cnt)
+{
+  ASSERT (entries == NULL);
+
+  if (sector_cnt < CACHE_MIN_SECTORS)
+    sector_cnt = CACHE_MIN_SECTORS;
+  else if (sector_cnt > CACHE_MAX_SECTORS)
+    sector_cnt = CACHE_MAX_SECTORS;
+  entry_cnt = sector_cnt;
+}
+
+/* Initializes the buffer cache. */
+void
+cache_init (void)
+{
+  uint8_t *data;
+  size_t i;
+
+  entries = calloc (entry_cnt, sizeof *entries);
+  flush_batch = calloc (entry_cnt, sizeof *flush_batch);
+  data = vmalloc (entry_cnt * BLOCK_SECTOR_SIZE);
+  if (entries == NULL || flush_batch == NULL || data == NULL
+      || !hash_init (&cache_map, entry_hash, entry_less, NULL))
+    PANIC ("cache_init: out of memory");
+
+  for (i = 0; i < entry_cnt; i++)
+    {
+      struct cache_entry *e = &entries[i];
+      e->in_use = false;
+      e->accessed = false;
+      e->pin_cnt = 0;
+      e->txn = 0;
+      rwlock_init (&e->rw);
+      e->loaded = false;
+      e->dirty = false;
+      e->data = data + i * BLOCK_SECTOR_SIZE;
+    }
+  hand = 0;
+  lock_init (&cache_lock);
+  cond_init (&entry_unpinned);
+  cond_init (&ra_nonempty);
+  lock_init (&flush_lock);
+
+  thread_create ("read-ahead", PRI_DEFAULT, read_ahead_thread, NULL);
+  thread_create ("flusher", PRI_DEFAULT, flusher_thread, NULL);
+}
+
+/* Reads sector SECTOR from the file system device into BUFFER,
+   which must have room for BLOCK_SECTOR_SIZE bytes. */
+void
+cache_read (block_sector_t sector, void *buffer)
+{
+  cache_read_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes sector SECTOR on the file system device from BUFFER,
+   which must contain BLOCK_SECTOR_SIZE bytes. */
+void
+cache_write (block_sector_t sector, const void *buffer)
+{
+  cache_write_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads SIZE bytes starting at byte offset OFS within sector
+   SECTOR into BUFFER. */
+void
+cache_read_at (block_sector_t sector, void *buffer, size_t ofs, size_t size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = acquire_entry (sector, false, true);
+  memcpy (buffer, e->data + ofs, size);
+  release_entry (e, false);
+}
+
+/* Writes SIZE bytes from BUFFER into sector SECTOR, starting at
+   byte offset OFS within the sector.  The rest of the sector is
+   preserved. */
+void
+cache_write_at (block_sector_t sector, const void *buffer,
+                size_t ofs, size_t size)
+{
+  cache_write_logged (sector, buffer, ofs, size, 0);
+}
+
+/* Like cache_write_at(), but on behalf of journal transaction
+   TXN, so that SECTOR is not written back in place until
+   cache_commit() is called for TXN or a later transaction.  TXN
+   may be 0 to write without a transaction. */
+void
+cache_write_logged (block_sector_t sector, const void *buffer,
+                    size_t ofs, size_t size, uint32_t txn)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
+
+  /* A write of the whole sector does not need the old data. */
+  e = acquire_entry (sector, true, size < BLOCK_SECTOR_SIZE);
+  memcpy (e->data + ofs, buffer, size);
+  e->loaded = true;
+  mark_dirty (e, txn);
+  release_entry (e, true);
+}
+
+/* Records that journal transaction TXN, and every one before
+   it, has committed, so that the sectors they changed may be
+   written back in place. */
+void
+cache_commit (uint32_t txn)
+{
+  lock_acquire (&cache_lock);
+  ASSERT (txn >= committed_txn);
+  committed_txn = txn;
+  cond_broadcast (&entry_unpinned, &cache_lock);
+  lock_release (&cache_lock);
+}
+
+/* Writes every dirty sector in the cache back to disk, except
+   those changed by journal transactions not yet committed. */
+void
+cache_flush (void)
+{
+  size_t batch_cnt = 0;
+  size_t run_cnt;
+  size_t i;
+
+  lock_acquire (&flush_lock);
+
+  /* Pin the dirty entries, so that they keep their sectors. */
+  lock_acquire (&cache_lock);
+  for (i = 0; i < entry_cnt; i++)
+    {
+      struct cache_entry *e = &entries[i];
+      if (e->in_use && e->dirty && !held (e))
+        {
+          e->pin_cnt++;
+          flush_batch[batch_cnt++] = e;
+        }
+    }
+  lock_release (&cache_lock);
+
+  /* Write them back in ascending sector order, one run of
+     consecutive sectors at a time.  Only this thread ever holds
+     more than one entry at once, so taking each run's locks in
+     order cannot deadlock. */
+  sort (flush_batch, batch_cnt, sizeof *flush_batch, compare_sectors, NULL);
+  for (i = 0; i < batch_cnt; i += run_cnt)
+    {
+      size_t j;
+
+      for (run_cnt = 1; i + run_cnt < batch_cnt && run_cnt < FLUSH_RUN_MAX;
+           run_cnt++)
+        if (flush_batch[i + run_cnt]->sector
+            != flush_batch[i + run_cnt - 1]->sector + 1)
+          break;
+
+      for (j = 0; j < run_cnt; j++)
+        rwlock_acquire_write (&flush_batch[i + j]->rw);
+      write_back_run (flush_batch + i, run_cnt);
+      for (j = 0; j < run_cnt; j++)
+        rwlock_release_write (&flush_batch[i + j]->rw);
+
+      lock_acquire (&cache_lock);
+      for (j = 0; j < run_cnt; j++)
+        unpin (flush_batch[i + j]);
+      lock_release (&cache_lock);
+    }
+
+  lock_release (&flush_lock);
+}
+
+/* Writes SECTOR back to disk if it is cached and dirty, unless
+   a journal transaction that changed it has not yet committed. */
+void
+cache_flush_sector (block_sector_t sector)
+{
+  struct cache_entry key, *e;
+  struct hash_elem *he;
+
+  lock_acquire (&cache_lock);
+  key.sector = sector;
+  he = hash_find (&cache_map, &key.hash_elem);
+  if (he == NULL)
+    {
+      lock_release (&cache_lock);
+      return;
+    }
+  e = hash_entry (he, struct cache_entry, hash_elem);
+  e->pin_cnt++;
+  lock_release (&cache_lock);
+
+  rwlock_acquire_write (&e->rw);
+  write_back (e);
+  release_entry (e, true);
+}
+
+/* Queues SECTOR to be read into the cache in the background,
+   unless it is already cached or the queue is full. */
+void
+cache_read_ahead (block_sector_t sector)
+{
+  struct cache_entry key;
+
+  lock_acquire (&cache_lock);
+  key.sector = sector;
+  if (ra_head - ra_tail < READ_AHEAD_QUEUE
+      && hash_find (&cache_map, &key.hash_elem) == NULL)
+    {
+      ra_queue[ra_head++ % READ_AHEAD_QUEUE] = sector;
+      cond_signal (&ra_nonempty, &cache_lock);
+    }
+  lock_release (&cache_lock);
+}
+
+/* Prints buffer cache statistics. */
+void
+cache_print_stats (void)
+{
+  printf ("Cache: %zu sectors, %llu hits, %llu misses, %llu evictions, "
+          "%llu read ahead, %llu written back\n",
+          entry_cnt, hit_cnt, miss_cnt, evict_cnt, ra_cnt, write_cnt);
+}
+
+/* Read-ahead thread.  Brings queued sectors into the cache. */
+static void
+read_ahead_thread (void *aux UNUSED)
+{
+  for (;;)
+    {
+      struct cache_entry key, *e;
+      bool cached;
+
+      lock_acquire (&cache_lock);
+      while (ra_head == ra_tail)
+        cond_wait (&ra_nonempty, &cache_lock);
+      key.sector = ra_queue[ra_tail++ % READ_AHEAD_QUEUE];
+      cached = hash_find (&cache_map, &key.hash_elem) != NULL;
+      if (!cached)
+        ra_cnt++;
+      lock_release (&cache_lock);
+
+      if (!cached)
+        {
+          e = acquire_entry (key.sector, false, true);
+          release_entry (e, false);
+        }
+    }
+}
+
+/* Flusher thread.  Writes dirty sectors back periodically, and
+   whenever half of the cache is dirty. */
+static void
+flusher_thread (void *aux UNUSED)
+{
+  int64_t last_flush = timer_ticks ();
+
+  for (;;)
+    {
+      timer_sleep (FLUSH_POLL);
+      if (dirty_cnt >= entry_cnt / 2
+          || timer_elapsed (last_flush) >= FLUSH_INTERVAL)
+        {
+          cache_flush ();
+          last_flush = timer_ticks ();
+        }
+    }
+}
+
+/* Finds or makes the entry for SECTOR, pins it, and acquires
+   its readers-writer lock, for writing if WRITE is true and for
+   reading otherwise.  If LOAD is true, the entry's data is read
+   from disk if it is not already there; callers that pass false
+   must fill in the whole sector. */
+static struct cache_entry *
+acquire_entry (block_sector_t sector, bool write, bool load)
+{
+  struct cache_entry key, *e;
+  struct hash_elem *he;
+
+  ASSERT (write || load);
+
+  lock_acquire (&cache_lock);
+  key.sector = sector;
+  for (;;)
+    {
+      he = hash_find (&cache_map, &key.hash_elem);
+      if (he != NULL)
+        {
+          e = hash_entry (he, struct cache_entry, hash_elem);
+          hit_cnt++;
+          break;
+        }
+
+      e = pick_victim ();
+      if (e->in_use && e->dirty)
+        {
+          /* Write the victim back while it still holds its old
+             sector, then start over: meanwhile the victim may
+             have been used again, and another thread may have
+             brought in SECTOR. */
+          e->pin_cnt++;
+          lock_release (&cache_lock);
+          rwlock_acquire_write (&e->rw);
+          write_back (e);
+          rwlock_release_write (&e->rw);
+          lock_acquire (&cache_lock);
+          unpin (e);
+          continue;
+        }
+
+      miss_cnt++;
+      if (e->in_use)
+        {
+          hash_delete (&cache_map, &e->hash_elem);
+          evict_cnt++;
+        }
+      e->sector = sector;
+      e->in_use = true;
+      e->loaded = false;
+      hash_insert (&cache_map, &e->hash_elem);
+      break;
+    }
+  e->accessed = true;
+  e->pin_cnt++;
+  lock_release (&cache_lock);
+
+  /* Fill in the data if needed.  Check again after taking the
+     lock for writing, because another thread may have beaten
+     us to it. */
+  if (load && !write)
+    {
+      rwlock_acquire_read (&e->rw);
+      if (e->loaded)
+        return e;
+      rwlock_release_read (&e->rw);
+    }
+  rwlock_acquire_write (&e->rw);
+  if (load && !e->loaded)
+    {
+      block_read (fs_device, sector, e->data);
+      e->loaded = true;
+    }
+  if (!write)
+    {
+      /* There is no downgrade, so give up the write lock and
+         take a read lock.  The entry is pinned, so it still
+         holds SECTOR afterward. */
+      rwlock_release_write (&e->rw);
+      rwlock_acquire_read (&e->rw);
+    }
+  return e;
+}
+
+/* Releases entry E, which was acquired for writing if WRITE is
+   true or for reading otherwise, and unpins it. */
+static void
+release_entry (struct cache_entry *e, bool write)
+{
+  if (write)
+    rwlock_release_write (&e->rw);
+  else
+    rwlock_release_read (&e->rw);
+
+  lock_acquire (&cache_lock);
+  unpin (e);
+  lock_release (&cache_lock);
+}
+
+/* Unpins entry E.  CACHE_LOCK must be held. */
+static void
+unpin (struct cache_entry *e)
+{
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+  ASSERT (e->pin_cnt > 0);
+
+  if (--e->pin_cnt == 0)
+    cond_signal (&entry_unpinned, &cache_lock);
+}
+
+/* Marks entry E, which the caller must hold for writing, as
+   dirty, with changes made by journal transaction TXN if TXN is
+   nonzero. */
+static void
+mark_dirty (struct cache_entry *e, uint32_t txn)
+{
+  ASSERT (rwlock_held_for_write (&e->rw));
+
+  if (!e->dirty || txn > e->txn)
+    {
+      lock_acquire (&cache_lock);
+      if (!e->dirty)
+        {
+          e->dirty = true;
+          dirty_cnt++;
+        }
+      if (txn > e->txn)
+        e->txn = txn;
+      lock_release (&cache_lock);
+    }
+}
+
+/* Returns true if entry E holds changes by a journal transaction
+   that has not yet committed.  The caller must hold CACHE_LOCK
+   or E's RW. */
+static bool
+held (const struct cache_entry *e)
+{
+  return e->txn > committed_txn;
+}
+
+/* Writes entry E, which the caller must hold for writing, back
+   to disk if it is dirty and not held by a journal transaction. */
+static void
+write_back (struct cache_entry *e)
+{
+  ASSERT (rwlock_held_for_write (&e->rw));
+
+  if (e->dirty && !held (e))
+    {
+      block_write (fs_device, e->sector, e->data);
+      e->dirty = false;
+      lock_acquire (&cache_lock);
+      dirty_cnt--;
+      write_cnt++;
+      lock_release (&cache_lock);
+    }
+}
+
+/* Writes back the dirty ones among the CNT entries in RUN, which
+   hold consecutive sectors in ascending order and which the
+   caller must hold for writing, except those held by a journal
+   transaction.  Each stretch of such entries goes to disk in a
+   single request. */
+static void
+write_back_run (struct cache_entry **run, size_t cnt)
+{
+  struct block_iovec iov[FLUSH_RUN_MAX];
+  size_t i = 0;
+
+  ASSERT (cnt <= FLUSH_RUN_MAX);
+
+  while (i < cnt)
+    {
+      block_sector_t start;
+      size_t n = 0;
+
+      /* Skip entries that were written back since they were
+         picked, then gather the dirty ones that follow. */
+      while (i < cnt && (!run[i]->dirty || held (run[i])))
+        i++;
+      if (i >= cnt)
+        break;
+      start = run[i]->sector;
+      while (i + n < cnt && run[i + n]->dirty && !held (run[i + n]))
+        {
+          iov[n].buffer = run[i + n]->data;
+          iov[n].sector_cnt = 1;
+          n++;
+        }
+
+      block_writev (fs_device, start, iov, n);
+      lock_acquire (&cache_lock);
+      dirty_cnt -= n;
+      write_cnt += n;
+      lock_release (&cache_lock);
+      for (; n > 0; n--)
+        run[i++]->dirty = false;
+    }
+}
+
+/* Chooses an unpinned entry to reuse, by the clock algorithm,
+   waiting for one to become unpinned if necessary.  Entries held
+   by a journal transaction count as pinned.  An unused entry is
+   taken as soon as the hand reaches it.  CACHE_LOCK must be
+   held. */
+static struct cache_entry *
+pick_victim (void)
+{
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  for (;;)
+    {
+      size_t i;
+
+      /* Two sweeps: the first may only clear accessed bits. */
+      for (i = 0; i < 2 * entry_cnt; i++)
+        {
+          struct cache_entry *e = &entries[hand];
+          hand = (hand + 1) % entry_cnt;
+
+          if (e->pin_cnt > 0 || (e->dirty && held (e)))
+            continue;
+          if (!e->in_use || !e->accessed)
+            return e;
+          e->accessed = false;
+        }
+
+      /* Every entry is pinned or held. */
+      cond_wait (&entry_unpinned, &cache_lock);
+    }
+}
+
+/* Compares the sectors of the cache entries that A and B point
+   to, for sort(). */
+static int
+compare_sectors (const void *a_, const void *b_, void *aux UNUSED)
+{
+  const struct cache_entry *const *a = a_;
+  const struct cache_entry *const *b = b_;
+
+  return (*a)->sector < (*b)->sector ? -1 : (*a)->sector > (*b)->sector;
+}
+
+/* Returns a hash value for cache entry E. */
+static unsigned
+entry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct cache_entry *ce = hash_entry (e, struct cache_entry, hash_elem);
+  return hash_int (ce->sector);
+}
+
+/* Returns true if cache entry A's sector precedes B's. */
+static bool
+entry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+            void *aux UNUSED)
+{
+  const struct cache_entry *a = hash_entry (a_, struct cache_entry, hash_elem);
+  const struct cache_entry *b = hash_entry (b_, struct cache_entry, hash_elem);
+  return a->sector < b->sector;
+}
@@ -0,0 +1,26 @@
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "devices/block.h"
+
+/* Bounds on the number of cached sectors. */
+#define CACHE_MIN_SECTORS 64
+#define CACHE_MAX_SECTORS 1024
+
+void cache_configure (size_t sector_cnt);
+void cache_init (void);
+void cache_read (block_sector_t, void *);
+void cache_write (block_sector_t, const void *);
+void cache_read_at (block_sector_t, void *, size_t ofs, size_t size);
+void cache_write_at (block_sector_t, const void *, size_t ofs, size_t size);
+void cache_write_logged (block_sector_t, const void *, size_t ofs,
+                         size_t size, uint32_t txn);
+void cache_commit (uint32_t txn);
+void cache_read_ahead (block_sector_t);
+void cache_flush (void);
+void cache_flush_sector (block_sector_t);
+void cache_print_stats (void);
+
+#endif /* filesys/cache.h */
@@ -0,0 +1,198 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "kernel/slab.h"
+#include "kernel/synch.h"
+
+/* Directory entry cache.
+
+   Maps a name within a directory, identified by the sector of
+   the directory's inode, to the sector of the named file's
+   inode, so that looking up a name a second time does not have
+   to search the directory.  Names that were looked up and not
+   found are cached too, as "negative" entries whose inode
+   sector is DCACHE_NEGATIVE.
+
+   The directory code keeps the cache up to date: dir_add()
+   records the new name, dir_remove() records its absence, and
+   removing a directory forgets every name in it.  At most
+   DCACHE_MAX names are cached; past that, the least recently
+   used one is dropped. */
+
+/* Maximum number of cached names. */
+#define DCACHE_MAX 256
+
+/* A cached name. */
+struct dentry
+  {
+    struct hash_elem hash_elem;         /* Element in dcache_map. */
+    struct list_elem lru_elem;          /* Element in lru_list. */
+    block_sector_t dir;                 /* Directory's inode sector. */
+    block_sector_t inode_sector;        /* Or DCACHE_NEGATIVE. */
+    char name[NAME_MAX + 1];            /* Null terminated file name. */
+  };
+
+static struct hash dcache_map;          /* All cached names. */
+static struct list lru_list;            /* Most recently used first. */
+static struct lock dcache_lock;         /* Protects all of the above. */
+static struct kmem_cache *dentry_cache; /* Cache of struct dentry. */
+
+/* Statistics. */
+static unsigned long long hit_cnt;      /* Lookups of existing names. */
+static unsigned long long negative_cnt; /* Lookups of missing names. */
+static unsigned long long miss_cnt;     /* Lookups not in the cache. */
+
+static unsigned dentry_hash (const struct hash_elem *, void *);
+static bool dentry_less (const struct hash_elem *, const struct hash_elem *,
+                         void *);
+static struct dentry *find (block_sector_t dir, const char *name);
+static void discard (struct dentry *);
+
+/* Initializes the directory entry cache. */
+void
+dcache_init (void)
+{
+  hash_init (&dcache_map, dentry_hash, dentry_less, NULL);
+  list_init (&lru_list);
+  lock_init (&dcache_lock);
+  dentry_cache = kmem_cache_create ("dentry", sizeof (struct dentry), NULL);
+}
+
+/* Looks up NAME in the directory whose inode is in sector DIR.
+   If the cache knows the answer, returns true and stores the
+   named file's inode sector, or DCACHE_NEGATIVE if there is no
+   such file, into *INODE_SECTOR.  Otherwise, returns false. */
+bool
+dcache_lookup (block_sector_t dir, const char *name,
+               block_sector_t *inode_sector)
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    {
+      list_remove (&d->lru_elem);
+      list_push_front (&lru_list, &d->lru_elem);
+      *inode_sector = d->inode_sector;
+      if (d->inode_sector != DCACHE_NEGATIVE)
+        hit_cnt++;
+      else
+        negative_cnt++;
+    }
+  else
+    miss_cnt++;
+  lock_release (&dcache_lock);
+  return d != NULL;
+}
+
+/* Records that NAME in the directory whose inode is in sector
+   DIR refers to the inode in INODE_SECTOR, or, if INODE_SECTOR
+   is DCACHE_NEGATIVE, that there is no such file.  Names too
+   long to be valid are not cached. */
+void
+dcache_insert (block_sector_t dir, const char *name,
+               block_sector_t inode_sector)
+{
+  struct dentry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    list_remove (&d->lru_elem);
+  else
+    {
+      if (hash_size (&dcache_map) >= DCACHE_MAX)
+        discard (list_entry (list_back (&lru_list), struct dentry, lru_elem));
+      d = kmem_cache_alloc (dentry_cache);
+      if (d == NULL)
+        goto done;
+      d->dir = dir;
+      strlcpy (d->name, name, sizeof d->name);
+      hash_insert (&dcache_map, &d->hash_elem);
+    }
+  d->inode_sector = inode_sector;
+  list_push_front (&lru_list, &d->lru_elem);
+
+ done:
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every cached name in the directory whose inode is in
+   sector DIR. */
+void
+dcache_purge_dir (block_sector_t dir)
+{
+  struct list_elem *e, *next;
+
+  lock_acquire (&dcache_lock);
+  for (e = list_begin (&lru_list); e != list_end (&lru_list); e = next)
+    {
+      struct dentry *d = list_entry (e, struct dentry, lru_elem);
+      next = list_next (e);
+      if (d->dir == dir)
+        discard (d);
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Prints directory entry cache statistics. */
+void
+dcache_print_stats (void)
+{
+  printf ("Dcache: %zu names, %llu hits, %llu negative hits, %llu misses\n",
+          hash_size (&dcache_map), hit_cnt, negative_cnt, miss_cnt);
+}
+
+/* Returns the cached entry for NAME in DIR, or a null pointer if
+   there is none.  DCACHE_LOCK must be held. */
+static struct dentry *
+find (block_sector_t dir, const char *name)
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  if (strlen (name) > NAME_MAX)
+    return NULL;
+  key.dir = dir;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dcache_map, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Removes D from the cache and frees it.  DCACHE_LOCK must be
+   held. */
+static void
+discard (struct dentry *d)
+{
+  hash_delete (&dcache_map, &d->hash_elem);
+  list_remove (&d->lru_elem);
+  kmem_cache_free (dentry_cache, d);
+}
+
+/* Returns a hash value for the dentry E. */
+static unsigned
+dentry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->dir);
+}
+
+/* Returns true if dentry A precedes dentry B. */
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+  if (a->dir != b->dir)
+    return a->dir < b->dir;
+  return strcmp (a->name, b->name) < 0;
+}
@@ -1,10 +1,15 @@
 #include "filesys/directory.h"
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "kernel/malloc.h"
+#include "kernel/slab.h"
 
 /* A directory. */
 struct dir 
@@ -21,6 +26,85 @@ struct dir_entry
     bool in_use;                        /* In use or free? */
   };
 
+/* Directory formats.
+
+   A small directory is "linear": an array of struct dir_entry
+   that lookups scan from the start.  Once a linear directory
+   fills up with LINEAR_MAX entries, it is converted to the
+   "indexed" format, an extendible hash table:
+
+   Block 0 of the file is a struct dir_index.  It maps the low
+   DEPTH bits of the hash of a name to the number of the leaf
+   block that holds names with those hash bits.  Each leaf is a
+   struct dir_leaf with room for LEAF_ENTRY_CNT entries.  A full
+   leaf is split in two, doubling the index first if necessary,
+   until the index reaches MAX_DEPTH; after that, full leaves are
+   extended with chains of overflow leaves.
+
+   An indexed directory is recognized by DIR_INDEX_MAGIC in its
+   first word, which in a linear directory is the inode sector of
+   its first entry and thus far smaller. */
+
+/* Identifies an indexed directory. */
+#define DIR_INDEX_MAGIC 0x48444952
+
+/* Maximum number of entries in a linear directory. */
+#define LINEAR_MAX (BLOCK_SECTOR_SIZE / sizeof (struct dir_entry))
+
+/* Maximum number of hash bits used by the index. */
+#define MAX_DEPTH 7
+
+/* Number of entries in a leaf. */
+#define LEAF_ENTRY_CNT 25
+
+/* Index block of an indexed directory.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct dir_index
+  {
+    uint32_t magic;                     /* DIR_INDEX_MAGIC. */
+    uint32_t depth;                     /* Number of hash bits used. */
+    uint32_t block_cnt;                 /* Blocks in use, including this. */
+    uint16_t leaves[1 << MAX_DEPTH];    /* Leaf block for each hash. */
+    uint8_t unused[244];                /* Not used. */
+  };
+
+/* Leaf block of an indexed directory.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct dir_leaf
+  {
+    uint32_t depth;                     /* Number of hash bits shared. */
+    uint32_t next;                      /* Overflow leaf block, or 0. */
+    uint32_t unused;                    /* Not used. */
+    struct dir_entry entries[LEAF_ENTRY_CNT]; /* Entries. */
+  };
+
+/* Cache of struct dir. */
+static struct kmem_cache *dir_cache;
+
+static bool readdir (struct dir *, char name[NAME_MAX + 1]);
+static bool read_header (const struct dir *, uint32_t *depth,
+                         uint32_t *block_cnt);
+static bool read_index (const struct dir *, struct dir_index *);
+static bool read_block (const struct dir *, uint32_t block, void *);
+static bool write_block (struct dir *, uint32_t block, const void *);
+static off_t entry_ofs (uint32_t block, size_t idx);
+static bool index_lookup (const struct dir *, uint32_t depth,
+                          const char *name, struct dir_entry *, off_t *);
+static bool index_add (struct dir *, struct dir_index *,
+                       const struct dir_entry *);
+static bool split_leaf (struct dir *, struct dir_index *, uint32_t block,
+                        struct dir_leaf *);
+static bool convert_to_index (struct dir *, struct dir_index *);
+
+/* Initializes the directory module. */
+void
+dir_init (void)
+{
+  ASSERT (sizeof (struct dir_index) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct dir_leaf) == BLOCK_SECTOR_SIZE);
+  dir_cache = kmem_cache_create ("dir", sizeof (struct dir), NULL);
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool
@@ -34,9 +118,10 @@ dir_create (block_sector_t sector, size_t entry_cnt)
 struct dir *
 dir_open (struct inode *inode) 
 {
-  struct dir *dir = calloc (1, sizeof *dir);
+  struct dir *dir = kmem_cache_alloc (dir_cache);
   if (inode != NULL && dir != NULL)
     {
+      inode_set_metadata (inode);
       dir->inode = inode;
       dir->pos = 0;
       return dir;
@@ -44,7 +129,7 @@ dir_open (struct inode *inode)
   else
     {
       inode_close (inode);
-      free (dir);
+      kmem_cache_free (dir_cache, dir);
       return NULL; 
     }
 }
@@ -72,7 +157,7 @@ dir_close (struct dir *dir)
   if (dir != NULL)
     {
       inode_close (dir->inode);
-      free (dir);
+      kmem_cache_free (dir_cache, dir);
     }
 }
 
@@ -93,11 +178,15 @@ lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
   struct dir_entry e;
+  uint32_t depth, block_cnt;
   size_t ofs;
   
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  if (read_header (dir, &depth, &block_cnt))
+    return index_lookup (dir, depth, name, ep, ofsp);
+
   for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e) 
     if (e.in_use && !strcmp (name, e.name)) 
@@ -119,15 +208,27 @@ bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
+  block_sector_t dir_sector = inode_get_inumber (dir->inode);
+  block_sector_t inode_sector;
   struct dir_entry e;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
+  /* Open the inode before releasing the directory lock, so that
+     the entry cannot be removed and its inode freed first. */
+  inode_lock_dir (dir->inode);
+  if (!dcache_lookup (dir_sector, name, &inode_sector))
+    {
+      inode_sector = (lookup (dir, name, &e, NULL)
+                      ? e.inode_sector : DCACHE_NEGATIVE);
+      dcache_insert (dir_sector, name, inode_sector);
+    }
+  if (inode_sector != DCACHE_NEGATIVE)
+    *inode = inode_open (inode_sector);
   else
     *inode = NULL;
+  inode_unlock_dir (dir->inode);
 
   return *inode != NULL;
 }
@@ -142,6 +243,7 @@ bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 {
   struct dir_entry e;
+  struct dir_index *idx = NULL;
   off_t ofs;
   bool success = false;
 
@@ -153,28 +255,57 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
     return false;
 
   /* Check that NAME is not in use. */
+  journal_begin ();
+  inode_lock_dir (dir->inode);
   if (lookup (dir, name, NULL, NULL))
     goto done;
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
+  idx = malloc (sizeof *idx);
+  if (idx == NULL)
+    goto done;
+  if (!read_index (dir, idx))
+    {
+      /* Set OFS to offset of free slot.
+         If there are no free slots, then it will be set to the
+         current end-of-file.
      
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
-      break;
+         inode_read_at() will only return a short read at end of
+         file.  Otherwise, we'd need to verify that we didn't get a
+         short read due to something intermittent such as low
+         memory. */
+      for (ofs = 0;
+           inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+           ofs += sizeof e) 
+        if (!e.in_use)
+          break;
+
+      /* Write slot, unless the directory has outgrown the linear
+         format. */
+      if ((size_t) ofs / sizeof e < LINEAR_MAX)
+        {
+          e.in_use = true;
+          strlcpy (e.name, name, sizeof e.name);
+          e.inode_sector = inode_sector;
+          success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+          goto done;
+        }
+      if (!convert_to_index (dir, idx))
+        goto done;
+    }
 
-  /* Write slot. */
+  /* Add to the index. */
+  memset (&e, 0, sizeof e);
   e.in_use = true;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
-  success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  success = index_add (dir, idx, &e);
 
  done:
+  if (success)
+    dcache_insert (inode_get_inumber (dir->inode), name, inode_sector);
+  inode_unlock_dir (dir->inode);
+  journal_end ();
+  free (idx);
   return success;
 }
 
@@ -193,6 +324,8 @@ dir_remove (struct dir *dir, const char *name)
   ASSERT (name != NULL);
 
   /* Find directory entry. */
+  journal_begin ();
+  inode_lock_dir (dir->inode);
   if (!lookup (dir, name, &e, &ofs))
     goto done;
 
@@ -206,12 +339,17 @@ dir_remove (struct dir *dir, const char *name)
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
     goto done;
 
-  /* Remove inode. */
+  /* Remove inode, and forget the names cached for it in case it
+     is a directory. */
+  dcache_insert (inode_get_inumber (dir->inode), name, DCACHE_NEGATIVE);
+  dcache_purge_dir (e.inode_sector);
   inode_remove (inode);
   success = true;
 
  done:
   inode_close (inode);
+  inode_unlock_dir (dir->inode);
+  journal_end ();
   return success;
 }
 
@@ -220,8 +358,53 @@ dir_remove (struct dir *dir, const char *name)
    contains no more entries. */
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
+{
+  bool success;
+
+  inode_lock_dir (dir->inode);
+  success = readdir (dir, name);
+  inode_unlock_dir (dir->inode);
+  return success;
+}
+
+/* Does the work for dir_readdir(), with DIR's lock held. */
+static bool
+readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
   struct dir_entry e;
+  uint32_t depth, block_cnt;
+
+  if (read_header (dir, &depth, &block_cnt))
+    {
+      /* Indexed directory: visit each leaf's entries in turn,
+         skipping the index and the leaf headers. */
+      const off_t first = offsetof (struct dir_leaf, entries);
+      const off_t last = first + LEAF_ENTRY_CNT * sizeof e;
+      for (;;)
+        {
+          off_t sector_ofs;
+          if (dir->pos < BLOCK_SECTOR_SIZE)
+            dir->pos = BLOCK_SECTOR_SIZE;
+          sector_ofs = dir->pos % BLOCK_SECTOR_SIZE;
+          if (sector_ofs < first)
+            dir->pos += first - sector_ofs;
+          else if (sector_ofs >= last)
+            {
+              dir->pos += BLOCK_SECTOR_SIZE - sector_ofs;
+              continue;
+            }
+          if ((uint32_t) dir->pos / BLOCK_SECTOR_SIZE >= block_cnt
+              || (inode_read_at (dir->inode, &e, sizeof e, dir->pos)
+                  != sizeof e))
+            return false;
+          dir->pos += sizeof e;
+          if (e.in_use)
+            {
+              strlcpy (name, e.name, NAME_MAX + 1);
+              return true;
+            }
+        }
+    }
 
   while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
     {
@@ -234,3 +417,273 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
     }
   return false;
 }
+
+/* Checks whether DIR is indexed.  If so, returns true and stores
+   the depth and block count from its index block into *DEPTH and
+   *BLOCK_CNT.  Otherwise, returns false. */
+static bool
+read_header (const struct dir *dir, uint32_t *depth, uint32_t *block_cnt)
+{
+  uint32_t header[3];
+
+  if (inode_read_at (dir->inode, header, sizeof header, 0) != sizeof header
+      || header[0] != DIR_INDEX_MAGIC)
+    return false;
+  *depth = header[1];
+  *block_cnt = header[2];
+  return true;
+}
+
+/* Reads DIR's index block into *IDX.  Returns true if DIR is
+   indexed, false if it is linear. */
+static bool
+read_index (const struct dir *dir, struct dir_index *idx)
+{
+  return (inode_read_at (dir->inode, idx, sizeof *idx, 0) == sizeof *idx
+          && idx->magic == DIR_INDEX_MAGIC);
+}
+
+/* Reads block BLOCK of DIR into BUFFER.  Returns true if
+   successful, false if BLOCK is past the end of DIR. */
+static bool
+read_block (const struct dir *dir, uint32_t block, void *buffer)
+{
+  return inode_read_at (dir->inode, buffer, BLOCK_SECTOR_SIZE,
+                        block * BLOCK_SECTOR_SIZE) == BLOCK_SECTOR_SIZE;
+}
+
+/* Writes BUFFER to block BLOCK of DIR, extending DIR if
+   necessary.  Returns true if successful, false on failure. */
+static bool
+write_block (struct dir *dir, uint32_t block, const void *buffer)
+{
+  return inode_write_at (dir->inode, buffer, BLOCK_SECTOR_SIZE,
+                         block * BLOCK_SECTOR_SIZE) == BLOCK_SECTOR_SIZE;
+}
+
+/* Returns the byte offset within an indexed directory of entry
+   IDX in leaf block BLOCK. */
+static off_t
+entry_ofs (uint32_t block, size_t idx)
+{
+  return (block * BLOCK_SECTOR_SIZE + offsetof (struct dir_leaf, entries)
+          + idx * sizeof (struct dir_entry));
+}
+
+/* Returns the leaf block of the index IDX that holds names whose
+   hash is HASH. */
+static uint32_t
+hash_to_leaf (const struct dir_index *idx, unsigned hash)
+{
+  return idx->leaves[hash & ((1u << idx->depth) - 1)];
+}
+
+/* Like lookup(), but for indexed directory DIR whose index uses
+   DEPTH hash bits.  Reads only NAME's slot in the index and the
+   entries of the leaf it points to, plus any overflow leaves
+   chained to it, all through the buffer cache. */
+static bool
+index_lookup (const struct dir *dir, uint32_t depth,
+              const char *name, struct dir_entry *ep, off_t *ofsp)
+{
+  unsigned slot = hash_string (name) & ((1u << depth) - 1);
+  uint16_t leaf;
+  uint32_t block;
+
+  if (inode_read_at (dir->inode, &leaf, sizeof leaf,
+                     offsetof (struct dir_index, leaves) + slot * sizeof leaf)
+      != sizeof leaf)
+    return false;
+  for (block = leaf; block != 0; )
+    {
+      struct dir_entry e;
+      size_t i;
+
+      for (i = 0; i < LEAF_ENTRY_CNT; i++)
+        {
+          off_t ofs = entry_ofs (block, i);
+          if (inode_read_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
+            return false;
+          if (e.in_use && !strcmp (name, e.name))
+            {
+              if (ep != NULL)
+                *ep = e;
+              if (ofsp != NULL)
+                *ofsp = ofs;
+              return true;
+            }
+        }
+      if (inode_read_at (dir->inode, &block, sizeof block,
+                         (block * BLOCK_SECTOR_SIZE
+                          + offsetof (struct dir_leaf, next)))
+          != sizeof block)
+        return false;
+    }
+  return false;
+}
+
+/* Adds entry E to indexed directory DIR, whose index block is
+   IDX, splitting leaves and growing the index as necessary.
+   Returns true if successful, false on failure. */
+static bool
+index_add (struct dir *dir, struct dir_index *idx, const struct dir_entry *e)
+{
+  unsigned hash = hash_string (e->name);
+  struct dir_leaf *leaf = malloc (sizeof *leaf);
+  bool success = false;
+
+  if (leaf == NULL)
+    return false;
+  for (;;)
+    {
+      uint32_t head = hash_to_leaf (idx, hash);
+      uint32_t block = head;
+      uint32_t head_depth = 0;
+      size_t i;
+
+      /* Look for a free slot in the leaf and its overflow
+         chain. */
+      for (;;)
+        {
+          if (!read_block (dir, block, leaf))
+            goto done;
+          if (block == head)
+            head_depth = leaf->depth;
+          for (i = 0; i < LEAF_ENTRY_CNT; i++)
+            if (!leaf->entries[i].in_use)
+              {
+                success = (inode_write_at (dir->inode, e, sizeof *e,
+                                           entry_ofs (block, i))
+                           == sizeof *e);
+                goto done;
+              }
+          if (leaf->next == 0)
+            break;
+          block = leaf->next;
+        }
+
+      if (head_depth < idx->depth)
+        {
+          /* Split the full leaf, then try again. */
+          if (!read_block (dir, head, leaf)
+              || !split_leaf (dir, idx, head, leaf))
+            goto done;
+        }
+      else if (idx->depth < MAX_DEPTH)
+        {
+          /* Double the index, then try again. */
+          uint32_t n = 1u << idx->depth;
+          memcpy (idx->leaves + n, idx->leaves, n * sizeof *idx->leaves);
+          idx->depth++;
+          if (!write_block (dir, 0, idx))
+            goto done;
+        }
+      else
+        {
+          /* Chain a new overflow leaf to the last one. */
+          uint32_t new_block = idx->block_cnt++;
+          leaf->next = new_block;
+          if (!write_block (dir, block, leaf))
+            goto done;
+          memset (leaf, 0, sizeof *leaf);
+          leaf->depth = head_depth;
+          leaf->entries[0] = *e;
+          success = write_block (dir, new_block, leaf)
+                    && write_block (dir, 0, idx);
+          goto done;
+        }
+    }
+
+ done:
+  free (leaf);
+  return success;
+}
+
+/* Splits LEAF, which is block BLOCK of indexed directory DIR and
+   has no overflow leaves, into two leaves that share one more
+   hash bit.  Updates the index IDX to match.  Returns true if
+   successful, false on failure. */
+static bool
+split_leaf (struct dir *dir, struct dir_index *idx, uint32_t block,
+            struct dir_leaf *leaf)
+{
+  struct dir_leaf *new_leaf;
+  uint32_t new_block = idx->block_cnt++;
+  unsigned bit = 1u << leaf->depth;
+  size_t i, j;
+  bool success;
+
+  ASSERT (leaf->next == 0);
+  new_leaf = calloc (1, sizeof *new_leaf);
+  if (new_leaf == NULL)
+    return false;
+
+  /* Move the entries with the new hash bit set. */
+  leaf->depth++;
+  new_leaf->depth = leaf->depth;
+  for (i = j = 0; i < LEAF_ENTRY_CNT; i++)
+    {
+      struct dir_entry *e = &leaf->entries[i];
+      if (e->in_use && (hash_string (e->name) & bit))
+        {
+          new_leaf->entries[j++] = *e;
+          e->in_use = false;
+        }
+    }
+
+  /* Point the index slots with the new bit set at the new
+     leaf. */
+  for (i = 0; i < (1u << idx->depth); i++)
+    if (idx->leaves[i] == block && (i & bit))
+      idx->leaves[i] = new_block;
+
+  success = (write_block (dir, new_block, new_leaf)
+             && write_block (dir, block, leaf)
+             && write_block (dir, 0, idx));
+  free (new_leaf);
+  return success;
+}
+
+/* Converts linear directory DIR to the indexed format, storing
+   its new index block into *IDX.  Returns true if successful,
+   false on failure. */
+static bool
+convert_to_index (struct dir *dir, struct dir_index *idx)
+{
+  struct dir_entry *entries;
+  struct dir_leaf *leaf;
+  size_t cnt = 0;
+  size_t i;
+  off_t ofs;
+  bool success = false;
+
+  /* Read the linear entries. */
+  entries = malloc (inode_length (dir->inode));
+  leaf = calloc (1, sizeof *leaf);
+  if (entries == NULL || leaf == NULL)
+    goto done;
+  for (ofs = 0;
+       inode_read_at (dir->inode, &entries[cnt], sizeof *entries, ofs)
+       == sizeof *entries;
+       ofs += sizeof *entries)
+    if (entries[cnt].in_use)
+      cnt++;
+
+  /* Write an index with one empty leaf, then add the entries. */
+  memset (idx, 0, sizeof *idx);
+  idx->magic = DIR_INDEX_MAGIC;
+  idx->depth = 0;
+  idx->block_cnt = 2;
+  idx->leaves[0] = 1;
+  if (!write_block (dir, 1, leaf) || !write_block (dir, 0, idx))
+    goto done;
+  for (i = 0; i < cnt; i++)
+    if (!index_add (dir, idx, &entries[i]))
+      goto done;
+  success = true;
+
+ done:
+  free (entries);
+  free (leaf);
+  return success;
+}
@@ -1,7 +1,12 @@
 #include "filesys/file.h"
 #include <debug.h>
+#include "devices/block.h"
 #include "filesys/inode.h"
-#include "kernel/malloc.h"
+#include "kernel/slab.h"
+
+/* Read-ahead window bounds, in sectors. */
+#define RA_MIN_SECTORS 4
+#define RA_MAX_SECTORS 32
 
 /* An open file. */
 struct file 
@@ -9,26 +14,46 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+
+    /* Sequential read detection, see note_read(). */
+    off_t ra_next;              /* Where a sequential read would start. */
+    off_t ra_end;               /* End of data already read ahead. */
+    int ra_window;              /* Read-ahead window in sectors, or 0. */
   };
 
+static void note_read (struct file *, off_t ofs, off_t size);
+
+/* Cache of struct file. */
+static struct kmem_cache *file_cache;
+
+/* Initializes the file module. */
+void
+file_init (void)
+{
+  file_cache = kmem_cache_create ("file", sizeof (struct file), NULL);
+}
+
 /* Opens a file for the given INODE, of which it takes ownership,
    and returns the new file.  Returns a null pointer if an
    allocation fails or if INODE is null. */
 struct file *
 file_open (struct inode *inode) 
 {
-  struct file *file = calloc (1, sizeof *file);
+  struct file *file = kmem_cache_alloc (file_cache);
   if (inode != NULL && file != NULL)
     {
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->ra_next = 0;
+      file->ra_end = 0;
+      file->ra_window = 0;
       return file;
     }
   else
     {
       inode_close (inode);
-      free (file);
+      kmem_cache_free (file_cache, file);
       return NULL; 
     }
 }
@@ -49,7 +74,7 @@ file_close (struct file *file)
     {
       file_allow_write (file);
       inode_close (file->inode);
-      free (file); 
+      kmem_cache_free (file_cache, file); 
     }
 }
 
@@ -69,6 +94,7 @@ off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
   off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  note_read (file, file->pos, bytes_read);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -81,15 +107,16 @@ file_read (struct file *file, void *buffer, off_t size)
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) 
 {
-  return inode_read_at (file->inode, buffer, size, file_ofs);
+  off_t bytes_read = inode_read_at (file->inode, buffer, size, file_ofs);
+  note_read (file, file_ofs, bytes_read);
+  return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into FILE,
    starting at the file's current position.
    Returns the number of bytes actually written,
-   which may be less than SIZE if end of file is reached.
-   (Normally we'd grow the file in that case, but file growth is
-   not yet implemented.)
+   which may be less than SIZE if the disk is full.
+   Writing past end of file extends the file.
    Advances FILE's position by the number of bytes read. */
 off_t
 file_write (struct file *file, const void *buffer, off_t size) 
@@ -102,9 +129,8 @@ file_write (struct file *file, const void *buffer, off_t size)
 /* Writes SIZE bytes from BUFFER into FILE,
    starting at offset FILE_OFS in the file.
    Returns the number of bytes actually written,
-   which may be less than SIZE if end of file is reached.
-   (Normally we'd grow the file in that case, but file growth is
-   not yet implemented.)
+   which may be less than SIZE if the disk is full.
+   Writing past end of file extends the file.
    The file's current position is unaffected. */
 off_t
 file_write_at (struct file *file, const void *buffer, off_t size,
@@ -113,6 +139,15 @@ file_write_at (struct file *file, const void *buffer, off_t size,
   return inode_write_at (file->inode, buffer, size, file_ofs);
 }
 
+/* Writes any of FILE's data still held in the buffer cache
+   back to disk. */
+void
+file_flush (struct file *file)
+{
+  ASSERT (file != NULL);
+  inode_flush (file->inode);
+}
+
 /* Prevents write operations on FILE's underlying inode
    until file_allow_write() is called or FILE is closed. */
 void
@@ -176,3 +211,48 @@ file_tell (struct file *file)
   ASSERT (file != NULL);
   return file->pos;
 }
+
+/* Records that SIZE bytes were just read from FILE at offset
+   OFS, and asks for the data after it to be read ahead if FILE
+   is being read sequentially.
+
+   A read that starts where the previous one ended is
+   sequential.  The first sequential read opens a window of
+   RA_MIN_SECTORS sectors past the end of the read, and each one
+   after that doubles it, up to RA_MAX_SECTORS.  Any other read
+   is a seek, which closes the window until reads turn
+   sequential again.  Sectors already read ahead are not asked
+   for twice. */
+static void
+note_read (struct file *file, off_t ofs, off_t size)
+{
+  off_t end;
+
+  if (size <= 0)
+    return;
+
+  if (ofs == file->ra_next)
+    {
+      if (file->ra_window == 0)
+        file->ra_window = RA_MIN_SECTORS;
+      else if (file->ra_window < RA_MAX_SECTORS)
+        file->ra_window *= 2;
+    }
+  else
+    {
+      file->ra_window = 0;
+      file->ra_end = 0;
+    }
+  file->ra_next = ofs + size;
+  if (file->ra_window == 0)
+    return;
+
+  end = file->ra_next + file->ra_window * BLOCK_SECTOR_SIZE;
+  if (file->ra_end < file->ra_next)
+    file->ra_end = file->ra_next;
+  if (file->ra_end < end)
+    {
+      inode_read_ahead (file->inode, file->ra_end, end - file->ra_end);
+      file->ra_end = end;
+    }
+}
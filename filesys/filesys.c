@@ -2,10 +2,13 @@
 #include <debug.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
+#include "filesys/journal.h"
 
 /* Partition that contains the file system. */
 struct block *fs_device;
@@ -13,7 +16,8 @@ struct block *fs_device;
 static void do_format (void);
 
 /* Initializes the file system module.
-   If FORMAT is true, reformats the file system. */
+   If FORMAT is true, reformats the file system; otherwise,
+   replays its journal. */
 void
 filesys_init (bool format) 
 {
@@ -21,8 +25,13 @@ filesys_init (bool format)
   if (fs_device == NULL)
     PANIC ("No file system device found, can't initialize file system.");
 
+  cache_init ();
+  file_init ();
+  dir_init ();
+  dcache_init ();
   inode_init ();
   free_map_init ();
+  journal_init (format);
 
   if (format) 
     do_format ();
@@ -35,10 +44,24 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  inode_commit_all ();
   free_map_close ();
+  journal_checkpoint ();
+}
+
+/* Gives disk sectors to all file data whose allocation has been
+   delayed and commits the journal, which writes back the free
+   map, then writes everything in the buffer cache to disk and
+   makes it durable. */
+void
+filesys_sync (void)
+{
+  inode_commit_all ();
+  journal_checkpoint ();
 }
 
-/* Creates a file named NAME with the given INITIAL_SIZE.
+/* Creates a file named NAME with the given INITIAL_SIZE, with
+   its inode placed near its directory's.
    Returns true if successful, false otherwise.
    Fails if a file named NAME already exists,
    or if internal memory allocation fails. */
@@ -46,14 +69,20 @@ bool
 filesys_create (const char *name, off_t initial_size) 
 {
   block_sector_t inode_sector = 0;
-  struct dir *dir = dir_open_root ();
-  bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
-                  && inode_create (inode_sector, initial_size)
-                  && dir_add (dir, name, inode_sector));
+  struct dir *dir;
+  bool success;
+
+  journal_begin ();
+  dir = dir_open_root ();
+  success = (dir != NULL
+             && free_map_allocate_near
+                  (1, inode_get_inumber (dir_get_inode (dir)), &inode_sector)
+             && inode_create (inode_sector, initial_size)
+             && dir_add (dir, name, inode_sector));
   if (!success && inode_sector != 0) 
     free_map_release (inode_sector, 1);
   dir_close (dir);
+  journal_end ();
 
   return success;
 }
@@ -1,70 +1,312 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "kernel/malloc.h"
+#include "kernel/synch.h"
+
+/* The free map file holds the free map bitmap, padded to a whole
+   number of sectors, followed by a summary that gives the number
+   of free sectors in each "group" of sectors whose bits share
+   one sector of the bitmap.
+
+   Only the summary is read when the file system is mounted.  A
+   group's bitmap sector is read the first time the group is
+   needed; until then all its bits are set in memory, so that
+   bitmap scans never choose them.  Changed bitmap sectors, and
+   the summary sectors that count their groups, are only written
+   back when the journal commits, so an allocation charges its
+   journal operation for the sectors that it will change then.
+
+   Sectors that a transaction frees stay in use, marked in
+   RELEASED, until the transaction commits.  Until then a crash
+   would undo the freeing, leaving the sectors in use by whatever
+   had them, so they must not be given to anything else,
+   especially not to file data, which is written in place.  A
+   commit frees only as many groups' worth of them as the room
+   left in the transaction allows, leaving the rest for the next
+   commit. */
+
+/* Number of sectors in a group. */
+#define GROUP_SECTORS (BLOCK_SECTOR_SIZE * 8)
+
+/* Most sectors of the free map file that changing one group
+   changes: its bitmap sector and the summary sector that counts
+   its free sectors. */
+#define GROUP_COST 2
+
+/* Requests for at least this many sectors are placed in the
+   smallest free run that holds them, instead of the first one
+   found near the hint. */
+#define BEST_FIT_MIN 64
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct lock free_map_lock;    /* Protects the free map. */
+
+/* Per-group state, protected by free_map_lock. */
+static size_t group_cnt;             /* Number of groups. */
+static uint16_t *group_free;         /* Free sectors in each group. */
+static struct bitmap *loaded_groups; /* Groups read from disk. */
+static struct bitmap *dirty_groups;  /* Groups changed since flush. */
+static struct bitmap *released;      /* Sectors freed by the running
+                                        transaction. */
+static struct bitmap *released_groups; /* Groups with RELEASED sectors. */
+
+/* Free sector accounting, protected by free_map_lock.
+   Sectors that are free but reserved by free_map_reserve() may
+   only be allocated with free_map_claim(). */
+static size_t free_cnt;              /* Number of free sectors. */
+static size_t reserved_cnt;          /* Number of those reserved. */
+
+/* Statistics. */
+static unsigned long long near_cnt;  /* Allocations in the hint's group. */
+static unsigned long long far_cnt;   /* Allocations elsewhere. */
+
+static bool allocate (size_t cnt, block_sector_t hint,
+                      block_sector_t *sectorp);
+static size_t near_fit (size_t cnt, block_sector_t hint);
+static size_t best_fit (size_t cnt, block_sector_t hint);
+static size_t any_fit (size_t cnt);
+static size_t find_run (size_t start, size_t end, size_t cnt, size_t *lenp);
+static size_t nth_group (size_t home, size_t n);
+static void set_sectors (block_sector_t, size_t cnt, bool used);
+static void load_groups (size_t first, size_t last);
+static bool has_changes (void);
+static void apply_releases (size_t room);
+static off_t summary_ofs (void);
+static void flush (size_t room);
 
 /* Initializes the free map. */
 void
 free_map_init (void) 
 {
-  free_map = bitmap_create (block_size (fs_device));
-  if (free_map == NULL)
+  size_t sector_cnt = block_size (fs_device);
+  size_t i;
+
+  lock_init (&free_map_lock);
+  free_map = bitmap_create (sector_cnt);
+  group_cnt = DIV_ROUND_UP (sector_cnt, GROUP_SECTORS);
+  group_free = calloc (group_cnt, sizeof *group_free);
+  loaded_groups = bitmap_create (group_cnt);
+  dirty_groups = bitmap_create (group_cnt);
+  released = bitmap_create (sector_cnt);
+  released_groups = bitmap_create (group_cnt);
+  if (free_map == NULL || group_free == NULL
+      || loaded_groups == NULL || dirty_groups == NULL
+      || released == NULL || released_groups == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
-  bitmap_mark (free_map, FREE_MAP_SECTOR);
-  bitmap_mark (free_map, ROOT_DIR_SECTOR);
+
+  /* Until the free map is read from disk, every group is loaded
+     and every sector but the fixed ones is free. */
+  bitmap_set_all (loaded_groups, true);
+  for (i = 0; i < group_cnt; i++)
+    group_free[i] = (i + 1 < group_cnt
+                     ? GROUP_SECTORS : sector_cnt - i * GROUP_SECTORS);
+  free_cnt = sector_cnt;
+  set_sectors (FREE_MAP_SECTOR, 1, true);
+  set_sectors (ROOT_DIR_SECTOR, 1, true);
+  set_sectors (JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+  reserved_cnt = 0;
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   unreserved sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
-    {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
-    }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
-  return sector != BITMAP_ERROR;
+  return free_map_allocate_near (cnt, 0, sectorp);
+}
+
+/* Allocates CNT consecutive sectors from the free map, as close
+   as possible to sector HINT, and stores the first into
+   *SECTORP.
+   Returns true if successful, false if not enough consecutive
+   unreserved sectors were available. */
+bool
+free_map_allocate_near (size_t cnt, block_sector_t hint,
+                        block_sector_t *sectorp)
+{
+  bool success = false;
+
+  lock_acquire (&free_map_lock);
+  if (free_cnt - reserved_cnt >= cnt)
+    success = allocate (cnt, hint, sectorp);
+  lock_release (&free_map_lock);
+  return success;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Frees the CNT sectors starting at SECTOR.  They become
+   available for use once the running transaction commits.  Must
+   be called between journal_begin() and journal_end(). */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  size_t first = sector / GROUP_SECTORS;
+  size_t last = (sector + cnt - 1) / GROUP_SECTORS;
+  size_t g;
+
+  journal_revoke (sector, cnt);
+  lock_acquire (&free_map_lock);
+  load_groups (first, last);
   ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  ASSERT (bitmap_none (released, sector, cnt));
+  bitmap_set_multiple (released, sector, cnt, true);
+  for (g = first; g <= last; g++)
+    bitmap_mark (released_groups, g);
+  lock_release (&free_map_lock);
+}
+
+/* Sets aside CNT free sectors, without choosing which ones, so
+   that a later free_map_claim() of them cannot fail for lack of
+   space.  Returns true if successful, false if fewer than CNT
+   sectors are free and unreserved. */
+bool
+free_map_reserve (size_t cnt)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = free_cnt - reserved_cnt >= cnt;
+  if (success)
+    reserved_cnt += cnt;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Gives back CNT sectors reserved with free_map_reserve(). */
+void
+free_map_unreserve (size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (reserved_cnt >= cnt);
+  reserved_cnt -= cnt;
+  lock_release (&free_map_lock);
+}
+
+/* Allocates CNT consecutive sectors out of those reserved with
+   free_map_reserve(), as close as possible to sector HINT, and
+   stores the first into *SECTORP.
+   Returns true if successful, false if there is no run of CNT
+   free sectors, in which case the reservation is unchanged. */
+bool
+free_map_claim (size_t cnt, block_sector_t hint, block_sector_t *sectorp)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  ASSERT (reserved_cnt >= cnt);
+  success = allocate (cnt, hint, sectorp);
+  if (success)
+    reserved_cnt -= cnt;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Returns the most sectors of the running transaction that
+   allocating CNT consecutive sectors can charge for, which is
+   GROUP_COST for each group that the sectors could span. */
+size_t
+free_map_cost (size_t cnt)
+{
+  ASSERT (cnt > 0);
+  return (DIV_ROUND_UP (cnt - 1, GROUP_SECTORS) + 1) * GROUP_COST;
+}
+
+/* Makes the sectors freed by the running transaction available
+   for use, and writes the parts of the free map that changed
+   back to the free map file, as part of the transaction, without
+   changing more than ROOM sectors of the file.  The groups that
+   allocations changed are always written, because the
+   allocations were charged for them; sectors freed in other
+   groups may have to wait for the next commit.
+   Called by the journal when it commits the transaction, once
+   its operations have ended.  No operation can allocate the
+   freed sectors before the transaction is in the log, because
+   no operation can begin until then. */
+void
+free_map_commit (size_t room)
+{
+  journal_begin ();
+  lock_acquire (&free_map_lock);
+  if (free_map_file != NULL)
+    {
+      apply_releases (room);
+      flush (room);
+    }
+  lock_release (&free_map_lock);
+  journal_end ();
+}
+
+/* Prints free map statistics.  Fragmentation is reported only
+   for the groups that have been read from disk. */
+void
+free_map_print_stats (void)
+{
+  size_t run_cnt = 0, largest = 0;
+  size_t start, len;
+
+  lock_acquire (&free_map_lock);
+  for (start = 0;
+       (start = find_run (start, bitmap_size (free_map), 1, &len))
+         != BITMAP_ERROR;
+       start += len)
+    {
+      run_cnt++;
+      if (len > largest)
+        largest = len;
+    }
+  printf ("Free map: %zu of %zu sectors free, %zu of %zu groups loaded, "
+          "%zu free extents (largest %zu), "
+          "%llu allocations near hint, %llu far\n",
+          free_cnt, bitmap_size (free_map),
+          bitmap_count (loaded_groups, 0, group_cnt, true), group_cnt,
+          run_cnt, largest, near_cnt, far_cnt);
+  lock_release (&free_map_lock);
 }
 
-/* Opens the free map file and reads it from disk. */
+/* Opens the free map file and reads its summary from disk.  The
+   bitmap itself is read piecemeal, as it is needed. */
 void
 free_map_open (void) 
 {
+  size_t i;
+
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_read (free_map, free_map_file))
+  inode_set_metadata (file_get_inode (free_map_file));
+
+  lock_acquire (&free_map_lock);
+  bitmap_set_all (free_map, true);
+  bitmap_set_all (loaded_groups, false);
+  bitmap_set_all (dirty_groups, false);
+  if (file_read_at (free_map_file, group_free,
+                    group_cnt * sizeof *group_free, summary_ofs ())
+      != (off_t) (group_cnt * sizeof *group_free))
     PANIC ("can't read free map");
+  free_cnt = 0;
+  for (i = 0; i < group_cnt; i++)
+    free_cnt += group_free[i];
+  lock_release (&free_map_lock);
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
+  while (has_changes ())
+    journal_commit ();
   file_close (free_map_file);
+  free_map_file = NULL;
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -72,14 +314,357 @@ free_map_close (void)
 void
 free_map_create (void) 
 {
+  static const uint8_t zeros[BLOCK_SECTOR_SIZE];
+  off_t size = summary_ofs () + group_cnt * sizeof *group_free;
+  struct file *file;
+  off_t ofs;
+
   /* Create inode. */
-  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map)))
+  if (!inode_create (FREE_MAP_SECTOR, size))
     PANIC ("free map creation failed");
+  file = file_open (inode_open (FREE_MAP_SECTOR));
+  if (file == NULL)
+    PANIC ("can't open free map");
+  inode_set_metadata (file_get_inode (file));
 
-  /* Write bitmap to file. */
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
+  /* The file starts out as a hole.  Give it all of its sectors
+     now, because writing into a hole changes the free map, which
+     must not happen while the free map is being written.  That
+     may take more than one transaction, so the free map stays
+     unwritten, with FREE_MAP_FILE null, until it is done. */
+  for (ofs = 0; ofs < size; ofs += BLOCK_SECTOR_SIZE)
+    {
+      off_t chunk = size - ofs < BLOCK_SECTOR_SIZE ? size - ofs
+                                                   : BLOCK_SECTOR_SIZE;
+      if (file_write_at (file, zeros, chunk, ofs) != chunk)
+        PANIC ("free map creation failed");
+    }
+  inode_commit (file_get_inode (file));
+
+  /* Write bitmap and summary to file, over as many commits as
+     it takes. */
+  lock_acquire (&free_map_lock);
+  free_map_file = file;
+  bitmap_set_all (dirty_groups, true);
+  lock_release (&free_map_lock);
+  while (has_changes ())
+    journal_commit ();
+}
+
+/* Allocates CNT consecutive free sectors close to sector HINT,
+   storing the first into *SECTORP.  Small requests take the
+   first run found, searching outward from HINT's group; large
+   ones take the smallest run that fits.  Groups are read from
+   disk only as the search reaches them.  FREE_MAP_LOCK must be
+   held. */
+static bool
+allocate (size_t cnt, block_sector_t hint, block_sector_t *sectorp)
+{
+  size_t sector;
+  size_t changed = 0;
+  size_t g, last;
+
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+  ASSERT (cnt > 0);
+
+  if (cnt > free_cnt)
+    return false;
+  if (hint >= bitmap_size (free_map))
+    hint = 0;
+
+  sector = cnt >= BEST_FIT_MIN ? best_fit (cnt, hint) : near_fit (cnt, hint);
+  if (sector == BITMAP_ERROR)
+    sector = any_fit (cnt);
+  if (sector == BITMAP_ERROR)
+    return false;
+
+  if (sector / GROUP_SECTORS == hint / GROUP_SECTORS)
+    near_cnt++;
+  else
+    far_cnt++;
+
+  /* Charge for the groups that the commit will have to write. */
+  last = (sector + cnt - 1) / GROUP_SECTORS;
+  for (g = sector / GROUP_SECTORS; g <= last; g++)
+    if (!bitmap_test (dirty_groups, g))
+      changed++;
+  if (changed > 0)
+    journal_charge (changed * GROUP_COST);
+
+  set_sectors (sector, cnt, true);
+  *sectorp = sector;
+  return true;
+}
+
+/* Returns the first run of CNT free sectors found by searching
+   the groups in order of distance from HINT's group, starting
+   at HINT itself, or BITMAP_ERROR if none is found.  Skips
+   groups with fewer than CNT free sectors.  FREE_MAP_LOCK must
+   be held. */
+static size_t
+near_fit (size_t cnt, block_sector_t hint)
+{
+  size_t home = hint / GROUP_SECTORS;
+  size_t n;
+
+  for (n = 0; n < 2 * group_cnt; n++)
+    {
+      size_t g = nth_group (home, n);
+      size_t start, end, sector;
+
+      if (g == SIZE_MAX || group_free[g] < cnt)
+        continue;
+      load_groups (g, g);
+      start = g * GROUP_SECTORS;
+      end = start + GROUP_SECTORS;
+      if (g == home)
+        {
+          sector = find_run (hint, end, cnt, NULL);
+          if (sector == BITMAP_ERROR)
+            sector = find_run (start, hint, cnt, NULL);
+        }
+      else
+        sector = find_run (start, end, cnt, NULL);
+      if (sector != BITMAP_ERROR)
+        return sector;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Returns the start of the smallest run of at least CNT free
+   sectors that begins in a group with at least CNT free
+   sectors, preferring groups nearer HINT's among equals, or
+   BITMAP_ERROR if there is none.  FREE_MAP_LOCK must be
+   held. */
+static size_t
+best_fit (size_t cnt, block_sector_t hint)
+{
+  size_t home = hint / GROUP_SECTORS;
+  size_t best = BITMAP_ERROR, best_len = 0;
+  size_t n;
+
+  for (n = 0; n < 2 * group_cnt; n++)
+    {
+      size_t g = nth_group (home, n);
+      size_t start, end, len;
+
+      if (g == SIZE_MAX || group_free[g] < cnt)
+        continue;
+      load_groups (g, g);
+      end = (g + 1) * GROUP_SECTORS;
+      for (start = g * GROUP_SECTORS;
+           (start = find_run (start, end, cnt, &len)) != BITMAP_ERROR;
+           start += len)
+        if (best == BITMAP_ERROR || len < best_len)
+          {
+            best = start;
+            best_len = len;
+            if (len == cnt)
+              return best;
+          }
+    }
+  return best;
+}
+
+/* Returns the first run of CNT free sectors anywhere on disk, or
+   BITMAP_ERROR if there is none.  Reads every group that has any
+   free sectors.  FREE_MAP_LOCK must be held. */
+static size_t
+any_fit (size_t cnt)
+{
+  size_t g;
+
+  for (g = 0; g < group_cnt; g++)
+    if (group_free[g] > 0)
+      load_groups (g, g);
+  return find_run (0, bitmap_size (free_map), cnt, NULL);
+}
+
+/* Returns the start of the first run of at least CNT free
+   sectors that begins at or after START and before END, storing
+   its full length into *LENP if LENP is non-null.  The run may
+   extend past END.  Returns BITMAP_ERROR if there is no such
+   run.  FREE_MAP_LOCK must be held. */
+static size_t
+find_run (size_t start, size_t end, size_t cnt, size_t *lenp)
+{
+  if (end > bitmap_size (free_map))
+    end = bitmap_size (free_map);
+  while (start < end)
+    {
+      size_t run_end;
+
+      start = bitmap_next (free_map, start, false);
+      if (start == BITMAP_ERROR || start >= end)
+        break;
+      run_end = bitmap_next (free_map, start, true);
+      if (run_end == BITMAP_ERROR)
+        run_end = bitmap_size (free_map);
+      if (run_end - start >= cnt)
+        {
+          if (lenp != NULL)
+            *lenp = run_end - start;
+          return start;
+        }
+      start = run_end;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Returns the group N steps along the search order that starts
+   at group HOME and alternates outward: HOME, HOME + 1,
+   HOME - 1, HOME + 2, and so on.  Returns SIZE_MAX if that group
+   does not exist. */
+static size_t
+nth_group (size_t home, size_t n)
+{
+  size_t dist = (n + 1) / 2;
+
+  if (n % 2 == 1)
+    return home + dist < group_cnt ? home + dist : SIZE_MAX;
+  else
+    return home >= dist ? home - dist : SIZE_MAX;
+}
+
+/* Marks the CNT sectors starting at SECTOR, which must already
+   be loaded, as used or free according to USED, and updates the
+   group summary and free count to match.  FREE_MAP_LOCK must be
+   held, except during initialization. */
+static void
+set_sectors (block_sector_t sector, size_t cnt, bool used)
+{
+  block_sector_t end = sector + cnt;
+
+  bitmap_set_multiple (free_map, sector, cnt, used);
+  if (used)
+    free_cnt -= cnt;
+  else
+    free_cnt += cnt;
+
+  while (sector < end)
+    {
+      size_t g = sector / GROUP_SECTORS;
+      block_sector_t group_end = (g + 1) * GROUP_SECTORS;
+      size_t n = (end < group_end ? end : group_end) - sector;
+
+      ASSERT (bitmap_test (loaded_groups, g));
+      if (used)
+        group_free[g] -= n;
+      else
+        group_free[g] += n;
+      bitmap_mark (dirty_groups, g);
+      sector += n;
+    }
+}
+
+/* Reads groups FIRST through LAST, inclusive, from disk, unless
+   they are already loaded.  FREE_MAP_LOCK must be held. */
+static void
+load_groups (size_t first, size_t last)
+{
+  size_t g;
+
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+  for (g = first; g <= last; g++)
+    if (!bitmap_test (loaded_groups, g))
+      {
+        if (!bitmap_read_part (free_map, free_map_file,
+                               g * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE))
+          PANIC ("can't read free map");
+        bitmap_mark (loaded_groups, g);
+      }
+}
+
+/* Returns true if any part of the free map has changed since
+   it was last written back, or has sectors waiting to be
+   freed. */
+static bool
+has_changes (void)
+{
+  bool changes;
+
+  lock_acquire (&free_map_lock);
+  changes = (bitmap_any (dirty_groups, 0, group_cnt)
+             || bitmap_any (released_groups, 0, group_cnt));
+  lock_release (&free_map_lock);
+  return changes;
+}
+
+/* Marks the sectors in RELEASED free, and clears them from
+   RELEASED, but only in groups that are already changed or
+   that can be changed without changing more than ROOM sectors
+   of the free map file in all.  FREE_MAP_LOCK must be held. */
+static void
+apply_releases (size_t room)
+{
+  size_t changed = bitmap_count (dirty_groups, 0, group_cnt, true);
+  size_t g;
+
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+  for (g = 0; g < group_cnt; g++)
+    if (bitmap_test (released_groups, g))
+      {
+        size_t end = (g + 1) * GROUP_SECTORS;
+        size_t start, run_end;
+
+        if (!bitmap_test (dirty_groups, g))
+          {
+            if ((changed + 1) * GROUP_COST > room)
+              continue;
+            changed++;
+          }
+        if (end > bitmap_size (released))
+          end = bitmap_size (released);
+        for (start = g * GROUP_SECTORS;
+             (start = bitmap_next (released, start, true)) < end;
+             start = run_end)
+          {
+            run_end = bitmap_next (released, start, false);
+            if (run_end > end)
+              run_end = end;
+            set_sectors (start, run_end - start, false);
+            bitmap_set_multiple (released, start, run_end - start, false);
+          }
+        bitmap_reset (released_groups, g);
+      }
+}
+
+/* Returns the offset of the group summary in the free map
+   file. */
+static off_t
+summary_ofs (void)
+{
+  return ROUND_UP (bitmap_file_size (free_map), BLOCK_SECTOR_SIZE);
+}
+
+/* Writes each dirty group's bitmap sector and the summary
+   sector that counts it, as long as that changes no more than
+   ROOM sectors of the free map file.  FREE_MAP_LOCK must be
+   held. */
+static void
+flush (size_t room)
+{
+  const size_t summary_size = group_cnt * sizeof *group_free;
+  size_t g;
+
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
   if (free_map_file == NULL)
-    PANIC ("can't open free map");
-  if (!bitmap_write (free_map, free_map_file))
-    PANIC ("can't write free map");
+    return;
+
+  for (g = 0; g < group_cnt && room >= GROUP_COST; g++)
+    if (bitmap_test (dirty_groups, g))
+      {
+        size_t ofs = ROUND_DOWN (g * sizeof *group_free, BLOCK_SECTOR_SIZE);
+        size_t size = (summary_size - ofs < BLOCK_SECTOR_SIZE
+                       ? summary_size - ofs : BLOCK_SECTOR_SIZE);
+
+        if (!bitmap_write_part (free_map, free_map_file,
+                                g * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE)
+            || (file_write_at (free_map_file, (uint8_t *) group_free + ofs,
+                               size, summary_ofs () + ofs)
+                != (off_t) size))
+          PANIC ("can't write free map");
+        bitmap_reset (dirty_groups, g);
+        room -= GROUP_COST;
+      }
 }
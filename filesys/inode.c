@@ -1,23 +1,86 @@
 #include "filesys/inode.h"
+#include <hash.h>
 #include <list.h>
 #include <debug.h>
 #include <round.h>
+#include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "kernel/malloc.h"
+#include "kernel/slab.h"
+#include "kernel/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Number of extents stored in the inode itself and in each
+   indirect extent block. */
+#define DIRECT_EXTENT_CNT 41
+#define INDIRECT_EXTENT_CNT 42
+
+/* Maximum number of sectors whose allocation an inode may delay
+   before it is forced to allocate them. */
+#define DELAYED_MAX 64
+
+/* Maximum number of extents in a file, which bounds its indirect
+   extent blocks, so that writing all of them back along with the
+   inode fits in one journal transaction. */
+#define INDIRECT_MAX 32
+#define EXTENT_MAX (DIRECT_EXTENT_CNT + INDIRECT_MAX * INDIRECT_EXTENT_CNT)
+
+/* Maximum size of a file whose data is stored in its inode, in
+   place of its direct extents. */
+#define INLINE_MAX (DIRECT_EXTENT_CNT * sizeof (struct extent))
+
+/* inode_disk flags. */
+#define INODE_INLINE 0x1                /* Data stored in the inode. */
+
+/* A run of COUNT sectors of a file, starting at sector LOGICAL
+   within the file, stored in COUNT consecutive sectors of the
+   disk starting at START. */
+struct extent
+  {
+    uint32_t logical;                   /* First sector within file. */
+    block_sector_t start;               /* First sector on disk. */
+    uint32_t count;                     /* Number of sectors. */
+  };
+
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly BLOCK_SECTOR_SIZE bytes long.
+
+   A file's extents are kept in order of LOGICAL and do not
+   overlap.  Sectors of the file that no extent covers are holes,
+   which read as zeros.  The first DIRECT_EXTENT_CNT extents are
+   stored here, any further ones in a chain of indirect extent
+   blocks starting at INDIRECT.
+
+   If FLAGS includes INODE_INLINE, the file has no extents, and
+   its data, at most INLINE_MAX bytes of it, is stored in DATA
+   instead. */
 struct inode_disk
   {
-    block_sector_t start;               /* First data sector. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[125];               /* Not used. */
+    uint32_t extent_cnt;                /* Total number of extents. */
+    block_sector_t indirect;            /* First indirect block, or 0. */
+    uint32_t flags;                     /* INODE_INLINE, or 0. */
+    union
+      {
+        struct extent extents[DIRECT_EXTENT_CNT]; /* First extents. */
+        uint8_t data[INLINE_MAX];       /* Inline data. */
+      };
+  };
+
+/* On-disk indirect extent block.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct indirect_block
+  {
+    block_sector_t next;                /* Next indirect block, or 0. */
+    uint32_t extent_cnt;                /* Number of extents used. */
+    struct extent extents[INDIRECT_EXTENT_CNT]; /* Extents. */
   };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -28,80 +91,245 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
 }
 
-/* In-memory inode. */
+/* The contents of a sector of a file that has been written but
+   not yet given a place on disk. */
+struct delayed_block
+  {
+    struct list_elem elem;              /* Element in inode's list. */
+    size_t idx;                         /* Sector number within file. */
+    uint8_t data[BLOCK_SECTOR_SIZE];    /* Contents. */
+  };
+
+/* In-memory inode.
+
+   Disk space for a file's data is allocated lazily.  ALLOC_CNT
+   of the file's sectors are mapped by EXTENTS.  Any other sector
+   that has been written has only been reserved, with
+   free_map_reserve(), and its data lives in DELAYED until
+   inode_commit() gives it a disk sector, when the inode is
+   closed or flushed, or when too many have piled up; runs of
+   consecutive delayed sectors get as few extents as the free map
+   allows.  The rest of the file's sectors are holes, which read
+   as zeros and take no disk space.
+
+   Alternatively, a file no longer than INLINE_MAX bytes may keep
+   its data in INLINE_DATA, which is written to disk as part of
+   the inode's own sector.  A write that would make the file
+   longer moves the data into a delayed block first.
+
+   Each delayed block's reservation also covers the indirect
+   extent block that committing it could call for, in
+   INDIRECT_RSV, so that once commit() has placed a file's data,
+   recording where it went cannot fail for lack of space.  The
+   journal transaction may run out of room first, though, so
+   commit() places only as much as the transaction has room for,
+   and the caller commits the transaction and goes on in the
+   next one, if it can.
+
+   The inode's own sector and its indirect extent blocks are
+   always written through the journal, and so is its data if
+   METADATA is set, as it is for directories and the free map.
+   Every function below that may change any of them does so
+   between journal_begin() and journal_end(). */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
-    block_sector_t sector;              /* Sector number of disk location. */
+    /* Protected by inode_table_lock. */
+    struct hash_elem elem;              /* Element in inode_table. */
+    struct list_elem lru_elem;          /* Element in closed_list. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
+    bool loading;                       /* Still being read from disk? */
+
+    /* Owned by inode_commit_all(). */
+    struct list_elem commit_elem;       /* Element in its snapshot. */
+
+    block_sector_t sector;              /* Sector number of disk location. */
+    struct lock dir_lock;               /* See inode_lock_dir(). */
+
+    /* Protected by LOCK, which is held for reading to read them
+       and for writing to change them. */
+    struct rwlock lock;                 /* Guards the members below. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
-    struct inode_disk data;             /* Inode content. */
+    off_t length;                       /* File size in bytes. */
+    struct extent *extents;             /* Extents, sorted by LOGICAL. */
+    size_t extent_cnt;                  /* Number of extents. */
+    size_t extent_cap;                  /* Allocated size of EXTENTS. */
+    size_t first_dirty;                 /* First extent changed since
+                                           written to disk. */
+    block_sector_t *indirects;          /* Indirect extent blocks. */
+    size_t indirect_cnt;                /* Number of indirect blocks. */
+    size_t indirect_rsv;                /* Sectors reserved for more. */
+    size_t alloc_cnt;                   /* Number of sectors mapped. */
+    struct list delayed;                /* Unallocated written sectors. */
+    size_t delayed_cnt;                 /* Number of blocks in DELAYED. */
+    bool dirty;                         /* On-disk inode out of date? */
+    bool metadata;                      /* Journal data writes? */
+    uint8_t *inline_data;               /* Inline data, or null. */
   };
 
+/* Table of in-memory inodes, indexed by sector, so that opening
+   a single inode twice returns the same `struct inode'.
+
+   Besides the open inodes, the table holds up to CLOSED_MAX
+   inodes that have been closed by all of their openers but that
+   were clean when they were closed.  These are kept in
+   CLOSED_LIST, most recently closed first, so that opening one
+   of them again needs no disk I/O; beyond CLOSED_MAX, the least
+   recently closed is freed.  An inode that could not be
+   committed when it was closed, because the journal transaction
+   ran out of room in a nested operation, is kept in CLOSED_LIST
+   too, but stays there, however many there are, until it is
+   opened again or inode_commit_all() commits it.
+
+   inode_open() reads an inode from disk without holding
+   inode_table_lock, so that other opens and closes need not wait
+   for the disk.  It first inserts the new inode with LOADING set,
+   and any other thread that opens the same inode meanwhile waits
+   on LOADED until LOADING is cleared. */
+static struct hash inode_table;
+static struct list closed_list;
+static size_t closed_cnt;
+
+/* Protects inode_table, closed_list, closed_cnt, and the
+   statistics below, as well as the members of every inode
+   marked as protected by it.
+
+   Locks in the file system are acquired in this order:
+   a directory's dir_lock, inode_table_lock, an inode's LOCK,
+   the free map's lock, the free map file's inode's LOCK, and
+   the buffer cache's locks. */
+static struct lock inode_table_lock;
+static struct condition loaded;         /* Signaled when an inode is
+                                           done loading. */
+
+/* Serializes inode_commit_all(), the only user of inodes'
+   COMMIT_ELEM.  Nothing else acquires it, so it may be held
+   across journal operations. */
+static struct lock commit_all_lock;
+
+/* Maximum number of closed inodes kept in memory. */
+#define CLOSED_MAX 32
+
+/* Statistics. */
+static unsigned long long open_cnt;     /* Calls to inode_open(). */
+static unsigned long long revive_cnt;   /* Opens of closed inodes. */
+static unsigned long long read_cnt;     /* Opens that read the disk. */
+
+/* Caches of struct inode and struct delayed_block. */
+static struct kmem_cache *inode_cache;
+static struct kmem_cache *delayed_cache;
+
+static unsigned inode_hash (const struct hash_elem *, void *);
+static bool inode_less (const struct hash_elem *, const struct hash_elem *,
+                        void *);
+static void destroy_inode (struct inode *);
+static bool is_clean (const struct inode *);
+static void init_inode (struct inode *, block_sector_t);
+static bool load_extents (struct inode *, const struct inode_disk *);
+static void release_inode (struct inode *);
+static struct delayed_block *find_delayed (struct inode *, size_t idx);
+static void drop_delayed (struct inode *);
+static size_t next_extent (const struct inode *, size_t idx);
+static size_t indirects_needed (size_t extent_cnt);
+static bool reserve_delayed (struct inode *);
+static bool make_room (struct inode *, size_t extent_cnt);
+static void add_extent (struct inode *, size_t logical, block_sector_t start,
+                        size_t cnt);
+static list_less_func delayed_less;
+static size_t write_cost (const struct inode *, size_t first);
+static bool commit (struct inode *, size_t *needp);
+static bool commit_fully (struct inode *);
+static void write_inode (struct inode *, void *buffer);
+static void write_data (struct inode *, block_sector_t, const void *,
+                        size_t ofs, size_t size);
+static bool move_inline (struct inode *);
+
+/* Initializes the inode module. */
+void
+inode_init (void) 
+{
+  hash_init (&inode_table, inode_hash, inode_less, NULL);
+  list_init (&closed_list);
+  lock_init (&inode_table_lock);
+  cond_init (&loaded);
+  lock_init (&commit_all_lock);
+  inode_cache = kmem_cache_create ("inode", sizeof (struct inode), NULL);
+  delayed_cache = kmem_cache_create ("delayed block",
+                                     sizeof (struct delayed_block), NULL);
+}
+
 /* Returns the block device sector that contains byte offset POS
    within INODE.
    Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   POS or if that byte has not been allocated a sector, because
+   it is in a hole or its sector is delayed.
+   INODE's lock must be held, for reading or writing.
+
+   Uses binary search, so takes time logarithmic in the number of
+   extents. */
 static block_sector_t
 byte_to_sector (const struct inode *inode, off_t pos) 
 {
+  size_t idx, i;
+
   ASSERT (inode != NULL);
-  if (pos < inode->data.length)
-    return inode->data.start + pos / BLOCK_SECTOR_SIZE;
-  else
+  if (pos >= inode->length)
     return -1;
-}
-
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+  idx = pos / BLOCK_SECTOR_SIZE;
 
-/* Initializes the inode module. */
-void
-inode_init (void) 
-{
-  list_init (&open_inodes);
+  i = next_extent (inode, idx);
+  if (i > 0)
+    {
+      const struct extent *e = &inode->extents[i - 1];
+      if (idx < e->logical + e->count)
+        return e->start + (idx - e->logical);
+    }
+  return -1;
 }
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
-   device.
+   device.  The data is stored inline if it is short enough, and
+   is otherwise all one hole, which takes no disk space, so that
+   creating the inode writes only its own sector no matter how
+   long it is.
    Returns true if successful.
    Returns false if memory or disk allocation fails. */
 bool
 inode_create (block_sector_t sector, off_t length)
 {
-  struct inode_disk *disk_inode = NULL;
-  bool success = false;
+  struct inode *inode;
+  size_t need;
+  bool success;
 
   ASSERT (length >= 0);
 
-  /* If this assertion fails, the inode structure is not exactly
-     one sector in size, and you should fix that. */
-  ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
+  /* If these assertions fail, the inode structures are not
+     exactly one sector in size, and you should fix that. */
+  ASSERT (sizeof (struct inode_disk) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct indirect_block) == BLOCK_SECTOR_SIZE);
 
-  disk_inode = calloc (1, sizeof *disk_inode);
-  if (disk_inode != NULL)
+  inode = kmem_cache_alloc (inode_cache);
+  if (inode == NULL)
+    return false;
+  init_inode (inode, sector);
+  inode->length = length;
+  inode->dirty = true;
+  if ((size_t) length <= INLINE_MAX)
     {
-      size_t sectors = bytes_to_sectors (length);
-      disk_inode->length = length;
-      disk_inode->magic = INODE_MAGIC;
-      if (free_map_allocate (sectors, &disk_inode->start)) 
+      inode->inline_data = calloc (1, INLINE_MAX);
+      if (inode->inline_data == NULL)
         {
-          block_write (fs_device, sector, disk_inode);
-          if (sectors > 0) 
-            {
-              static char zeros[BLOCK_SECTOR_SIZE];
-              size_t i;
-              
-              for (i = 0; i < sectors; i++) 
-                block_write (fs_device, disk_inode->start + i, zeros);
-            }
-          success = true; 
-        } 
-      free (disk_inode);
+          destroy_inode (inode);
+          return false;
+        }
     }
+  journal_begin ();
+  rwlock_acquire_write (&inode->lock);
+  success = commit (inode, &need);
+  rwlock_release_write (&inode->lock);
+  journal_end ();
+  destroy_inode (inode);
   return success;
 }
 
@@ -111,33 +339,86 @@ inode_create (block_sector_t sector, off_t length)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
+  struct inode_disk *disk_inode;
+  bool loaded_ok = false;
 
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  /* Check whether this inode is already in memory, and revive
+     it if it was closed. */
+  lock_acquire (&inode_table_lock);
+  open_cnt++;
+  key.sector = sector;
+  e = hash_find (&inode_table, &key.elem);
+  if (e != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
+      inode = hash_entry (e, struct inode, elem);
+      if (inode->open_cnt == 0)
+        {
+          list_remove (&inode->lru_elem);
+          closed_cnt--;
+          revive_cnt++;
+        }
+      inode->open_cnt++;
+
+      /* If another thread is reading it from disk, wait for it.
+         The inode leaves the table if that fails. */
+      while (inode->loading)
+        cond_wait (&loaded, &inode_table_lock);
+      if (hash_find (&inode_table, &key.elem) != &inode->elem)
         {
-          inode_reopen (inode);
-          return inode; 
+          if (--inode->open_cnt == 0)
+            destroy_inode (inode);
+          inode = NULL;
         }
+      lock_release (&inode_table_lock);
+      return inode;
     }
 
-  /* Allocate memory. */
-  inode = malloc (sizeof *inode);
+  /* Allocate memory, and claim the inode's place in the table. */
+  inode = kmem_cache_alloc (inode_cache);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&inode_table_lock);
+      return NULL;
+    }
+  init_inode (inode, sector);
+  inode->loading = true;
+  hash_insert (&inode_table, &inode->elem);
+  read_cnt++;
+  lock_release (&inode_table_lock);
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
-  inode->sector = sector;
-  inode->open_cnt = 1;
-  inode->deny_write_cnt = 0;
-  inode->removed = false;
-  block_read (fs_device, inode->sector, &inode->data);
+  /* Read from disk. */
+  disk_inode = malloc (sizeof *disk_inode);
+  if (disk_inode != NULL)
+    {
+      cache_read (inode->sector, disk_inode);
+      inode->length = disk_inode->length;
+      if (disk_inode->flags & INODE_INLINE)
+        {
+          inode->inline_data = malloc (INLINE_MAX);
+          if (inode->inline_data != NULL)
+            memcpy (inode->inline_data, disk_inode->data, INLINE_MAX);
+          loaded_ok = inode->inline_data != NULL;
+        }
+      else
+        loaded_ok = load_extents (inode, disk_inode);
+      free (disk_inode);
+    }
+
+  /* Let any waiters have it. */
+  lock_acquire (&inode_table_lock);
+  inode->loading = false;
+  cond_broadcast (&loaded, &inode_table_lock);
+  if (!loaded_ok)
+    {
+      hash_delete (&inode_table, &inode->elem);
+      if (--inode->open_cnt == 0)
+        destroy_inode (inode);
+      inode = NULL;
+    }
+  lock_release (&inode_table_lock);
   return inode;
 }
 
@@ -146,7 +427,12 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&inode_table_lock);
+      ASSERT (inode->open_cnt > 0);
+      inode->open_cnt++;
+      lock_release (&inode_table_lock);
+    }
   return inode;
 }
 
@@ -158,31 +444,102 @@ inode_get_inumber (const struct inode *inode)
 }
 
 /* Closes INODE and writes it to disk.
-   If this was the last reference to INODE, frees its memory.
+   If this was the last reference to INODE, keeps it in memory
+   among the recently closed inodes, or, if it could not be
+   written or was removed, frees its memory.
    If INODE was also a removed inode, frees its blocks. */
 void
 inode_close (struct inode *inode) 
 {
+  bool committed = true;
+  size_t need = 0;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
-  /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  journal_begin ();
+
+  /* The last opener commits INODE before letting go of it.  The
+     commit does I/O, so it is done without inode_table_lock,
+     which means another thread may open INODE, and even write
+     to it, meanwhile; so check again afterward. */
+  for (;;)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
- 
-      /* Deallocate blocks if removed. */
+      lock_acquire (&inode_table_lock);
+      if (inode->open_cnt > 1)
+        {
+          inode->open_cnt--;
+          lock_release (&inode_table_lock);
+          journal_end ();
+          return;
+        }
+
       if (inode->removed) 
         {
+          /* Make INODE unreachable, then deallocate its blocks. */
+          inode->open_cnt = 0;
+          hash_delete (&inode_table, &inode->elem);
+          lock_release (&inode_table_lock);
+          rwlock_acquire_write (&inode->lock);
+          release_inode (inode);
           free_map_release (inode->sector, 1);
-          free_map_release (inode->data.start,
-                            bytes_to_sectors (inode->data.length)); 
+          rwlock_release_write (&inode->lock);
+          destroy_inode (inode);
+          journal_end ();
+          return;
         }
 
-      free (inode); 
+      if (!committed || is_clean (inode))
+        break;
+      lock_release (&inode_table_lock);
+
+      /* Allocate delayed blocks.  If the transaction runs out of
+         room, commit it and go on in the next one, unless this
+         is a nested operation. */
+      rwlock_acquire_write (&inode->lock);
+      committed = commit (inode, &need);
+      rwlock_release_write (&inode->lock);
+      if (!committed && need > 0 && journal_restart (need))
+        committed = true;
+    }
+
+  inode->open_cnt = 0;
+  if (committed || need > 0)
+    {
+      /* Keep it, freeing the least recently closed clean inode
+         if there are too many. */
+      list_push_front (&closed_list, &inode->lru_elem);
+      if (++closed_cnt > CLOSED_MAX)
+        {
+          struct list_elem *e;
+
+          for (e = list_rbegin (&closed_list); e != list_rend (&closed_list);
+               e = list_prev (e))
+            {
+              struct inode *victim = list_entry (e, struct inode, lru_elem);
+              if (is_clean (victim))
+                {
+                  list_remove (e);
+                  closed_cnt--;
+                  hash_delete (&inode_table, &victim->elem);
+                  destroy_inode (victim);
+                  break;
+                }
+            }
+        }
     }
+  else
+    {
+      /* Memory or disk space ran out.  Whatever was placed has
+         been recorded, so only the delayed blocks that are left
+         are lost. */
+      hash_delete (&inode_table, &inode->elem);
+      drop_delayed (inode);
+      destroy_inode (inode);
+    }
+  lock_release (&inode_table_lock);
+  journal_end ();
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -191,7 +548,9 @@ void
 inode_remove (struct inode *inode) 
 {
   ASSERT (inode != NULL);
+  lock_acquire (&inode_table_lock);
   inode->removed = true;
+  lock_release (&inode_table_lock);
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
@@ -202,16 +561,27 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
 
-  while (size > 0) 
+  rwlock_acquire_read (&inode->lock);
+  if (inode->inline_data != NULL)
+    {
+      /* The data is in the inode itself. */
+      if (offset < inode->length)
+        {
+          bytes_read = inode->length - offset < size
+                       ? inode->length - offset : size;
+          memcpy (buffer, inode->inline_data + offset, bytes_read);
+        }
+      size = 0;
+    }
+  while (size > 0)
     {
       /* Disk sector to read, starting byte offset within sector. */
       block_sector_t sector_idx = byte_to_sector (inode, offset);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      off_t inode_left = inode->length - offset;
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
@@ -220,59 +590,116 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+      if (sector_idx != (block_sector_t) -1)
         {
-          /* Read full sector directly into caller's buffer. */
-          block_read (fs_device, sector_idx, buffer + bytes_read);
+          /* Copy the chunk out of the buffer cache. */
+          cache_read_at (sector_idx, buffer + bytes_read, sector_ofs,
+                         chunk_size);
         }
-      else 
+      else
         {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          block_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
+          /* Not yet allocated: copy the chunk out of its delayed
+             block, or zeros if it was never written. */
+          struct delayed_block *d
+            = find_delayed (inode, offset / BLOCK_SECTOR_SIZE);
+          if (d != NULL)
+            memcpy (buffer + bytes_read, d->data + sector_ofs, chunk_size);
+          else
+            memset (buffer + bytes_read, 0, chunk_size);
         }
-      
+
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
+  rwlock_release_read (&inode->lock);
 
   return bytes_read;
 }
 
+/* Asks for the sectors holding the SIZE bytes of INODE starting
+   at OFFSET to be brought into the buffer cache in the
+   background.  Sectors past the end of INODE, or not yet
+   allocated, are ignored. */
+void
+inode_read_ahead (struct inode *inode, off_t offset, off_t size)
+{
+  off_t end = offset + size;
+
+  rwlock_acquire_read (&inode->lock);
+  if (end > inode->length)
+    end = inode->length;
+  for (offset = ROUND_DOWN (offset, BLOCK_SECTOR_SIZE); offset < end;
+       offset += BLOCK_SECTOR_SIZE)
+    {
+      block_sector_t sector = byte_to_sector (inode, offset);
+      if (sector != (block_sector_t) -1)
+        cache_read_ahead (sector);
+    }
+  rwlock_release_read (&inode->lock);
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if the disk is full or an error occurs.
+   A write past end of file extends INODE, leaving a hole between
+   the old end and OFFSET.  Space for each sector written that
+   does not have any is reserved now but only allocated later, by
+   commit(). */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  off_t old_length;
 
-  if (inode->deny_write_cnt)
-    return 0;
+  journal_begin ();
+  rwlock_acquire_write (&inode->lock);
+  if (inode->deny_write_cnt
+      || (inode->metadata && size > 0
+          && !journal_extend (DIV_ROUND_UP (offset % BLOCK_SECTOR_SIZE + size,
+                                            BLOCK_SECTOR_SIZE))))
+    {
+      rwlock_release_write (&inode->lock);
+      journal_end ();
+      return 0;
+    }
 
-  while (size > 0) 
+  /* Write inline data in place, unless the file would outgrow
+     it. */
+  if (inode->inline_data != NULL && size > 0)
+    {
+      if (offset + size <= (off_t) INLINE_MAX)
+        {
+          memcpy (inode->inline_data + offset, buffer, size);
+          if (offset + size > inode->length)
+            inode->length = offset + size;
+          inode->dirty = true;
+          bytes_written = size;
+          size = 0;
+        }
+      else if (!move_inline (inode))
+        size = 0;
+    }
+
+  /* Extend the file. */
+  old_length = inode->length;
+  if (size > 0 && offset + size > inode->length)
+    {
+      inode->length = offset + size;
+      inode->dirty = true;
+    }
+
+  while (size > 0)
     {
       /* Sector to write, starting byte offset within sector. */
       block_sector_t sector_idx = byte_to_sector (inode, offset);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      off_t inode_left = inode->length - offset;
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
@@ -281,30 +708,44 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+      if (sector_idx != (block_sector_t) -1)
         {
-          /* Write full sector directly to disk. */
-          block_write (fs_device, sector_idx, buffer + bytes_written);
+          /* Copy the chunk into the buffer cache, which keeps the
+             rest of the sector intact. */
+          write_data (inode, sector_idx, buffer + bytes_written, sector_ofs,
+                      chunk_size);
         }
-      else 
+      else
         {
-          /* We need a bounce buffer. */
-          if (bounce == NULL) 
+          /* Copy the chunk into the sector's delayed block, if
+             the disk has room for it.  If no delayed block can be
+             had, or the file could run out of extents, allocate
+             the delayed sectors now and try again. */
+          struct delayed_block *d
+            = find_delayed (inode, offset / BLOCK_SECTOR_SIZE);
+          if (d == NULL)
             {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
+              if (!reserve_delayed (inode))
+                {
+                  if (inode->delayed_cnt == 0 || !commit_fully (inode))
+                    break;
+                  continue;
+                }
+              if (inode->delayed_cnt < DELAYED_MAX)
+                d = kmem_cache_alloc (delayed_cache);
+              if (d == NULL)
+                {
+                  free_map_unreserve (1);
+                  if (!commit_fully (inode))
+                    break;
+                  continue;
+                }
+              d->idx = offset / BLOCK_SECTOR_SIZE;
+              memset (d->data, 0, BLOCK_SECTOR_SIZE);
+              list_push_back (&inode->delayed, &d->elem);
+              inode->delayed_cnt++;
             }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left) 
-            block_read (fs_device, sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          block_write (fs_device, sector_idx, bounce);
+          memcpy (d->data + sector_ofs, buffer + bytes_written, chunk_size);
         }
 
       /* Advance. */
@@ -312,18 +753,109 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
+
+  /* If the disk filled up, end the file where the data did. */
+  if (size > 0 && offset < inode->length && inode->length > old_length)
+    inode->length = offset > old_length ? offset : old_length;
+  rwlock_release_write (&inode->lock);
+  journal_end ();
 
   return bytes_written;
 }
 
+/* Gives disk sectors to any of INODE's data whose allocation has
+   been delayed, and writes INODE back to disk if it changed.
+   The data itself may stay in the buffer cache. */
+void
+inode_commit (struct inode *inode)
+{
+  journal_begin ();
+  rwlock_acquire_write (&inode->lock);
+  commit_fully (inode);
+  rwlock_release_write (&inode->lock);
+  journal_end ();
+}
+
+/* Commits every open inode, and every closed one that could
+   not be committed when it was closed.  See inode_commit().
+   The commits do I/O, so they are done without inode_table_lock,
+   on a snapshot of the inodes that holds a reference to each of
+   them.  Each commit is a separate journal operation, so
+   that no transaction has to hold them all. */
+void
+inode_commit_all (void)
+{
+  struct hash_iterator i;
+  struct list inodes;
+
+  lock_acquire (&commit_all_lock);
+  list_init (&inodes);
+  lock_acquire (&inode_table_lock);
+  hash_first (&i, &inode_table);
+  while (hash_next (&i))
+    {
+      struct inode *inode = hash_entry (hash_cur (&i), struct inode, elem);
+      if (inode->loading)
+        continue;
+      if (inode->open_cnt == 0 && !is_clean (inode))
+        {
+          list_remove (&inode->lru_elem);
+          closed_cnt--;
+        }
+      if (inode->open_cnt > 0 || !is_clean (inode))
+        {
+          inode->open_cnt++;
+          list_push_back (&inodes, &inode->commit_elem);
+        }
+    }
+  lock_release (&inode_table_lock);
+
+  while (!list_empty (&inodes))
+    {
+      struct inode *inode = list_entry (list_pop_front (&inodes),
+                                        struct inode, commit_elem);
+      inode_commit (inode);
+      inode_close (inode);
+    }
+  lock_release (&commit_all_lock);
+}
+
+/* Commits INODE, and the journal, then writes its data and
+   inode sectors back to disk, if the buffer cache holds newer
+   versions of them, and makes them durable. */
+void
+inode_flush (struct inode *inode)
+{
+  size_t i;
+
+  inode_commit (inode);
+  journal_commit ();
+
+  rwlock_acquire_read (&inode->lock);
+  for (i = 0; i < inode->extent_cnt; i++)
+    {
+      const struct extent *e = &inode->extents[i];
+      block_sector_t sector;
+
+      for (sector = e->start; sector < e->start + e->count; sector++)
+        cache_flush_sector (sector);
+    }
+  for (i = 0; i < inode->indirect_cnt; i++)
+    cache_flush_sector (inode->indirects[i]);
+  cache_flush_sector (inode->sector);
+  rwlock_release_read (&inode->lock);
+  block_flush (fs_device);
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void
 inode_deny_write (struct inode *inode) 
 {
+  rwlock_acquire_write (&inode->lock);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  rwlock_release_write (&inode->lock);
 }
 
 /* Re-enables writes to INODE.
@@ -332,23 +864,714 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
+  rwlock_acquire_write (&inode->lock);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  rwlock_release_write (&inode->lock);
 }
 
-/* Returns the length, in bytes, of INODE's data. */
+/* Acquires INODE's directory lock, which the directory code
+   holds across each lookup or update of the directory stored in
+   INODE, so that the entries it reads stay consistent with each
+   other.  File data is protected separately, by INODE's
+   reader/writer lock. */
+void
+inode_lock_dir (struct inode *inode)
+{
+  lock_acquire (&inode->dir_lock);
+}
+
+/* Releases INODE's directory lock. */
+void
+inode_unlock_dir (struct inode *inode)
+{
+  lock_release (&inode->dir_lock);
+}
+
+/* Marks INODE as holding file system metadata, so that writes to
+   its data go through the journal. */
+void
+inode_set_metadata (struct inode *inode)
+{
+  rwlock_acquire_write (&inode->lock);
+  inode->metadata = true;
+  rwlock_release_write (&inode->lock);
+}
+
+/* Returns the length, in bytes, of INODE's data.  Reads it
+   without taking INODE's lock, since a single aligned word is
+   read atomically; the result may be stale by the time the
+   caller uses it. */
 off_t
 inode_length (const struct inode *inode)
 {
-  return inode->data.length;
+  return inode->length;
 }
 
 /* Returns the block sector that contains the given position 
    within an inode. Used to uniquely identify both inode and
-   the given offset. */
+   the given offset.  Commits INODE first, if necessary, so that
+   the position has a sector, unless it is in a hole, in which
+   case returns -1. */
 off_t
-inode_get_block_number (const struct inode *inode, off_t offset)
+inode_get_block_number (struct inode *inode, off_t offset)
 {
-  return byte_to_sector (inode, offset);
+  block_sector_t sector;
+
+  rwlock_acquire_read (&inode->lock);
+  sector = byte_to_sector (inode, offset);
+  rwlock_release_read (&inode->lock);
+  if (sector == (block_sector_t) -1 && offset < inode_length (inode))
+    {
+      journal_begin ();
+      rwlock_acquire_write (&inode->lock);
+      commit_fully (inode);
+      sector = byte_to_sector (inode, offset);
+      rwlock_release_write (&inode->lock);
+      journal_end ();
+    }
+  return sector;
+}
+
+/* Prints inode statistics. */
+void
+inode_print_stats (void)
+{
+  lock_acquire (&inode_table_lock);
+  printf ("Inodes: %zu in memory, %zu of them closed, %llu opens, "
+          "%llu revived, %llu read\n",
+          hash_size (&inode_table), closed_cnt, open_cnt, revive_cnt,
+          read_cnt);
+  lock_release (&inode_table_lock);
+}
+
+/* Returns a hash value for inode E. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct inode, elem)->sector);
+}
+
+/* Returns true if inode A precedes inode B. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return (hash_entry (a, struct inode, elem)->sector
+          < hash_entry (b, struct inode, elem)->sector);
+}
+
+/* Frees INODE's memory.  INODE must not be in the inode table. */
+static void
+destroy_inode (struct inode *inode)
+{
+  free (inode->extents);
+  free (inode->indirects);
+  free (inode->inline_data);
+  kmem_cache_free (inode_cache, inode);
+}
+
+/* Returns true if INODE has no delayed blocks and its sector is
+   up to date, so that committing it would do nothing. */
+static bool
+is_clean (const struct inode *inode)
+{
+  return inode->delayed_cnt == 0 && !inode->dirty;
+}
+
+/* Initializes INODE as an empty inode stored in SECTOR. */
+static void
+init_inode (struct inode *inode, block_sector_t sector)
+{
+  inode->sector = sector;
+  inode->open_cnt = 1;
+  inode->deny_write_cnt = 0;
+  inode->removed = false;
+  inode->loading = false;
+  lock_init (&inode->dir_lock);
+  rwlock_init (&inode->lock);
+  inode->length = 0;
+  inode->extents = NULL;
+  inode->extent_cnt = inode->extent_cap = inode->first_dirty = 0;
+  inode->indirects = NULL;
+  inode->indirect_cnt = inode->indirect_rsv = 0;
+  inode->alloc_cnt = 0;
+  list_init (&inode->delayed);
+  inode->delayed_cnt = 0;
+  inode->dirty = false;
+  inode->metadata = false;
+  inode->inline_data = NULL;
+}
+
+/* Reads INODE's extents from DISK_INODE and the indirect blocks
+   that it points to.  Returns true if successful, false if
+   memory allocation fails. */
+static bool
+load_extents (struct inode *inode, const struct inode_disk *disk_inode)
+{
+  struct indirect_block *ib;
+  block_sector_t next;
+  size_t cnt = disk_inode->extent_cnt;
+  size_t i;
+
+  inode->extents = malloc (cnt * sizeof *inode->extents);
+  if (cnt > 0 && inode->extents == NULL)
+    return false;
+  inode->extent_cap = cnt;
+  inode->extent_cnt = cnt < DIRECT_EXTENT_CNT ? cnt : DIRECT_EXTENT_CNT;
+  memcpy (inode->extents, disk_inode->extents,
+          inode->extent_cnt * sizeof *inode->extents);
+
+  if (disk_inode->indirect != 0)
+    {
+      size_t indirect_cnt = DIV_ROUND_UP (cnt - DIRECT_EXTENT_CNT,
+                                          INDIRECT_EXTENT_CNT);
+      ib = malloc (sizeof *ib);
+      inode->indirects = malloc (indirect_cnt * sizeof *inode->indirects);
+      if (ib == NULL || inode->indirects == NULL)
+        {
+          free (ib);
+          return false;
+        }
+      for (next = disk_inode->indirect; next != 0; next = ib->next)
+        {
+          ASSERT (inode->indirect_cnt < indirect_cnt);
+          inode->indirects[inode->indirect_cnt++] = next;
+          cache_read (next, ib);
+          memcpy (inode->extents + inode->extent_cnt, ib->extents,
+                  ib->extent_cnt * sizeof *inode->extents);
+          inode->extent_cnt += ib->extent_cnt;
+        }
+      free (ib);
+    }
+  ASSERT (inode->extent_cnt == cnt);
+  inode->first_dirty = cnt;
+
+  for (i = 0; i < cnt; i++)
+    inode->alloc_cnt += inode->extents[i].count;
+  return true;
+}
+
+/* Frees INODE's data and indirect extent sectors, as well as its
+   delayed blocks and its reservation for them, but not INODE's
+   own sector.  INODE's lock must be held for writing. */
+static void
+release_inode (struct inode *inode)
+{
+  size_t i;
+
+  ASSERT (rwlock_held_for_write (&inode->lock));
+
+  drop_delayed (inode);
+  for (i = 0; i < inode->extent_cnt; i++)
+    free_map_release (inode->extents[i].start, inode->extents[i].count);
+  for (i = 0; i < inode->indirect_cnt; i++)
+    free_map_release (inode->indirects[i], 1);
+  inode->extent_cnt = inode->indirect_cnt = inode->alloc_cnt = 0;
+}
+
+/* Frees INODE's delayed blocks, without writing them, and gives
+   back their reservation and that for indirect blocks. */
+static void
+drop_delayed (struct inode *inode)
+{
+  while (!list_empty (&inode->delayed))
+    {
+      struct list_elem *e = list_pop_front (&inode->delayed);
+      kmem_cache_free (delayed_cache,
+                       list_entry (e, struct delayed_block, elem));
+    }
+  free_map_unreserve (inode->delayed_cnt + inode->indirect_rsv);
+  inode->delayed_cnt = inode->indirect_rsv = 0;
+}
+
+/* Returns INODE's delayed block for sector IDX within the file,
+   or a null pointer if there is none. */
+static struct delayed_block *
+find_delayed (struct inode *inode, size_t idx)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&inode->delayed); e != list_end (&inode->delayed);
+       e = list_next (e))
+    {
+      struct delayed_block *d = list_entry (e, struct delayed_block, elem);
+      if (d->idx == idx)
+        return d;
+    }
+  return NULL;
+}
+
+/* Returns the index of the first of INODE's extents that begins
+   after sector IDX of the file, or INODE's extent count if there
+   is none.  Uses binary search. */
+static size_t
+next_extent (const struct inode *inode, size_t idx)
+{
+  size_t lo = 0, hi = inode->extent_cnt;
+
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (idx < inode->extents[mid].logical)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+  return lo;
+}
+
+/* Returns the number of indirect blocks that a file with
+   EXTENT_CNT extents needs. */
+static size_t
+indirects_needed (size_t extent_cnt)
+{
+  if (extent_cnt <= DIRECT_EXTENT_CNT)
+    return 0;
+  return DIV_ROUND_UP (extent_cnt - DIRECT_EXTENT_CNT, INDIRECT_EXTENT_CNT);
+}
+
+/* Reserves a sector for a new delayed block of INODE, and
+   another for an indirect block if committing all of INODE's
+   delayed blocks could then need one more than INODE has or has
+   reserved, since each delayed block could become an extent of
+   its own.  The caller must add the delayed block.  Returns true
+   if successful, false if the disk is full or if INODE could
+   then need more than EXTENT_MAX extents. */
+static bool
+reserve_delayed (struct inode *inode)
+{
+  size_t needed = indirects_needed (inode->extent_cnt
+                                    + inode->delayed_cnt + 1);
+  size_t extra = 0;
+
+  if (inode->extent_cnt + inode->delayed_cnt >= EXTENT_MAX)
+    return false;
+  if (needed > inode->indirect_cnt + inode->indirect_rsv)
+    extra = needed - (inode->indirect_cnt + inode->indirect_rsv);
+  if (!free_map_reserve (1 + extra))
+    return false;
+  inode->indirect_rsv += extra;
+  return true;
+}
+
+/* Makes room in INODE's arrays for EXTENT_CNT extents and the
+   indirect blocks that they need, so that add_extent() and
+   write_inode() cannot run out of memory.  Returns true if
+   successful, false if memory allocation fails. */
+static bool
+make_room (struct inode *inode, size_t extent_cnt)
+{
+  size_t indirect_cnt = indirects_needed (extent_cnt);
+
+  if (extent_cnt > inode->extent_cap)
+    {
+      size_t new_cap = inode->extent_cap > 0 ? inode->extent_cap : 4;
+      struct extent *extents;
+
+      while (new_cap < extent_cnt)
+        new_cap *= 2;
+      extents = realloc (inode->extents, new_cap * sizeof *extents);
+      if (extents == NULL)
+        return false;
+      inode->extents = extents;
+      inode->extent_cap = new_cap;
+    }
+  if (indirect_cnt > inode->indirect_cnt)
+    {
+      block_sector_t *indirects = realloc (inode->indirects,
+                                           indirect_cnt * sizeof *indirects);
+      if (indirects == NULL)
+        return false;
+      inode->indirects = indirects;
+    }
+  return true;
+}
+
+/* Maps the CNT sectors of INODE starting at sector LOGICAL of the
+   file, which must be holes, to CNT disk sectors starting at
+   START, merging them into the extents on either side where
+   those are contiguous with them both in the file and on disk.
+   make_room() must have made room for one more extent.  Notes
+   the first extent that changed or moved in FIRST_DIRTY. */
+static void
+add_extent (struct inode *inode, size_t logical, block_sector_t start,
+            size_t cnt)
+{
+  size_t i = next_extent (inode, logical);
+  struct extent *prev = i > 0 ? &inode->extents[i - 1] : NULL;
+  struct extent *next = i < inode->extent_cnt ? &inode->extents[i] : NULL;
+  bool join_prev = (prev != NULL && prev->logical + prev->count == logical
+                    && prev->start + prev->count == start);
+  bool join_next = (next != NULL && next->logical == logical + cnt
+                    && next->start == start + cnt);
+  size_t changed;
+  struct extent *e;
+
+  ASSERT (prev == NULL || prev->logical + prev->count <= logical);
+  ASSERT (next == NULL || logical + cnt <= next->logical);
+
+  changed = join_prev ? i - 1 : i;
+  if (changed < inode->first_dirty)
+    inode->first_dirty = changed;
+
+  if (join_prev)
+    {
+      prev->count += cnt;
+      if (join_next)
+        {
+          prev->count += next->count;
+          memmove (next, next + 1,
+                   (inode->extent_cnt - i - 1) * sizeof *next);
+          inode->extent_cnt--;
+        }
+    }
+  else if (join_next)
+    {
+      next->logical = logical;
+      next->start = start;
+      next->count += cnt;
+    }
+  else
+    {
+      ASSERT (inode->extent_cnt < inode->extent_cap);
+      e = &inode->extents[i];
+      memmove (e + 1, e, (inode->extent_cnt - i) * sizeof *e);
+      inode->extent_cnt++;
+      e->logical = logical;
+      e->start = start;
+      e->count = cnt;
+    }
+  inode->alloc_cnt += cnt;
+}
+
+/* Returns true if delayed block A comes before B in the file. */
+static bool
+delayed_less (const struct list_elem *a, const struct list_elem *b,
+              void *aux UNUSED)
+{
+  return (list_entry (a, struct delayed_block, elem)->idx
+          < list_entry (b, struct delayed_block, elem)->idx);
+}
+
+/* Returns the most sectors of the running journal transaction
+   that write_inode() could change, counting those of the free
+   map, once INODE gains one more extent at index FIRST or
+   later. */
+static size_t
+write_cost (const struct inode *inode, size_t first)
+{
+  size_t old_cnt = inode->indirect_cnt;
+  size_t new_cnt = indirects_needed (inode->extent_cnt + 1);
+  size_t block, cost;
+
+  if (inode->first_dirty < first)
+    first = inode->first_dirty;
+  block = (first < DIRECT_EXTENT_CNT ? 0
+           : (first - DIRECT_EXTENT_CNT) / INDIRECT_EXTENT_CNT);
+  if (old_cnt > 0 && old_cnt - 1 < block)
+    block = old_cnt - 1;
+
+  cost = 1;
+  if (new_cnt > block)
+    cost += new_cnt - block;
+  if (new_cnt > old_cnt)
+    cost += (new_cnt - old_cnt) * free_map_cost (1);
+  return cost;
+}
+
+/* Allocates disk sectors for INODE's delayed blocks, in runs as
+   long as the free map can supply, writes their data into the
+   buffer cache, and then writes INODE to disk if it changed.
+   Holes stay holes.  INODE's lock must be held for writing.
+
+   Places only as many runs as the running journal transaction
+   has room for, along with writing INODE afterward, and leaves
+   the rest delayed.
+   Returns true if successful.  Returns false if the transaction
+   ran out of room, storing into *NEEDP how many credits a
+   journal operation needs to go on, or if memory or disk space
+   runs out, storing 0.  Everything that can fail for lack of
+   memory or disk space is done before any data is placed, and
+   whatever was placed has been recorded in INODE on disk. */
+static bool
+commit (struct inode *inode, size_t *needp)
+{
+  size_t needed, cost;
+  void *buffer;
+
+  ASSERT (rwlock_held_for_write (&inode->lock));
+
+  *needp = 0;
+  if (is_clean (inode) && inode->indirect_rsv == 0)
+    return true;
+  buffer = malloc (BLOCK_SECTOR_SIZE);
+  if (buffer == NULL
+      || !make_room (inode, inode->extent_cnt + inode->delayed_cnt))
+    {
+      free (buffer);
+      return false;
+    }
+
+  /* Extents that merged after an earlier commit placed only some
+     of the delayed blocks may have freed indirect blocks that the
+     rest were counting on. */
+  needed = indirects_needed (inode->extent_cnt + inode->delayed_cnt);
+  if (needed > inode->indirect_cnt + inode->indirect_rsv)
+    {
+      size_t extra = needed - (inode->indirect_cnt + inode->indirect_rsv);
+      if (!free_map_reserve (extra))
+        {
+          free (buffer);
+          return false;
+        }
+      inode->indirect_rsv += extra;
+    }
+
+  cost = write_cost (inode, inode->extent_cnt);
+  if (!journal_extend (cost))
+    {
+      *needp = cost;
+      free (buffer);
+      return false;
+    }
+
+  list_sort (&inode->delayed, delayed_less, NULL);
+  while (!list_empty (&inode->delayed))
+    {
+      struct list_elem *e = list_front (&inode->delayed);
+      size_t logical = list_entry (e, struct delayed_block, elem)->idx;
+      size_t cnt = 1;
+      size_t data_cnt;
+      block_sector_t hint, start;
+      size_t i;
+
+      /* Find the run of consecutive delayed blocks at the front. */
+      for (e = list_next (e); e != list_end (&inode->delayed);
+           e = list_next (e))
+        {
+          if (list_entry (e, struct delayed_block, elem)->idx
+              != logical + cnt)
+            break;
+          cnt++;
+        }
+
+      /* Place the data where it would continue the extent before
+         it, or else right after the inode. */
+      i = next_extent (inode, logical);
+      if (i > 0)
+        {
+          const struct extent *prev = &inode->extents[i - 1];
+          hint = prev->start + (logical - prev->logical);
+        }
+      else
+        hint = inode->sector + 1;
+
+      /* Make sure that the transaction has room for the data, if
+         it goes through the journal, for the free map sectors
+         that placing it changes, and for writing INODE afterward.
+         Place less of the run if that helps, or else stop. */
+      cost = write_cost (inode, i > 0 ? i - 1 : 0);
+      for (;;)
+        {
+          data_cnt = inode->metadata ? cnt : 0;
+          if (journal_extend (cost + free_map_cost (cnt) + data_cnt))
+            break;
+          if (data_cnt <= 1)
+            {
+              *needp = cost + free_map_cost (1) + data_cnt;
+              goto done;
+            }
+          cnt /= 2;
+        }
+
+      /* Take the longest run we can, halving the request each
+         time none that long is free.  A single sector is always
+         free, because it is reserved. */
+      while (!free_map_claim (cnt, hint, &start))
+        {
+          ASSERT (cnt > 1);
+          cnt /= 2;
+        }
+      add_extent (inode, logical, start, cnt);
+
+      for (i = 0; i < cnt; i++)
+        {
+          struct delayed_block *d
+            = list_entry (list_pop_front (&inode->delayed),
+                          struct delayed_block, elem);
+          ASSERT (d->idx == logical + i);
+          write_data (inode, start + i, d->data, 0, BLOCK_SECTOR_SIZE);
+          kmem_cache_free (delayed_cache, d);
+          inode->delayed_cnt--;
+        }
+      inode->dirty = true;
+    }
+
+ done:
+  if (inode->dirty)
+    write_inode (inode, buffer);
+  free (buffer);
+  if (inode->delayed_cnt > 0)
+    return false;
+
+  /* With no delayed blocks left, no more indirect blocks can be
+     needed until more are written. */
+  free_map_unreserve (inode->indirect_rsv);
+  inode->indirect_rsv = 0;
+  return true;
+}
+
+/* Commits INODE like commit(), but if the running journal
+   transaction runs out of room, commits the transaction and goes
+   on in the next one, unless the current journal operation is
+   nested, in which case it returns false.  INODE's lock must be
+   held for writing, and is released while the transaction
+   commits. */
+static bool
+commit_fully (struct inode *inode)
+{
+  size_t need;
+
+  while (!commit (inode, &need))
+    {
+      bool restarted;
+
+      if (need == 0)
+        return false;
+      rwlock_release_write (&inode->lock);
+      restarted = journal_restart (need);
+      rwlock_acquire_write (&inode->lock);
+      if (!restarted)
+        return false;
+    }
+  return true;
+}
+
+/* Writes INODE's length and extents to its sector and to those
+   of its indirect extent blocks that changed, allocating
+   indirect blocks out of INDIRECT_RSV or freeing them as needed,
+   using BUFFER, which must hold BLOCK_SECTOR_SIZE bytes.
+   make_room() must have made room for INODE's extents.  INODE's
+   lock must be held for writing. */
+static void
+write_inode (struct inode *inode, void *buffer)
+{
+  struct inode_disk *disk_inode = buffer;
+  struct indirect_block *ib = buffer;
+  size_t indirect_cnt = indirects_needed (inode->extent_cnt);
+  size_t old_cnt = inode->indirect_cnt;
+  size_t first, ofs, i;
+
+  /* Allocate indirect blocks. */
+  while (inode->indirect_cnt < indirect_cnt)
+    {
+      ASSERT (inode->indirect_rsv > 0);
+      if (!free_map_claim (1, inode->sector,
+                           &inode->indirects[inode->indirect_cnt]))
+        NOT_REACHED ();
+      inode->indirect_rsv--;
+      inode->indirect_cnt++;
+    }
+
+  /* The blocks to write are those that hold extents from
+     FIRST_DIRTY on, and the last block that stays in the chain,
+     if blocks were added to it or dropped from its end, because
+     its NEXT changes. */
+  first = (inode->first_dirty < DIRECT_EXTENT_CNT ? 0
+           : (inode->first_dirty - DIRECT_EXTENT_CNT) / INDIRECT_EXTENT_CNT);
+  if (indirect_cnt != old_cnt)
+    {
+      size_t kept = indirect_cnt < old_cnt ? indirect_cnt : old_cnt;
+      if (kept > 0 && kept - 1 < first)
+        first = kept - 1;
+    }
+
+  /* Write them, last first, so that the chain on disk is never
+     longer than the extents written. */
+  for (i = indirect_cnt; i-- > first; )
+    {
+      ofs = DIRECT_EXTENT_CNT + i * INDIRECT_EXTENT_CNT;
+      memset (ib, 0, sizeof *ib);
+      ib->next = i + 1 < indirect_cnt ? inode->indirects[i + 1] : 0;
+      ib->extent_cnt = inode->extent_cnt - ofs;
+      if (ib->extent_cnt > INDIRECT_EXTENT_CNT)
+        ib->extent_cnt = INDIRECT_EXTENT_CNT;
+      memcpy (ib->extents, inode->extents + ofs,
+              ib->extent_cnt * sizeof *ib->extents);
+      journal_write (inode->indirects[i], ib);
+    }
+
+  /* Write the inode itself. */
+  memset (disk_inode, 0, sizeof *disk_inode);
+  disk_inode->length = inode->length;
+  disk_inode->magic = INODE_MAGIC;
+  disk_inode->extent_cnt = inode->extent_cnt;
+  disk_inode->indirect = indirect_cnt > 0 ? inode->indirects[0] : 0;
+  if (inode->inline_data != NULL)
+    {
+      disk_inode->flags = INODE_INLINE;
+      memcpy (disk_inode->data, inode->inline_data, INLINE_MAX);
+    }
+  else
+    memcpy (disk_inode->extents, inode->extents,
+            (inode->extent_cnt < DIRECT_EXTENT_CNT
+             ? inode->extent_cnt : DIRECT_EXTENT_CNT)
+            * sizeof *disk_inode->extents);
+  journal_write (inode->sector, disk_inode);
+  inode->dirty = false;
+  inode->first_dirty = inode->extent_cnt;
+
+  /* Free indirect blocks left over after extents merged. */
+  while (inode->indirect_cnt > indirect_cnt)
+    free_map_release (inode->indirects[--inode->indirect_cnt], 1);
+}
+
+/* Writes SIZE bytes from BUFFER into SECTOR, one of INODE's data
+   sectors, starting at byte offset OFS within the sector,
+   through the journal if INODE holds metadata. */
+static void
+write_data (struct inode *inode, block_sector_t sector, const void *buffer,
+            size_t ofs, size_t size)
+{
+  if (inode->metadata)
+    journal_write_at (sector, buffer, ofs, size);
+  else
+    cache_write_at (sector, buffer, ofs, size);
+}
+
+/* Moves INODE's inline data into a delayed block for the first
+   sector of the file, so that the file can grow beyond
+   INLINE_MAX bytes.  INODE's lock must be held for writing.
+   Returns true if successful, false if the disk or memory is
+   full. */
+static bool
+move_inline (struct inode *inode)
+{
+  ASSERT (rwlock_held_for_write (&inode->lock));
+  ASSERT (inode->inline_data != NULL);
+
+  if (inode->length > 0)
+    {
+      struct delayed_block *d;
+
+      if (!reserve_delayed (inode))
+        return false;
+      d = kmem_cache_alloc (delayed_cache);
+      if (d == NULL)
+        {
+          free_map_unreserve (1);
+          return false;
+        }
+      d->idx = 0;
+      memcpy (d->data, inode->inline_data, INLINE_MAX);
+      memset (d->data + INLINE_MAX, 0, BLOCK_SECTOR_SIZE - INLINE_MAX);
+      list_push_back (&inode->delayed, &d->elem);
+      inode->delayed_cnt++;
+    }
+  free (inode->inline_data);
+  inode->inline_data = NULL;
+  inode->dirty = true;
+  return true;
 }
@@ -0,0 +1,781 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <hash.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "kernel/malloc.h"
+#include "kernel/synch.h"
+#include "kernel/thread.h"
+#include "kernel/vmalloc.h"
+
+/* Write-ahead journal for file system metadata.
+
+   Every change to an inode sector, an indirect extent block, a
+   directory, or the free map file is made with
+   journal_write_at() between journal_begin() and journal_end().
+   Such a change goes into the buffer cache like any other, but
+   the cache keeps the changed sector from being written back in
+   place until the transaction that changed it has committed.
+
+   There is only one running transaction at a time, which the
+   operations of every thread join.  Committing it first waits
+   for the operations in it to end, holding off new ones, then
+   writes one or more descriptor sectors that list the changed
+   sectors, each followed by the contents of the sectors it
+   lists, as one sequential write to the log, and makes it
+   durable with block_flush().  The "journal" thread commits
+   every COMMIT_INTERVAL ticks, or sooner once TXN_FULL sectors
+   have changed.
+
+   After a commit, the changed sectors may be written back in
+   place, which the buffer cache's flusher thread does in its
+   own time.  Once more than half of the log is in use, the
+   journal thread checkpoints: it writes back all of the cache
+   and empties the log by advancing the sequence number in the
+   journal header.  filesys_init() replays the descriptor groups
+   that follow the header, in order, as long as each one has the
+   next sequence number and good checksums.
+
+   Freeing a sector whose old contents are in the log adds a
+   revoke record for it to the running transaction, because the
+   sector may be reused for file data, which does not go through
+   the log.  Replay skips a logged sector if a transaction at
+   least as new revoked it.  Logging the sector again in the
+   same transaction cancels the revoke record.
+
+   Only metadata goes through the journal.  File data is written
+   in place, so after a crash a file may have stale contents, but
+   the file system's structure is consistent.
+
+   A transaction pins the buffer cache entries of the sectors it
+   changed until it commits, so it must stay well below the size
+   of the cache.  Each operation therefore reserves OP_CREDITS
+   sectors when it begins, and it only joins the running
+   transaction if that leaves the reservations of all of its
+   operations within TXN_MAX; otherwise it commits the
+   transaction first.  An operation that changes more sectors
+   than it reserved may use the slack between TXN_MAX and
+   TXN_LIMIT, asking for it ahead of time with journal_extend(),
+   and if there is not enough, an outermost operation may commit
+   the transaction and go on in the next with journal_restart().
+   The free map is written back only while
+   committing, so an operation that allocates charges for the
+   free map sectors that will change then with
+   journal_charge(), and the free map writes back no more than
+   what is left of TXN_LIMIT.  A transaction over TXN_LIMIT
+   cannot be made atomic, so it is a kernel panic. */
+
+/* Identifies the journal header and descriptors. */
+#define JOURNAL_MAGIC 0x4c4e524a
+#define DESC_MAGIC 0x3243444a
+
+/* Sectors reserved by each operation, the most sectors that
+   operations may reserve in one transaction, and the most that
+   one transaction may change at all. */
+#define OP_CREDITS 8
+#define TXN_MAX 32
+#define TXN_LIMIT 48
+
+/* Sectors at which the journal thread commits early. */
+#define TXN_FULL 16
+
+/* Timer ticks between periodic commits, and between checks of
+   how full the running transaction is. */
+#define COMMIT_INTERVAL TIMER_FREQ
+#define COMMIT_POLL (TIMER_FREQ / 10)
+
+/* The log: all of the journal but its header. */
+#define LOG_START (JOURNAL_SECTOR + 1)
+#define LOG_SECTORS (JOURNAL_SECTORS - 1)
+
+/* Most revoke records in one transaction: one for each sector
+   that can be in the log or the transaction. */
+#define REVOKE_MAX (LOG_SECTORS + TXN_LIMIT)
+
+/* Entries in a descriptor, and most descriptors per
+   transaction. */
+#define DESC_ENTRY_CNT 122
+#define DESC_MAX DIV_ROUND_UP (TXN_LIMIT + REVOKE_MAX, DESC_ENTRY_CNT)
+
+/* Journal header, in sector JOURNAL_SECTOR.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct journal_header
+  {
+    uint32_t magic;                     /* JOURNAL_MAGIC. */
+    uint32_t seq;                       /* Sequence number at LOG_START. */
+    uint8_t unused[504];                /* Not used. */
+  };
+
+/* A committed transaction in the log is a series of these
+   descriptors, the last with LAST set, each followed by the
+   contents of the CNT sectors it lists.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct descriptor
+  {
+    uint32_t magic;                     /* DESC_MAGIC. */
+    uint32_t seq;                       /* Transaction sequence number. */
+    uint32_t cnt;                       /* Number of sectors. */
+    uint32_t revoke_cnt;                /* Number of revoke records. */
+    uint32_t last;                      /* Last of the transaction? */
+    uint32_t checksum;                  /* See checksum(). */
+    block_sector_t entries[DESC_ENTRY_CNT]; /* CNT sectors' targets,
+                                           then REVOKE_CNT revoked
+                                           sectors. */
+  };
+
+/* A revoke record found during replay. */
+struct revoke
+  {
+    block_sector_t sector;              /* Revoked sector. */
+    uint32_t seq;                       /* Revoking transaction. */
+  };
+
+/* The running transaction, protected by journal_lock. */
+static struct lock journal_lock;
+static uint32_t txn_seq;                /* Its sequence number. */
+static block_sector_t txn_sectors[TXN_LIMIT]; /* Sectors it changed. */
+static size_t txn_cnt;                  /* Number of TXN_SECTORS. */
+static block_sector_t revokes[REVOKE_MAX]; /* Sectors it revoked. */
+static size_t revoke_cnt;               /* Number of REVOKES. */
+static size_t reserved_cnt;             /* Unused credits of operations. */
+static size_t charged_cnt;              /* Sectors for the commit to change. */
+static unsigned active_cnt;             /* Operations in progress. */
+static bool closing;                    /* Being committed? */
+static struct condition txn_drained;    /* Signaled when ACTIVE_CNT is 0. */
+static struct condition txn_open;       /* Signaled when CLOSING is reset. */
+
+/* Sectors in the log since the last checkpoint, which may need
+   revoke records.  Protected by journal_lock, changed only with
+   commit_lock also held. */
+static block_sector_t logged[LOG_SECTORS];
+static size_t logged_cnt;
+
+/* Commit state, protected by commit_lock. */
+static struct lock commit_lock;         /* One commit at a time. */
+static size_t log_used;                 /* Sectors of the log in use. */
+static struct journal_header *header;   /* Header buffer. */
+static struct descriptor *desc;         /* DESC_MAX descriptors. */
+static uint8_t *data;                   /* TXN_LIMIT sectors of contents. */
+
+/* Statistics. */
+static unsigned long long op_cnt;       /* Operations. */
+static unsigned long long commit_cnt;   /* Transactions committed. */
+static unsigned long long logged_total; /* Sectors written to the log. */
+static unsigned long long checkpoint_cnt; /* Checkpoints. */
+static unsigned long long revoked_cnt;  /* Revoke records written. */
+
+static uint32_t replay (void);
+static size_t read_txn (size_t pos, uint32_t seq, struct revoke **,
+                        size_t *found_cnt, bool apply);
+static void begin (size_t credits);
+static void commit (bool checkpoint);
+static void write_log (void);
+static void reset_log (uint32_t seq);
+static bool in_list (const block_sector_t *, size_t cnt, block_sector_t);
+static uint32_t checksum (const struct descriptor *, const uint8_t *);
+static thread_func journal_thread NO_RETURN;
+
+/* Initializes the journal.  If FORMAT is true, creates an empty
+   journal; otherwise, replays the one on disk.  Must be called
+   after cache_init() and before anything else reads the file
+   system. */
+void
+journal_init (bool format)
+{
+  uint32_t seq;
+
+  ASSERT (sizeof (struct journal_header) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct descriptor) == BLOCK_SECTOR_SIZE);
+
+  lock_init (&journal_lock);
+  cond_init (&txn_drained);
+  cond_init (&txn_open);
+  lock_init (&commit_lock);
+  header = vmalloc (sizeof *header);
+  desc = vmalloc (DESC_MAX * sizeof *desc);
+  data = vmalloc (TXN_LIMIT * BLOCK_SECTOR_SIZE);
+  if (header == NULL || desc == NULL || data == NULL)
+    PANIC ("journal_init: out of memory");
+
+  if (format)
+    {
+      /* Erase any descriptors left over from an earlier file
+         system, so that none of them can be replayed. */
+      struct block_iovec iov;
+      size_t ofs;
+
+      memset (data, 0, TXN_LIMIT * BLOCK_SECTOR_SIZE);
+      iov.buffer = data;
+      for (ofs = 0; ofs < LOG_SECTORS; ofs += iov.sector_cnt)
+        {
+          iov.sector_cnt = LOG_SECTORS - ofs;
+          if (iov.sector_cnt > TXN_LIMIT)
+            iov.sector_cnt = TXN_LIMIT;
+          block_writev (fs_device, LOG_START + ofs, &iov, 1);
+        }
+      seq = 1;
+    }
+  else
+    seq = replay ();
+
+  reset_log (seq);
+  txn_seq = seq;
+  thread_create ("journal", PRI_DEFAULT, journal_thread, NULL);
+}
+
+/* Begins an operation that changes metadata, which reserves
+   OP_CREDITS sectors in the running transaction and joins it.
+   Calls nest: only the outermost journal_begin() and
+   journal_end() of a thread count.  The outermost call must be
+   made before acquiring any file system lock, because it may
+   wait for a commit. */
+void
+journal_begin (void)
+{
+  if (thread_current ()->journal_depth++ > 0)
+    return;
+  begin (OP_CREDITS);
+}
+
+/* Ends an operation begun with journal_begin(). */
+void
+journal_end (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+  if (--t->journal_depth > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  reserved_cnt -= t->journal_credits;
+  t->journal_credits = 0;
+  if (--active_cnt == 0)
+    cond_signal (&txn_drained, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Makes sure that the current operation has at least CNT unused
+   credits, taking any more that it needs out of the running
+   transaction's slack.  Returns true if successful, false if the
+   transaction does not have that much room left, in which case
+   nothing changes.  Must be called between journal_begin() and
+   journal_end(). */
+bool
+journal_extend (size_t cnt)
+{
+  struct thread *t = thread_current ();
+  bool success = true;
+
+  ASSERT (t->journal_depth > 0);
+
+  lock_acquire (&journal_lock);
+  if ((size_t) t->journal_credits < cnt)
+    {
+      size_t more = cnt - t->journal_credits;
+      if (txn_cnt + charged_cnt + reserved_cnt + more <= TXN_LIMIT)
+        {
+          t->journal_credits += more;
+          reserved_cnt += more;
+        }
+      else
+        success = false;
+    }
+  lock_release (&journal_lock);
+  return success;
+}
+
+/* Ends the current operation, commits the running transaction,
+   and begins a new operation with at least CNT credits in the
+   next, for an operation that ran out of room.  Everything that
+   the operation changed before commits, so the caller must be
+   at a point where its changes so far are consistent.  Only
+   possible for an outermost operation, which, like the caller of
+   journal_begin(), must not hold any file system lock.  Returns
+   true if successful, false if the operation is nested or CNT is
+   more than a transaction can hold, in which case nothing
+   happens. */
+bool
+journal_restart (size_t cnt)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+  if (t->journal_depth > 1 || cnt > TXN_LIMIT)
+    return false;
+
+  journal_end ();
+  commit (false);
+  t->journal_depth++;
+  begin (cnt > OP_CREDITS ? cnt : OP_CREDITS);
+  return true;
+}
+
+/* Writes metadata sector SECTOR from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes, as part of the running transaction. */
+void
+journal_write (block_sector_t sector, const void *buffer)
+{
+  journal_write_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes SIZE bytes from BUFFER into metadata sector SECTOR,
+   starting at byte offset OFS within the sector, as part of the
+   running transaction.  Must be called between journal_begin()
+   and journal_end().  A sector new to the transaction uses up
+   one of the operation's credits, or if it has none left, some
+   of the transaction's slack. */
+void
+journal_write_at (block_sector_t sector, const void *buffer,
+                  size_t ofs, size_t size)
+{
+  struct thread *t = thread_current ();
+  uint32_t seq;
+  size_t i;
+
+  ASSERT (t->journal_depth > 0);
+
+  lock_acquire (&journal_lock);
+  if (!in_list (txn_sectors, txn_cnt, sector))
+    {
+      if (t->journal_credits > 0)
+        {
+          t->journal_credits--;
+          reserved_cnt--;
+        }
+      else if (txn_cnt + charged_cnt + reserved_cnt >= TXN_LIMIT)
+        PANIC ("journal: transaction exceeds %d sectors", TXN_LIMIT);
+      txn_sectors[txn_cnt++] = sector;
+
+      /* Logging SECTOR again supersedes revoking it. */
+      for (i = 0; i < revoke_cnt; i++)
+        if (revokes[i] == sector)
+          {
+            revokes[i] = revokes[--revoke_cnt];
+            break;
+          }
+    }
+  seq = txn_seq;
+  lock_release (&journal_lock);
+
+  cache_write_logged (sector, buffer, ofs, size, seq);
+}
+
+/* Sets aside CNT sectors of the running transaction for changes
+   that committing it will make on behalf of the current
+   operation, using up the operation's credits first and then
+   the transaction's slack.  Must be called between
+   journal_begin() and journal_end(). */
+void
+journal_charge (size_t cnt)
+{
+  struct thread *t = thread_current ();
+  size_t n;
+
+  ASSERT (t->journal_depth > 0);
+
+  lock_acquire (&journal_lock);
+  n = (size_t) t->journal_credits < cnt ? (size_t) t->journal_credits : cnt;
+  t->journal_credits -= n;
+  reserved_cnt -= n;
+  if (txn_cnt + charged_cnt + reserved_cnt + cnt > TXN_LIMIT)
+    PANIC ("journal: transaction exceeds %d sectors", TXN_LIMIT);
+  charged_cnt += cnt;
+  lock_release (&journal_lock);
+}
+
+/* Adds revoke records to the running transaction for any of the
+   CNT sectors starting at SECTOR whose contents are in the log
+   or the transaction, because they are being freed and may be
+   reused for data that does not go through the log.  Must be
+   called between journal_begin() and journal_end(), so that the
+   revoke records commit along with the freeing. */
+void
+journal_revoke (block_sector_t sector, size_t cnt)
+{
+  size_t i;
+
+  ASSERT (thread_current ()->journal_depth > 0);
+
+  lock_acquire (&journal_lock);
+  for (i = 0; i < logged_cnt + txn_cnt; i++)
+    {
+      block_sector_t s = (i < logged_cnt ? logged[i]
+                          : txn_sectors[i - logged_cnt]);
+      if (s >= sector && s - sector < cnt
+          && !in_list (revokes, revoke_cnt, s))
+        {
+          ASSERT (revoke_cnt < REVOKE_MAX);
+          revokes[revoke_cnt++] = s;
+        }
+    }
+  lock_release (&journal_lock);
+}
+
+/* Commits the running transaction, so that its changes survive
+   a crash. */
+void
+journal_commit (void)
+{
+  commit (false);
+}
+
+/* Commits the running transaction, then writes every dirty
+   sector in the buffer cache back in place, makes it durable,
+   and empties the log. */
+void
+journal_checkpoint (void)
+{
+  commit (true);
+}
+
+/* Prints journal statistics. */
+void
+journal_print_stats (void)
+{
+  printf ("Journal: %llu operations in %llu commits, %llu sectors logged, "
+          "%llu revoked, %llu checkpoints\n",
+          op_cnt, commit_cnt, logged_total, revoked_cnt, checkpoint_cnt);
+}
+
+/* Replays the transactions in the log into place and returns
+   the sequence number that the next transaction should have.
+   The first pass finds the complete transactions and their
+   revoke records, the second writes their sectors into place,
+   except those revoked by the same or a later transaction. */
+static uint32_t
+replay (void)
+{
+  struct revoke *found = NULL;
+  size_t found_cnt = 0;
+  size_t replay_cnt = 0;
+  size_t pos, len, i;
+  uint32_t seq;
+
+  block_read (fs_device, JOURNAL_SECTOR, header);
+  if (header->magic != JOURNAL_MAGIC)
+    PANIC ("file system has no journal; it must be reformatted");
+
+  for (pos = 0, seq = header->seq;
+       (len = read_txn (pos, seq, &found, &found_cnt, false)) > 0;
+       pos += len, seq++)
+    replay_cnt++;
+  for (i = 0, pos = 0; i < replay_cnt; i++)
+    pos += read_txn (pos, header->seq + i, &found, &found_cnt, true);
+  free (found);
+
+  if (replay_cnt > 0)
+    {
+      block_flush (fs_device);
+      printf ("journal: replayed %zu transactions\n", replay_cnt);
+    }
+  return seq;
+}
+
+/* Reads the transaction with sequence number SEQ that starts
+   POS sectors into the log and returns its length in sectors,
+   or 0 if it is not there or not complete.
+   If APPLY is false, adds the transaction's revoke records to
+   the *FOUND_CNT in *FOUND, which grows as necessary.  If APPLY
+   is true, instead writes its sectors into place, except those
+   that *FOUND says were revoked no earlier than SEQ. */
+static size_t
+read_txn (size_t pos, uint32_t seq, struct revoke **found,
+          size_t *found_cnt, bool apply)
+{
+  size_t old_found_cnt = *found_cnt;
+  size_t len = 0;
+  bool last = false;
+
+  while (!last)
+    {
+      struct block_iovec iov;
+      size_t i, j;
+
+      if (pos + len >= LOG_SECTORS)
+        break;
+      block_read (fs_device, LOG_START + pos + len, desc);
+      if (desc->magic != DESC_MAGIC || desc->seq != seq
+          || desc->cnt > TXN_LIMIT
+          || desc->cnt + desc->revoke_cnt > DESC_ENTRY_CNT
+          || pos + len + 1 + desc->cnt > LOG_SECTORS)
+        break;
+      iov.buffer = data;
+      iov.sector_cnt = desc->cnt;
+      if (desc->cnt > 0)
+        block_readv (fs_device, LOG_START + pos + len + 1, &iov, 1);
+      if (checksum (desc, data) != desc->checksum)
+        break;
+      len += 1 + desc->cnt;
+      last = desc->last;
+
+      if (apply)
+        {
+          for (i = 0; i < desc->cnt; i++)
+            {
+              for (j = 0; j < *found_cnt; j++)
+                if ((*found)[j].sector == desc->entries[i]
+                    && (*found)[j].seq >= seq)
+                  break;
+              if (j == *found_cnt)
+                block_write (fs_device, desc->entries[i],
+                             data + i * BLOCK_SECTOR_SIZE);
+            }
+        }
+      else
+        for (i = 0; i < desc->revoke_cnt; i++)
+          {
+            struct revoke *r = realloc (*found,
+                                        (*found_cnt + 1) * sizeof *r);
+            if (r == NULL)
+              PANIC ("journal: out of memory during replay");
+            r[*found_cnt].sector = desc->entries[desc->cnt + i];
+            r[*found_cnt].seq = seq;
+            *found = r;
+            ++*found_cnt;
+          }
+    }
+
+  if (!last)
+    {
+      /* Forget the revoke records of an incomplete transaction. */
+      *found_cnt = old_found_cnt;
+      return 0;
+    }
+  return len;
+}
+
+/* Joins the running transaction with an operation that reserves
+   CREDITS sectors, committing the transaction first if that
+   would take the reservations of its operations over TXN_MAX.
+   An operation that reserves more than TXN_MAX waits for a
+   transaction of its own. */
+static void
+begin (size_t credits)
+{
+  struct thread *t = thread_current ();
+  size_t limit = credits > TXN_MAX ? credits : TXN_MAX;
+
+  ASSERT (t->journal_depth == 1);
+  ASSERT (credits <= TXN_LIMIT);
+
+  lock_acquire (&journal_lock);
+  while (closing
+         || txn_cnt + charged_cnt + reserved_cnt + credits > limit)
+    if (closing)
+      cond_wait (&txn_open, &journal_lock);
+    else
+      {
+        lock_release (&journal_lock);
+        t->journal_depth--;
+        journal_commit ();
+        t->journal_depth++;
+        lock_acquire (&journal_lock);
+      }
+  active_cnt++;
+  op_cnt++;
+  reserved_cnt += credits;
+  t->journal_credits = credits;
+  lock_release (&journal_lock);
+}
+
+/* Commits the running transaction, as described at the top of
+   the file, and checkpoints afterward if CHECKPOINT is true or
+   the log is more than half full. */
+static void
+commit (bool checkpoint)
+{
+  struct thread *t = thread_current ();
+  size_t room, cnt;
+
+  ASSERT (t->journal_depth == 0);
+
+  /* Hold off new operations and wait for the running ones. */
+  lock_acquire (&commit_lock);
+  lock_acquire (&journal_lock);
+  closing = true;
+  while (active_cnt > 0)
+    cond_wait (&txn_drained, &journal_lock);
+  room = TXN_LIMIT - txn_cnt;
+  charged_cnt = 0;
+  lock_release (&journal_lock);
+
+  /* Give the free map the sectors that the transaction freed,
+     and bring its file up to date as part of the transaction,
+     in whatever room the transaction has left. */
+  t->journal_depth++;
+  free_map_commit (room);
+  t->journal_depth--;
+  lock_acquire (&journal_lock);
+  reserved_cnt -= t->journal_credits;
+  t->journal_credits = 0;
+  lock_release (&journal_lock);
+
+  /* Nothing else changes the transaction until CLOSING is reset. */
+  cnt = txn_cnt + revoke_cnt;
+  if (cnt > 0)
+    {
+      /* Make room in the log if necessary.  The transaction's
+         sectors are still held, so they stay put. */
+      if (log_used + txn_cnt + DESC_MAX > LOG_SECTORS)
+        {
+          cache_flush ();
+          block_flush (fs_device);
+          reset_log (txn_seq);
+          checkpoint_cnt++;
+        }
+      write_log ();
+      cache_commit (txn_seq);
+      commit_cnt++;
+    }
+  if (checkpoint || log_used > LOG_SECTORS / 2)
+    {
+      cache_flush ();
+      block_flush (fs_device);
+      reset_log (cnt > 0 ? txn_seq + 1 : txn_seq);
+      checkpoint_cnt++;
+    }
+
+  /* Open a new transaction. */
+  lock_acquire (&journal_lock);
+  if (cnt > 0)
+    {
+      txn_seq++;
+      txn_cnt = 0;
+      revoke_cnt = 0;
+    }
+  closing = false;
+  cond_broadcast (&txn_open, &journal_lock);
+  lock_release (&journal_lock);
+  lock_release (&commit_lock);
+}
+
+/* Appends the running transaction to the log, as descriptors
+   each followed by the contents of the sectors it lists, and
+   makes it durable.  COMMIT_LOCK must be held. */
+static void
+write_log (void)
+{
+  struct block_iovec iov[2 * DESC_MAX];
+  size_t iov_cnt = 0;
+  size_t desc_cnt = 0;
+  size_t entry = 0;
+  size_t len = 0;
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&commit_lock));
+
+  for (i = 0; i < txn_cnt; i++)
+    cache_read (txn_sectors[i], data + i * BLOCK_SECTOR_SIZE);
+
+  /* Fill descriptors with the sectors' targets, then the revoke
+     records. */
+  do
+    {
+      struct descriptor *d = &desc[desc_cnt++];
+      uint8_t *contents = data + (entry < txn_cnt ? entry : txn_cnt)
+                                 * BLOCK_SECTOR_SIZE;
+
+      ASSERT (desc_cnt <= DESC_MAX);
+      memset (d, 0, sizeof *d);
+      d->magic = DESC_MAGIC;
+      d->seq = txn_seq;
+      for (; (entry < txn_cnt + revoke_cnt
+              && d->cnt + d->revoke_cnt < DESC_ENTRY_CNT); entry++)
+        if (entry < txn_cnt)
+          d->entries[d->cnt++] = txn_sectors[entry];
+        else
+          d->entries[d->cnt + d->revoke_cnt++] = revokes[entry - txn_cnt];
+      d->last = entry == txn_cnt + revoke_cnt;
+      d->checksum = checksum (d, contents);
+
+      iov[iov_cnt].buffer = d;
+      iov[iov_cnt++].sector_cnt = 1;
+      if (d->cnt > 0)
+        {
+          iov[iov_cnt].buffer = contents;
+          iov[iov_cnt++].sector_cnt = d->cnt;
+        }
+      len += 1 + d->cnt;
+    }
+  while (entry < txn_cnt + revoke_cnt);
+
+  ASSERT (log_used + len <= LOG_SECTORS);
+  block_writev (fs_device, LOG_START + log_used, iov, iov_cnt);
+  block_flush (fs_device);
+  log_used += len;
+  logged_total += txn_cnt;
+  revoked_cnt += revoke_cnt;
+
+  /* Remember the logged sectors, in case they are revoked. */
+  lock_acquire (&journal_lock);
+  for (i = 0; i < txn_cnt; i++)
+    if (!in_list (logged, logged_cnt, txn_sectors[i]))
+      logged[logged_cnt++] = txn_sectors[i];
+  lock_release (&journal_lock);
+}
+
+/* Empties the log, so that the next transaction written to it,
+   at LOG_START, must have sequence number SEQ. */
+static void
+reset_log (uint32_t seq)
+{
+  memset (header, 0, sizeof *header);
+  header->magic = JOURNAL_MAGIC;
+  header->seq = seq;
+  block_write (fs_device, JOURNAL_SECTOR, header);
+  block_flush (fs_device);
+  log_used = 0;
+
+  lock_acquire (&journal_lock);
+  logged_cnt = 0;
+  lock_release (&journal_lock);
+}
+
+/* Returns true if SECTOR is among the CNT sectors in LIST. */
+static bool
+in_list (const block_sector_t *list, size_t cnt, block_sector_t sector)
+{
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    if (list[i] == sector)
+      return true;
+  return false;
+}
+
+/* Returns a checksum of descriptor D's header and entries and
+   of the contents of its sectors in CONTENTS. */
+static uint32_t
+checksum (const struct descriptor *d, const uint8_t *contents)
+{
+  return (hash_bytes (d, offsetof (struct descriptor, checksum))
+          ^ hash_bytes (d->entries, (d->cnt + d->revoke_cnt)
+                                    * sizeof *d->entries) * 31
+          ^ hash_bytes (contents, d->cnt * BLOCK_SECTOR_SIZE));
+}
+
+/* Journal thread.  Commits the running transaction
+   periodically, and whenever it fills up. */
+static void
+journal_thread (void *aux UNUSED)
+{
+  int64_t last_commit = timer_ticks ();
+
+  for (;;)
+    {
+      timer_sleep (COMMIT_POLL);
+      if (txn_cnt >= TXN_FULL
+          || (txn_cnt > 0 && timer_elapsed (last_commit) >= COMMIT_INTERVAL))
+        {
+          journal_commit ();
+          last_commit = timer_ticks ();
+        }
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+
+/* Number of sectors in the journal, starting at JOURNAL_SECTOR. */
+#define JOURNAL_SECTORS 128
+
+void journal_init (bool format);
+void journal_begin (void);
+void journal_end (void);
+bool journal_extend (size_t cnt);
+bool journal_restart (size_t cnt);
+void journal_write (block_sector_t, const void *);
+void journal_write_at (block_sector_t, const void *, size_t ofs, size_t size);
+void journal_charge (size_t cnt);
+void journal_revoke (block_sector_t, size_t cnt);
+void journal_commit (void);
+void journal_checkpoint (void);
+void journal_print_stats (void);
+
+#endif /* filesys/journal.h */
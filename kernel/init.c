@@ -19,6 +19,7 @@
 #include "kernel/io.h"
 #include "kernel/loader.h"
 #include "kernel/malloc.h"
+#include "kernel/vmalloc.h"
 #include "kernel/palloc.h"
 #include "kernel/pte.h"
 #include "kernel/thread.h"
@@ -30,6 +31,9 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "devices/ramdisk.h"
+#include "devices/virtio-blk.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #endif
@@ -100,6 +104,7 @@ main (void)
   palloc_init (user_page_limit);
   malloc_init ();
   paging_init ();
+  vmalloc_init ();
 
   /* Segmentation. */
 #ifdef USERPROG
@@ -126,7 +131,9 @@ main (void)
 
 #ifdef FILESYS
   /* Initialize file system. */
+  ramdisk_init ();
   ide_init ();
+  virtio_blk_init ();
   locate_block_devices ();
   filesys_init (format_filesys);
 #endif
@@ -254,6 +261,24 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-cache"))
+        cache_configure (atoi (value));
+      else if (!strcmp (name, "-no-dma"))
+        ide_disable_dma ();
+      else if (!strcmp (name, "-no-wcache"))
+        ide_disable_write_cache ();
+      else if (!strcmp (name, "-iosched"))
+        {
+          if (!block_configure_scheduler (value))
+            PANIC ("unknown I/O scheduler `%s' (use -h for help)", value);
+        }
+      else if (!strcmp (name, "-blktrace"))
+        block_configure_trace (atoi (value));
+      else if (!strcmp (name, "-ramdisk"))
+        {
+          if (!ramdisk_configure (value))
+            PANIC ("bad RAM disk `%s' (use -h for help)", value);
+        }
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -380,6 +405,13 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -cache=SECTORS     Cache SECTORS file system sectors (64-1024).\n"
+          "  -no-dma            Use programmed I/O for IDE disks, not DMA.\n"
+          "  -no-wcache         Leave IDE disks' write caches off.\n"
+          "  -iosched=NAME      Use I/O scheduler NAME (fifo, cscan, deadline).\n"
+          "  -blktrace=N        Trace the last N block requests.\n"
+          "  -ramdisk=[ROLE:]KB Add a RAM disk of KB kB, the default device\n"
+          "                     for ROLE (filesys, scratch, or swap) if given.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
@@ -6,7 +6,10 @@
 #include <stdio.h>
 #include <string.h>
 #include "kernel/palloc.h"
+#include "kernel/interrupt.h"
 #include "kernel/synch.h"
+#include "kernel/thread.h"
+#include "kernel/vmalloc.h"
 #include "kernel/vaddr.h"
 
 /* A simple implementation of malloc().
@@ -32,7 +35,27 @@
    because they're too big to fit in a single page with a
    descriptor.  We handle those by allocating contiguous pages
    with the page allocator and sticking the allocation size at
-   the beginning of the allocated block's arena header. */
+   the beginning of the allocated block's arena header.  If the
+   page allocator has no run of contiguous pages that long, the
+   pages come from vmalloc() instead, which only needs them to be
+   contiguous in virtual memory.
+
+   In front of each descriptor, every thread has a "magazine" of
+   up to MAGAZINE_SIZE free blocks of that size, kept in its
+   struct thread.  Only the owning thread ever touches its
+   magazines, so most malloc() and free() calls complete without
+   taking the descriptor's lock.  An empty magazine is refilled,
+   and a full one drained, MAGAZINE_BATCH blocks at a time
+   against the descriptor's free list.  Blocks in a magazine are
+   still in use as far as their arena is concerned.  A thread's
+   magazines are drained when it exits. */
+
+/* Maximum number of blocks in a magazine. */
+#define MAGAZINE_SIZE 16
+
+/* Number of blocks moved between a magazine and its descriptor
+   at a time. */
+#define MAGAZINE_BATCH 8
 
 /* Descriptor. */
 struct desc
@@ -41,6 +64,10 @@ struct desc
     size_t blocks_per_arena;    /* Number of blocks in an arena. */
     struct list free_list;      /* List of free blocks. */
     struct lock lock;           /* Lock. */
+
+    /* Magazine statistics of threads that have exited. */
+    unsigned long long hits;    /* Requests satisfied by a magazine. */
+    unsigned long long misses;  /* Requests that refilled a magazine. */
   };
 
 /* Magic number for detecting arena corruption. */
@@ -57,15 +84,22 @@ struct arena
 /* Free block. */
 struct block 
   {
-    struct list_elem free_elem; /* Free list element. */
+    union
+      {
+        struct list_elem free_elem; /* Free list element. */
+        struct block *next;         /* Next block in a magazine. */
+      };
   };
 
 /* Our set of descriptors. */
-static struct desc descs[10];   /* Descriptors. */
+static struct desc descs[MALLOC_CLASS_CNT]; /* Descriptors. */
 static size_t desc_cnt;         /* Number of descriptors. */
 
 static struct arena *block_to_arena (struct block *);
 static struct block *arena_to_block (struct arena *, size_t idx);
+static bool refill (struct desc *, struct magazine *);
+static void drain (struct desc *, struct magazine *, size_t cnt);
+static void release_block (struct desc *, struct block *);
 
 /* Initializes the malloc() descriptors. */
 void
@@ -81,7 +115,9 @@ malloc_init (void)
       d->blocks_per_arena = (PGSIZE - sizeof (struct arena)) / block_size;
       list_init (&d->free_list);
       lock_init (&d->lock);
+      d->hits = d->misses = 0;
     }
+  ASSERT (desc_cnt == MALLOC_CLASS_CNT);
 }
 
 /* Obtains and returns a new block of at least SIZE bytes.
@@ -90,6 +126,7 @@ void *
 malloc (size_t size) 
 {
   struct desc *d;
+  struct magazine *m;
   struct block *b;
   struct arena *a;
 
@@ -108,6 +145,8 @@ malloc (size_t size)
          Allocate enough pages to hold SIZE plus an arena. */
       size_t page_cnt = DIV_ROUND_UP (size + sizeof *a, PGSIZE);
       a = palloc_get_multiple (0, page_cnt);
+      if (a == NULL && page_cnt > 1)
+        a = vmalloc (page_cnt * PGSIZE);
       if (a == NULL)
         return NULL;
 
@@ -119,37 +158,20 @@ malloc (size_t size)
       return a + 1;
     }
 
-  lock_acquire (&d->lock);
-
-  /* If the free list is empty, create a new arena. */
-  if (list_empty (&d->free_list))
+  /* Take a block from this thread's magazine, refilling it
+     first if it is empty. */
+  m = &thread_current ()->magazines[d - descs];
+  if (m->cnt == 0)
     {
-      size_t i;
-
-      /* Allocate a page. */
-      a = palloc_get_page (0);
-      if (a == NULL) 
-        {
-          lock_release (&d->lock);
-          return NULL; 
-        }
-
-      /* Initialize arena and add its blocks to the free list. */
-      a->magic = ARENA_MAGIC;
-      a->desc = d;
-      a->free_cnt = d->blocks_per_arena;
-      for (i = 0; i < d->blocks_per_arena; i++) 
-        {
-          struct block *b = arena_to_block (a, i);
-          list_push_back (&d->free_list, &b->free_elem);
-        }
+      m->misses++;
+      if (!refill (d, m))
+        return NULL;
     }
-
-  /* Get a block from free list and return it. */
-  b = list_entry (list_pop_front (&d->free_list), struct block, free_elem);
-  a = block_to_arena (b);
-  a->free_cnt--;
-  lock_release (&d->lock);
+  else
+    m->hits++;
+  b = m->head;
+  m->head = b->next;
+  m->cnt--;
   return b;
 }
 
@@ -228,41 +250,189 @@ free (void *p)
         {
           /* It's a normal block.  We handle it here. */
 
+          struct magazine *m = &thread_current ()->magazines[d - descs];
+
 #ifndef NDEBUG
           /* Clear the block to help detect use-after-free bugs. */
           memset (b, 0xcc, d->block_size);
 #endif
-  
-          lock_acquire (&d->lock);
-
-          /* Add block to free list. */
-          list_push_front (&d->free_list, &b->free_elem);
-
-          /* If the arena is now entirely unused, free it. */
-          if (++a->free_cnt >= d->blocks_per_arena) 
-            {
-              size_t i;
-
-              ASSERT (a->free_cnt == d->blocks_per_arena);
-              for (i = 0; i < d->blocks_per_arena; i++) 
-                {
-                  struct block *b = arena_to_block (a, i);
-                  list_remove (&b->free_elem);
-                }
-              palloc_free_page (a);
-            }
 
-          lock_release (&d->lock);
+          /* Put the block in this thread's magazine, making room
+             first if it is full. */
+          if (m->cnt >= MAGAZINE_SIZE)
+            drain (d, m, MAGAZINE_BATCH);
+          b->next = m->head;
+          m->head = b;
+          m->cnt++;
         }
       else
         {
           /* It's a big block.  Free its pages. */
-          palloc_free_multiple (a, a->free_cnt);
+          if (is_vmalloc_vaddr (a))
+            vfree (a);
+          else
+            palloc_free_multiple (a, a->free_cnt);
           return;
         }
     }
 }
 
+/* Gives back all of the running thread's cached blocks and
+   records its magazine statistics.  Called by thread_exit(). */
+void
+malloc_thread_exit (void)
+{
+  struct thread *t = thread_current ();
+  size_t i;
+
+  for (i = 0; i < desc_cnt; i++)
+    {
+      struct desc *d = &descs[i];
+      struct magazine *m = &t->magazines[i];
+
+      drain (d, m, m->cnt);
+      lock_acquire (&d->lock);
+      d->hits += m->hits;
+      d->misses += m->misses;
+      lock_release (&d->lock);
+      m->hits = m->misses = 0;
+    }
+}
+
+/* Adds thread T's magazine statistics to the array of
+   2 * MALLOC_CLASS_CNT counters in AUX. */
+static void
+sum_magazine_stats (struct thread *t, void *aux)
+{
+  unsigned long long *sums = aux;
+  size_t i;
+
+  for (i = 0; i < MALLOC_CLASS_CNT; i++)
+    {
+      sums[2 * i] += t->magazines[i].hits;
+      sums[2 * i + 1] += t->magazines[i].misses;
+    }
+}
+
+/* Prints magazine statistics for each size class. */
+void
+malloc_print_stats (void)
+{
+  unsigned long long sums[2 * MALLOC_CLASS_CNT];
+  enum intr_level old_level;
+  size_t i;
+
+  for (i = 0; i < desc_cnt; i++)
+    {
+      sums[2 * i] = descs[i].hits;
+      sums[2 * i + 1] = descs[i].misses;
+    }
+  old_level = intr_disable ();
+  thread_foreach (sum_magazine_stats, sums);
+  intr_set_level (old_level);
+
+  for (i = 0; i < desc_cnt; i++)
+    if (sums[2 * i] + sums[2 * i + 1] > 0)
+      printf ("Malloc: %zu-byte blocks: %llu magazine hits, %llu misses\n",
+              descs[i].block_size, sums[2 * i], sums[2 * i + 1]);
+}
+
+/* Moves up to MAGAZINE_BATCH blocks from descriptor D into
+   magazine M, which must be empty, creating a new arena if
+   needed.  Returns false if no block could be obtained. */
+static bool
+refill (struct desc *d, struct magazine *m)
+{
+  ASSERT (m->cnt == 0);
+
+  lock_acquire (&d->lock);
+  while (m->cnt < MAGAZINE_BATCH)
+    {
+      struct block *b;
+      struct arena *a;
+
+      /* If the free list is empty, create a new arena. */
+      if (list_empty (&d->free_list))
+        {
+          size_t i;
+
+          /* Allocate a page, settling for what we already have
+             if there is none. */
+          a = palloc_get_page (0);
+          if (a == NULL)
+            break;
+
+          /* Initialize arena and add its blocks to the free list. */
+          a->magic = ARENA_MAGIC;
+          a->desc = d;
+          a->free_cnt = d->blocks_per_arena;
+          for (i = 0; i < d->blocks_per_arena; i++) 
+            {
+              b = arena_to_block (a, i);
+              list_push_back (&d->free_list, &b->free_elem);
+            }
+        }
+
+      /* Move a block from the free list to the magazine. */
+      b = list_entry (list_pop_front (&d->free_list), struct block, free_elem);
+      a = block_to_arena (b);
+      a->free_cnt--;
+      b->next = m->head;
+      m->head = b;
+      m->cnt++;
+    }
+  lock_release (&d->lock);
+
+  return m->cnt > 0;
+}
+
+/* Returns CNT blocks from magazine M to descriptor D. */
+static void
+drain (struct desc *d, struct magazine *m, size_t cnt)
+{
+  ASSERT (cnt <= m->cnt);
+
+  if (cnt == 0)
+    return;
+
+  lock_acquire (&d->lock);
+  while (cnt-- > 0)
+    {
+      struct block *b = m->head;
+      m->head = b->next;
+      m->cnt--;
+      release_block (d, b);
+    }
+  lock_release (&d->lock);
+}
+
+/* Adds block B to descriptor D's free list, freeing its arena
+   if the arena is now entirely unused.  D must be locked. */
+static void
+release_block (struct desc *d, struct block *b)
+{
+  struct arena *a = block_to_arena (b);
+
+  ASSERT (lock_held_by_current_thread (&d->lock));
+
+  /* Add block to free list. */
+  list_push_front (&d->free_list, &b->free_elem);
+
+  /* If the arena is now entirely unused, free it. */
+  if (++a->free_cnt >= d->blocks_per_arena) 
+    {
+      size_t i;
+
+      ASSERT (a->free_cnt == d->blocks_per_arena);
+      for (i = 0; i < d->blocks_per_arena; i++) 
+        {
+          struct block *b = arena_to_block (a, i);
+          list_remove (&b->free_elem);
+        }
+      palloc_free_page (a);
+    }
+}
+
 /* Returns the arena that block B is inside. */
 static struct arena *
 block_to_arena (struct block *b)
@@ -4,10 +4,25 @@
 #include <debug.h>
 #include <stddef.h>
 
+/* Number of malloc() size classes: 16, 32, ..., 1024 bytes. */
+#define MALLOC_CLASS_CNT 7
+
+/* A thread's cache of free blocks of one size class.  See
+   malloc.c. */
+struct magazine
+  {
+    void *head;                 /* First free block. */
+    unsigned cnt;               /* Number of free blocks. */
+    unsigned hits;              /* Requests satisfied from here. */
+    unsigned misses;            /* Requests that needed a refill. */
+  };
+
 void malloc_init (void);
 void *malloc (size_t) __attribute__ ((malloc));
 void *calloc (size_t, size_t) __attribute__ ((malloc));
 void *realloc (void *, size_t);
 void free (void *);
+void malloc_thread_exit (void);
+void malloc_print_stats (void);
 
 #endif /* kernel/malloc.h */
@@ -2,11 +2,13 @@
 #include <bitmap.h>
 #include <debug.h>
 #include <inttypes.h>
+#include <list.h>
 #include <round.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "kernel/interrupt.h"
 #include "kernel/loader.h"
 #include "kernel/synch.h"
 #include "kernel/vaddr.h"
@@ -23,14 +25,77 @@
 
    By default, half of system RAM is given to the kernel pool and
    half to the user pool.  That should be huge overkill for the
-   kernel pool, but that's just fine for demonstration purposes. */
+   kernel pool, but that's just fine for demonstration purposes.
+
+   Within a pool, pages are managed by a binary buddy allocator.
+   Free memory is kept as blocks of 2**ORDER pages, each aligned
+   (relative to the pool base) on its own size, on one free list
+   per order.  A request for PAGE_CNT pages takes a block from the
+   smallest nonempty list that is big enough, splits it in half
+   as many times as needed, and gives the unused tail of the last
+   block straight back.  Freeing a block merges it with its
+   "buddy", the other half of the block it was split from, for as
+   long as the buddy is free too.  Both directions take time
+   proportional to the number of orders, not to the size of the
+   pool.
+
+   Each pool also keeps a small stash of free pages that have
+   already been filled with zeros.  The idle thread refills the
+   stash one page at a time whenever nothing else wants to run
+   (see palloc_prezero_page()), so that PAL_ZERO requests for a
+   single page, which include every new thread and every
+   demand-zero user page, don't pay for the memset() themselves.
+   Stashed pages count as allocated as far as the buddy allocator
+   is concerned, so they are handed back out when the pool runs
+   dry.
+
+   A pool is protected by disabling interrupts, not by a lock,
+   because pages are freed from inside the scheduler, in
+   thread_schedule_tail(), where blocking is impossible and the
+   thread switched to may have been preempted while allocating.
+   Neither direction of the buddy allocator takes long enough for
+   that to matter. */
+
+/* Number of block orders.  The largest block is 2**(ORDER_CNT - 1)
+   pages, that is, 128 MB. */
+#define ORDER_CNT 16
+
+/* Upper bound on the number of pre-zeroed pages in a pool. */
+#define ZEROED_MAX 64
 
 /* A memory pool. */
 struct pool
   {
-    struct lock lock;                   /* Mutual exclusion. */
-    struct bitmap *used_map;            /* Bitmap of free pages. */
+    struct bitmap *used_map;            /* Bitmap of allocated pages. */
     uint8_t *base;                      /* Base of pool. */
+    size_t page_cnt;                    /* Number of pages in pool. */
+
+    /* Buddy allocator. */
+    uint8_t *orders;                    /* Per page: 1 + order if the page
+                                           starts a free block, else 0. */
+    struct list free_lists[ORDER_CNT];  /* Free blocks, by order. */
+    size_t free_blocks[ORDER_CNT];      /* Length of each free list. */
+
+    /* Pre-zeroed pages. */
+    struct list zeroed;                 /* Pre-zeroed free pages. */
+    size_t zeroed_cnt;                  /* Number of pages in ZEROED. */
+    size_t zeroed_max;                  /* Target size of ZEROED. */
+    unsigned long long zero_hits;       /* PAL_ZERO pages from ZEROED. */
+    unsigned long long zero_misses;     /* PAL_ZERO pages zeroed on demand. */
+  };
+
+/* A free buddy block's link in its pool's free list, stored in
+   the block's first page. */
+struct free_block
+  {
+    struct list_elem elem;
+  };
+
+/* A pre-zeroed page's link in its pool's ZEROED list.  It is
+   cleared again when the page leaves the list. */
+struct zeroed_page
+  {
+    struct list_elem elem;
   };
 
 /* Two pools: one for kernel data, one for user pages. */
@@ -39,6 +104,11 @@ static struct pool kernel_pool, user_pool;
 static void init_pool (struct pool *, void *base, size_t page_cnt,
                        const char *name);
 static bool page_from_pool (const struct pool *, void *page);
+static size_t alloc_pages (struct pool *, size_t page_cnt);
+static void free_pages (struct pool *, size_t page_idx, size_t page_cnt);
+static void *take_zeroed (struct pool *);
+static bool release_zeroed (struct pool *);
+static void print_pool_stats (const struct pool *, const char *name);
 
 /* Initializes the page allocator.  At most USER_PAGE_LIMIT
    pages are put into the user pool. */
@@ -71,25 +141,56 @@ void *
 palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
 {
   struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+  enum intr_level old_level;
   void *pages;
   size_t page_idx;
 
   if (page_cnt == 0)
     return NULL;
 
-  lock_acquire (&pool->lock);
-  page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
-  lock_release (&pool->lock);
+  /* A single zeroed page can usually come straight from the
+     pre-zeroed stash. */
+  if (page_cnt == 1 && (flags & PAL_ZERO))
+    {
+      pages = take_zeroed (pool);
+      if (pages != NULL)
+        {
+          pool->zero_hits++;
+          return pages;
+        }
+    }
+
+  do
+    {
+      old_level = intr_disable ();
+      page_idx = alloc_pages (pool, page_cnt);
+      intr_set_level (old_level);
+    }
+  while (page_idx == BITMAP_ERROR && page_cnt > 1 && release_zeroed (pool));
 
   if (page_idx != BITMAP_ERROR)
     pages = pool->base + PGSIZE * page_idx;
+  else if (page_cnt == 1)
+    {
+      /* Out of free pages, but a pre-zeroed page is still a free
+         page. */
+      pages = take_zeroed (pool);
+      if (pages != NULL && (flags & PAL_ZERO))
+        {
+          pool->zero_hits++;
+          return pages;
+        }
+    }
   else
     pages = NULL;
 
   if (pages != NULL) 
     {
       if (flags & PAL_ZERO)
-        memset (pages, 0, PGSIZE * page_cnt);
+        {
+          pool->zero_misses++;
+          memset (pages, 0, PGSIZE * page_cnt);
+        }
     }
   else 
     {
@@ -118,6 +219,7 @@ void
 palloc_free_multiple (void *pages, size_t page_cnt) 
 {
   struct pool *pool;
+  enum intr_level old_level;
   size_t page_idx;
 
   ASSERT (pg_ofs (pages) == 0);
@@ -137,8 +239,9 @@ palloc_free_multiple (void *pages, size_t page_cnt)
   memset (pages, 0xcc, PGSIZE * page_cnt);
 #endif
 
-  ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
-  bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+  old_level = intr_disable ();
+  free_pages (pool, page_idx, page_cnt);
+  intr_set_level (old_level);
 }
 
 /* Frees the page at PAGE. */
@@ -148,25 +251,282 @@ palloc_free_page (void *page)
   palloc_free_multiple (page, 1);
 }
 
+/* Zeroes one free page ahead of time and adds it to its pool's
+   stash of pre-zeroed pages.  Called by the idle thread, so it
+   never blocks.
+   Returns true if a page was zeroed, false if there is nothing
+   left to do for now. */
+bool
+palloc_prezero_page (void)
+{
+  struct pool *pools[] = {&kernel_pool, &user_pool};
+  size_t i;
+
+  for (i = 0; i < sizeof pools / sizeof *pools; i++)
+    {
+      struct pool *pool = pools[i];
+      struct zeroed_page *zp;
+      enum intr_level old_level;
+      size_t page_idx;
+
+      if (pool->zeroed_cnt >= pool->zeroed_max)
+        continue;
+      old_level = intr_disable ();
+      page_idx = alloc_pages (pool, 1);
+      intr_set_level (old_level);
+      if (page_idx == BITMAP_ERROR)
+        continue;
+
+      zp = (struct zeroed_page *) (pool->base + PGSIZE * page_idx);
+      memset (zp, 0, PGSIZE);
+
+      old_level = intr_disable ();
+      list_push_front (&pool->zeroed, &zp->elem);
+      pool->zeroed_cnt++;
+      intr_set_level (old_level);
+      return true;
+    }
+  return false;
+}
+
+/* Prints page allocator statistics. */
+void
+palloc_print_stats (void)
+{
+  print_pool_stats (&kernel_pool, "kernel pool");
+  print_pool_stats (&user_pool, "user pool");
+}
+
+/* Removes and returns a page from POOL's pre-zeroed stash, or a
+   null pointer if the stash is empty. */
+static void *
+take_zeroed (struct pool *pool) 
+{
+  struct zeroed_page *zp = NULL;
+  enum intr_level old_level;
+
+  old_level = intr_disable ();
+  if (!list_empty (&pool->zeroed))
+    {
+      zp = list_entry (list_pop_front (&pool->zeroed),
+                       struct zeroed_page, elem);
+      pool->zeroed_cnt--;
+    }
+  intr_set_level (old_level);
+
+  if (zp != NULL)
+    memset (&zp->elem, 0, sizeof zp->elem);
+  return zp;
+}
+
+/* Returns every page in POOL's pre-zeroed stash to the buddy
+   allocator, so that they can be part of a multi-page
+   allocation.
+   Returns true if any pages were returned, false if the stash
+   was already empty. */
+static bool
+release_zeroed (struct pool *pool) 
+{
+  bool released = false;
+  void *page;
+
+  while ((page = take_zeroed (pool)) != NULL)
+    {
+      size_t page_idx = pg_no (page) - pg_no (pool->base);
+      enum intr_level old_level = intr_disable ();
+      free_pages (pool, page_idx, 1);
+      intr_set_level (old_level);
+      released = true;
+    }
+  return released;
+}
+
+/* Buddy allocator. */
+
+/* Returns the free block link for the block starting at page
+   PAGE_IDX in POOL. */
+static struct free_block *
+idx_to_block (const struct pool *pool, size_t page_idx)
+{
+  return (struct free_block *) (pool->base + PGSIZE * page_idx);
+}
+
+/* Puts the 2**ORDER-page block starting at PAGE_IDX on POOL's
+   free list for ORDER, without trying to merge it. */
+static void
+push_block (struct pool *pool, size_t page_idx, int order)
+{
+  pool->orders[page_idx] = order + 1;
+  pool->free_blocks[order]++;
+  list_push_front (&pool->free_lists[order],
+                   &idx_to_block (pool, page_idx)->elem);
+}
+
+/* Takes the 2**ORDER-page free block starting at PAGE_IDX off
+   POOL's free list for ORDER. */
+static void
+remove_block (struct pool *pool, size_t page_idx, int order)
+{
+  ASSERT (pool->orders[page_idx] == order + 1);
+  pool->orders[page_idx] = 0;
+  pool->free_blocks[order]--;
+  list_remove (&idx_to_block (pool, page_idx)->elem);
+}
+
+/* Frees the 2**ORDER-page block starting at PAGE_IDX in POOL,
+   merging it with its buddy for as long as the buddy is also
+   free. */
+static void
+free_block (struct pool *pool, size_t page_idx, int order)
+{
+  while (order + 1 < ORDER_CNT)
+    {
+      size_t size = (size_t) 1 << order;
+      size_t buddy_idx = page_idx ^ size;
+      if (buddy_idx + size > pool->page_cnt
+          || pool->orders[buddy_idx] != order + 1)
+        break;
+
+      remove_block (pool, buddy_idx, order);
+      page_idx &= ~size;
+      order++;
+    }
+  push_block (pool, page_idx, order);
+}
+
+/* Frees the PAGE_CNT pages starting at PAGE_IDX in POOL, which
+   need not be a single buddy block, by breaking them into the
+   largest aligned blocks that fit. */
+static void
+free_pages (struct pool *pool, size_t page_idx, size_t page_cnt)
+{
+  ASSERT (page_idx + page_cnt <= pool->page_cnt);
+  ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
+  bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+
+  while (page_cnt > 0)
+    {
+      int order = 0;
+      while (order + 1 < ORDER_CNT
+             && page_idx % ((size_t) 2 << order) == 0
+             && ((size_t) 2 << order) <= page_cnt)
+        order++;
+
+      free_block (pool, page_idx, order);
+      page_idx += (size_t) 1 << order;
+      page_cnt -= (size_t) 1 << order;
+    }
+}
+
+/* Allocates PAGE_CNT contiguous pages from POOL and returns the
+   index of the first, or BITMAP_ERROR if no free block is large
+   enough. */
+static size_t
+alloc_pages (struct pool *pool, size_t page_cnt)
+{
+  int want, order;
+  size_t page_idx;
+
+  /* Find the smallest order that can satisfy the request, then
+     the smallest nonempty free list at or above it. */
+  for (want = 0; want < ORDER_CNT; want++)
+    if (((size_t) 1 << want) >= page_cnt)
+      break;
+  for (order = want; order < ORDER_CNT; order++)
+    if (!list_empty (&pool->free_lists[order]))
+      break;
+  if (order >= ORDER_CNT)
+    return BITMAP_ERROR;
+
+  page_idx = pg_no (list_front (&pool->free_lists[order]))
+             - pg_no (pool->base);
+  remove_block (pool, page_idx, order);
+
+  /* Split off and free the upper halves we don't need. */
+  while (order > want)
+    {
+      order--;
+      push_block (pool, page_idx + ((size_t) 1 << order), order);
+    }
+
+  ASSERT (bitmap_none (pool->used_map, page_idx, (size_t) 1 << want));
+  bitmap_set_multiple (pool->used_map, page_idx, (size_t) 1 << want, true);
+
+  /* Give back the tail of the block beyond PAGE_CNT. */
+  if (((size_t) 1 << want) > page_cnt)
+    free_pages (pool, page_idx + page_cnt,
+                ((size_t) 1 << want) - page_cnt);
+
+  return page_idx;
+}
+
+/* Prints statistics for POOL, named NAME: its free memory by
+   block order, and how fragmented that free memory is, measured
+   as the fraction of free pages that lie outside the largest free
+   block. */
+static void
+print_pool_stats (const struct pool *pool, const char *name)
+{
+  size_t free_cnt = 0;
+  size_t largest = 0;
+  int order;
+
+  for (order = 0; order < ORDER_CNT; order++)
+    if (pool->free_blocks[order] > 0)
+      {
+        free_cnt += pool->free_blocks[order] << order;
+        largest = (size_t) 1 << order;
+      }
+
+  printf ("Palloc: %s: %zu of %zu pages free, largest free block "
+          "%zu pages, %zu%% fragmented\n",
+          name, free_cnt, pool->page_cnt, largest,
+          free_cnt > 0 ? (free_cnt - largest) * 100 / free_cnt : 0);
+  printf ("Palloc: %s: free blocks by order:", name);
+  for (order = 0; order < ORDER_CNT; order++)
+    printf (" %zu", pool->free_blocks[order]);
+  printf ("\n");
+  printf ("Palloc: %s: %zu pre-zeroed, %llu zero hits, "
+          "%llu zero misses\n", name, pool->zeroed_cnt,
+          pool->zero_hits, pool->zero_misses);
+}
+
 /* Initializes pool P as starting at START and ending at END,
    naming it NAME for debugging purposes. */
 static void
 init_pool (struct pool *p, void *base, size_t page_cnt, const char *name) 
 {
-  /* We'll put the pool's used_map at its base.
-     Calculate the space needed for the bitmap
-     and subtract it from the pool's size. */
-  size_t bm_pages = DIV_ROUND_UP (bitmap_buf_size (page_cnt), PGSIZE);
-  if (bm_pages > page_cnt)
+  /* We'll put the pool's used_map and order map at its base.
+     Calculate the space needed for them and subtract it from the
+     pool's size. */
+  size_t bm_size = bitmap_buf_size (page_cnt);
+  size_t meta_pages = DIV_ROUND_UP (bm_size + page_cnt, PGSIZE);
+  int order;
+
+  if (meta_pages > page_cnt)
     PANIC ("Not enough memory in %s for bitmap.", name);
-  page_cnt -= bm_pages;
+  page_cnt -= meta_pages;
 
   printf ("%zu pages available in %s.\n", page_cnt, name);
 
   /* Initialize the pool. */
-  lock_init (&p->lock);
-  p->used_map = bitmap_create_in_buf (page_cnt, base, bm_pages * PGSIZE);
-  p->base = base + bm_pages * PGSIZE;
+  p->used_map = bitmap_create_in_buf (page_cnt, base, bm_size);
+  p->base = base + meta_pages * PGSIZE;
+  p->page_cnt = page_cnt;
+  p->orders = (uint8_t *) base + bm_size;
+  memset (p->orders, 0, page_cnt);
+  for (order = 0; order < ORDER_CNT; order++)
+    {
+      list_init (&p->free_lists[order]);
+      p->free_blocks[order] = 0;
+    }
+  list_init (&p->zeroed);
+  p->zeroed_cnt = 0;
+  p->zeroed_max = page_cnt / 16 < ZEROED_MAX ? page_cnt / 16 : ZEROED_MAX;
+
+  /* Carve the whole pool into free blocks. */
+  bitmap_set_all (p->used_map, true);
+  free_pages (p, 0, page_cnt);
 }
 
 /* Returns true if PAGE was allocated from POOL,
@@ -176,7 +536,7 @@ page_from_pool (const struct pool *pool, void *page)
 {
   size_t page_no = pg_no (page);
   size_t start_page = pg_no (pool->base);
-  size_t end_page = start_page + bitmap_size (pool->used_map);
+  size_t end_page = start_page + pool->page_cnt;
 
   return page_no >= start_page && page_no < end_page;
 }
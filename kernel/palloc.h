@@ -1,6 +1,7 @@
 #ifndef KERNEL_PALLOC_H
 #define KERNEL_PALLOC_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 /* How to allocate pages. */
@@ -16,5 +17,7 @@ void *palloc_get_page (enum palloc_flags);
 void *palloc_get_multiple (enum palloc_flags, size_t page_cnt);
 void palloc_free_page (void *);
 void palloc_free_multiple (void *, size_t page_cnt);
+bool palloc_prezero_page (void);
+void palloc_print_stats (void);
 
 #endif /* kernel/palloc.h */
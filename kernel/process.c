@@ -205,6 +205,15 @@ process_exit (void)
       pagedir_activate (NULL);
       pagedir_destroy (pd);
     }
+
+  /* Close the executable only now that no page refers to it.
+     Closing may block, so it cannot wait for the scheduler to
+     destroy this thread. */
+  if (cur->exec_file != NULL)
+    {
+      file_close (cur->exec_file);
+      cur->exec_file = NULL;
+    }
 }
 
 /* Sets up the CPU for running user code in the current
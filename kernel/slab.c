@@ -0,0 +1,243 @@
+#include "kernel/slab.h"
+#include <debug.h>
+#include <list.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "kernel/palloc.h"
+#include "kernel/synch.h"
+#include "kernel/vaddr.h"
+
+/* Slab allocator for fixed-size kernel objects.
+
+   Each cache hands out objects of exactly one size, rounded up
+   only to pointer alignment, instead of to the next power of 2
+   as malloc() does.  The cache carves single pages, called
+   "slabs", into as many objects as fit after a small slab
+   header, and chains each slab's free objects together through
+   their first word.
+
+   A cache keeps its slabs that still have free objects on a
+   "partial" list and allocates from the front of it, so that
+   objects allocated close together in time also tend to be
+   close together in memory.  A full slab drops off the list
+   until one of its objects is freed.  When a slab becomes
+   entirely free, it goes back to the page allocator, except
+   that each cache holds on to one empty slab to avoid
+   allocating and freeing a page over and over at the
+   boundary.
+
+   An optional constructor is run on every object as it is
+   allocated, so callers that want their objects zeroed or
+   otherwise set up can say so once at cache creation. */
+
+/* Magic number for detecting slab corruption. */
+#define SLAB_MAGIC 0x51ab51ab
+
+/* Object cache. */
+struct kmem_cache
+  {
+    const char *name;           /* Name, for statistics. */
+    size_t obj_size;            /* Size of each object in bytes. */
+    size_t objs_per_slab;       /* Number of objects in a slab. */
+    kmem_ctor_func *ctor;       /* Constructor, or null. */
+    struct list partial;        /* Slabs with at least one free object. */
+    size_t slab_cnt;            /* Number of slabs. */
+    size_t empty_cnt;           /* Number of entirely free slabs. */
+    struct lock lock;           /* Lock. */
+
+    /* Statistics. */
+    size_t in_use;                      /* Objects allocated now. */
+    size_t peak;                        /* High-water mark of IN_USE. */
+    unsigned long long alloc_cnt;       /* Total allocations. */
+    unsigned long long free_cnt;        /* Total frees. */
+  };
+
+/* Slab header, at the start of each slab's page. */
+struct slab
+  {
+    unsigned magic;             /* Always set to SLAB_MAGIC. */
+    struct kmem_cache *cache;   /* Owning cache. */
+    size_t free_cnt;            /* Number of free objects. */
+    void *free;                 /* First free object. */
+    struct list_elem elem;      /* Element in cache's PARTIAL list. */
+  };
+
+/* Our set of caches. */
+static struct kmem_cache caches[16];
+static size_t cache_cnt;
+
+static struct slab *new_slab (struct kmem_cache *);
+static struct slab *object_to_slab (struct kmem_cache *, void *);
+
+/* Creates and returns a cache of SIZE-byte objects named NAME.
+   If CTOR is nonnull, it is called on each object as it is
+   allocated.  Caches are never destroyed. */
+struct kmem_cache *
+kmem_cache_create (const char *name, size_t size, kmem_ctor_func *ctor)
+{
+  struct kmem_cache *c;
+
+  ASSERT (name != NULL);
+  ASSERT (size > 0);
+
+  size = ROUND_UP (size, sizeof (void *));
+  ASSERT (size <= (PGSIZE - sizeof (struct slab)) / 2);
+
+  ASSERT (cache_cnt < sizeof caches / sizeof *caches);
+  c = &caches[cache_cnt++];
+  c->name = name;
+  c->obj_size = size;
+  c->objs_per_slab = (PGSIZE - sizeof (struct slab)) / size;
+  c->ctor = ctor;
+  list_init (&c->partial);
+  c->slab_cnt = 0;
+  c->empty_cnt = 0;
+  lock_init (&c->lock);
+  c->in_use = c->peak = 0;
+  c->alloc_cnt = c->free_cnt = 0;
+  return c;
+}
+
+/* Obtains and returns a new object from cache C.
+   Returns a null pointer if memory is not available. */
+void *
+kmem_cache_alloc (struct kmem_cache *c)
+{
+  struct slab *s;
+  void *obj;
+
+  lock_acquire (&c->lock);
+  if (list_empty (&c->partial))
+    {
+      s = new_slab (c);
+      if (s == NULL)
+        {
+          lock_release (&c->lock);
+          return NULL;
+        }
+      list_push_front (&c->partial, &s->elem);
+    }
+  else
+    s = list_entry (list_front (&c->partial), struct slab, elem);
+
+  /* Take the slab's first free object. */
+  if (s->free_cnt-- == c->objs_per_slab)
+    c->empty_cnt--;
+  obj = s->free;
+  s->free = *(void **) obj;
+  if (s->free_cnt == 0)
+    list_remove (&s->elem);
+
+  if (++c->in_use > c->peak)
+    c->peak = c->in_use;
+  c->alloc_cnt++;
+  lock_release (&c->lock);
+
+  if (c->ctor != NULL)
+    c->ctor (obj);
+  return obj;
+}
+
+/* Returns OBJ, which must have been obtained from cache C, to
+   the cache. */
+void
+kmem_cache_free (struct kmem_cache *c, void *obj)
+{
+  struct slab *s;
+
+  if (obj == NULL)
+    return;
+
+  s = object_to_slab (c, obj);
+
+#ifndef NDEBUG
+  /* Clear the object to help detect use-after-free bugs. */
+  memset (obj, 0xcc, c->obj_size);
+#endif
+
+  lock_acquire (&c->lock);
+  *(void **) obj = s->free;
+  s->free = obj;
+  if (s->free_cnt++ == 0)
+    list_push_front (&c->partial, &s->elem);
+  c->in_use--;
+  c->free_cnt++;
+
+  /* Keep one empty slab around; give back any more than that. */
+  if (s->free_cnt == c->objs_per_slab && ++c->empty_cnt > 1)
+    {
+      list_remove (&s->elem);
+      c->empty_cnt--;
+      c->slab_cnt--;
+      s->magic = 0;
+      palloc_free_page (s);
+    }
+  lock_release (&c->lock);
+}
+
+/* Prints statistics for each cache. */
+void
+kmem_print_stats (void)
+{
+  size_t i;
+
+  for (i = 0; i < cache_cnt; i++)
+    {
+      struct kmem_cache *c = &caches[i];
+      printf ("Slab: %s: %zu-byte objects, %zu in use (peak %zu), "
+              "%zu slabs, %llu allocs, %llu frees\n",
+              c->name, c->obj_size, c->in_use, c->peak, c->slab_cnt,
+              c->alloc_cnt, c->free_cnt);
+    }
+}
+
+/* Allocates a new slab for cache C, which must be locked, and
+   threads all of its objects onto its free list.  Returns the
+   slab, or a null pointer if no page is available. */
+static struct slab *
+new_slab (struct kmem_cache *c)
+{
+  struct slab *s;
+  uint8_t *obj;
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&c->lock));
+
+  s = palloc_get_page (0);
+  if (s == NULL)
+    return NULL;
+
+  s->magic = SLAB_MAGIC;
+  s->cache = c;
+  s->free_cnt = c->objs_per_slab;
+  s->free = NULL;
+  obj = (uint8_t *) (s + 1) + (c->objs_per_slab - 1) * c->obj_size;
+  for (i = 0; i < c->objs_per_slab; i++, obj -= c->obj_size)
+    {
+      *(void **) obj = s->free;
+      s->free = obj;
+    }
+
+  c->slab_cnt++;
+  c->empty_cnt++;
+  return s;
+}
+
+/* Returns the slab that OBJ, an object in cache C, is inside. */
+static struct slab *
+object_to_slab (struct kmem_cache *c, void *obj)
+{
+  struct slab *s = pg_round_down (obj);
+
+  /* Check that the slab is valid and belongs to C. */
+  ASSERT (s != NULL);
+  ASSERT (s->magic == SLAB_MAGIC);
+  ASSERT (s->cache == c);
+
+  /* Check that the object is properly aligned within the slab. */
+  ASSERT ((pg_ofs (obj) - sizeof *s) % c->obj_size == 0);
+
+  return s;
+}
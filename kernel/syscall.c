@@ -3,13 +3,14 @@
 #include <stdio.h>
 #include <syscall-nr.h>
 #include "devices/shutdown.h"
+#include "devices/block.h"
 #include "devices/input.h"
 #include "kernel/interrupt.h"
 #include "kernel/thread.h"
 #include "kernel/synch.h"
 #include "kernel/vaddr.h"
 #include "kernel/palloc.h"
-#include "kernel/malloc.h"
+#include "kernel/slab.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "vm/page.h"
@@ -40,6 +41,9 @@ static unsigned  tell (int fd);
 static void      close (int fd);
 static mapid_t   mmap (int fd, void *addr);
 static void      munmap (mapid_t mapid);
+static int       fsync (int fd);
+static void      sync (void);
+static void      iostat (void);
 
 static struct ufile *file_by_fid (fid_t);
 static fid_t allocate_fid (void);
@@ -47,6 +51,12 @@ static mapid_t allocate_mapid (void);
 
 static struct list list_file;
 
+/* Protects the fid and mapid counters. */
+static struct lock id_lock;
+
+/* Cache of struct ufile. */
+static struct kmem_cache *ufile_cache;
+
 typedef int (*handler) (uint32_t, uint32_t, uint32_t);
 static handler syscall_map[32];
 
@@ -64,6 +74,7 @@ void
 syscall_init (void)
 {
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
+  ufile_cache = kmem_cache_create ("ufile", sizeof (struct ufile), NULL);
 
   syscall_map[SYS_HALT]     = (handler)halt;
   syscall_map[SYS_EXIT]     = (handler)exit;
@@ -80,7 +91,11 @@ syscall_init (void)
   syscall_map[SYS_CLOSE]    = (handler)close;
   syscall_map[SYS_MMAP]     = (handler)mmap;
   syscall_map[SYS_MUNMAP]   = (handler)munmap;
+  syscall_map[SYS_FSYNC]    = (handler)fsync;
+  syscall_map[SYS_SYNC]     = (handler)sync;
+  syscall_map[SYS_IOSTAT]   = (handler)iostat;
   list_init (&list_file);
+  lock_init (&id_lock);
 }
 
 /* Syscall handler calls the appropriate function. */
@@ -96,10 +111,12 @@ syscall_handler (struct intr_frame *f)
   if (!( is_user_vaddr (param + 1) && is_user_vaddr (param + 2) && is_user_vaddr (param + 3)))
     thread_exit ();
 
-  if (*param < SYS_HALT || *param > SYS_INUMBER)
+  if (*param < SYS_HALT || *param > SYS_IOSTAT)
     thread_exit ();
 
   function = syscall_map[*param];
+  if (function == NULL)
+    thread_exit ();
 
   param_esp = f->esp;
   ret = function (*(param + 1), *(param + 2), *(param + 3));
@@ -145,10 +162,7 @@ create (const char *file, unsigned initial_size)
   if (file == NULL)
     thread_exit ();
 
-  lock_acquire (&thread_filesys_lock);
-  int ret = filesys_create (file, initial_size);
-  lock_release (&thread_filesys_lock);
-  return ret;
+  return filesys_create (file, initial_size);
 }
 
 /* Delete a file. */
@@ -158,10 +172,7 @@ remove (const char *file)
    if (file == NULL)
      thread_exit ();
   
-  lock_acquire (&thread_filesys_lock);
-  bool ret = filesys_remove (file);
-  lock_release (&thread_filesys_lock);
-  return ret;
+  return filesys_remove (file);
 }
 
 /* Open a file. */
@@ -174,24 +185,20 @@ open (const char *file)
   if (file == NULL)
     return -1;
 
-  lock_acquire (&thread_filesys_lock);
   sfile = filesys_open (file);
-  lock_release (&thread_filesys_lock);
   if (sfile == NULL)
     return -1;
 
-  f = (struct ufile *) malloc (sizeof (struct ufile));
+  f = kmem_cache_alloc (ufile_cache);
   if (f == NULL)
     {
       file_close (sfile);
       return -1;
     }
 
-  lock_acquire (&thread_filesys_lock);
   f->file = sfile;
   f->fid = allocate_fid ();
   list_push_back (&thread_current ()->files, &f->thread_elem);
-  lock_release (&thread_filesys_lock);
   return f->fid;
 }
 
@@ -206,9 +213,7 @@ filesize (int fd)
   if (f == NULL)
     return -1;
 
-  lock_acquire (&thread_filesys_lock);
   size = file_length (f->file);
-  lock_release (&thread_filesys_lock);
 
   return size;
 }
@@ -255,10 +260,8 @@ read (int fd, void *buffer, unsigned length)
                 page_in (p, true);
               size_t read_bytes = ofs + rem > PGSIZE ?
                                   rem - (ofs + rem - PGSIZE) : rem;
-              lock_acquire (&thread_filesys_lock);
               ASSERT (p->loaded);
               ret += file_read (f->file, tbuffer, read_bytes);
-              lock_release (&thread_filesys_lock);              
               rem -= read_bytes;
               tbuffer += read_bytes;
               frame_unpin (p->kpage);
@@ -307,10 +310,8 @@ write (int fd, const void *buffer, unsigned length)
                 page_in (p, true);
               size_t write_bytes = ofs + rem > PGSIZE ? 
                                    rem - (ofs + rem - PGSIZE) : rem;
-              lock_acquire (&thread_filesys_lock);
               ASSERT (p->loaded);
               ret += file_write (f->file, tbuffer, write_bytes);
-              lock_release (&thread_filesys_lock);              
               rem -= write_bytes;
               tbuffer += write_bytes;
               frame_unpin (p->kpage);
@@ -328,9 +329,7 @@ seek (int fd, unsigned position)
   f = file_by_fid (fd);
   if (!f)
     thread_exit ();
-  lock_acquire (&thread_filesys_lock);
   file_seek (f->file, position);
-  lock_release (&thread_filesys_lock);
 }
 
 /* Report current position in a file */
@@ -342,12 +341,39 @@ tell (int fd)
   f = file_by_fid (fd);
   if (!f)
     thread_exit ();
-  lock_acquire (&thread_filesys_lock);
   status = file_tell (f->file);
-  lock_release (&thread_filesys_lock);
   return status;
 }
 
+/* Write a file's cached data to disk. */
+static int
+fsync (int fd)
+{
+  struct ufile *f;
+
+  f = file_by_fid (fd);
+  if (f == NULL)
+    return -1;
+
+  file_flush (f->file);
+  return 0;
+}
+
+/* Write all cached file system data to disk. */
+static void
+sync (void)
+{
+  filesys_sync ();
+}
+
+/* Print block device statistics and the block request trace. */
+static void
+iostat (void)
+{
+  block_print_stats ();
+  block_dump_trace ();
+}
+
 /* Close a file. */
 static void
 close (int fd)
@@ -356,11 +382,9 @@ close (int fd)
   f = file_by_fid (fd);
   if (f == NULL)
     thread_exit ();
-  lock_acquire (&thread_filesys_lock);
   list_remove (&f->thread_elem);
   file_close (f->file);
-  free (f);
-  lock_release (&thread_filesys_lock);
+  kmem_cache_free (ufile_cache, f);
 }
 
 /* Creates a memory mapped file from the given file. */
@@ -370,9 +394,7 @@ mmap (int fd, void *address)
   size_t size;
   struct file *file;
   size = filesize(fd);
-  lock_acquire (&thread_filesys_lock);
   file = file_reopen (file_by_fid (fd)->file);
-  lock_release (&thread_filesys_lock);  
   if (size <= 0 || file == NULL)
     return -1;
   if (address == NULL || address == 0x0 || pg_ofs (address) != 0)
@@ -440,7 +462,12 @@ static fid_t
 allocate_fid (void)
 {
   static fid_t next_fid = 2;
-  return next_fid++;
+  fid_t fid;
+
+  lock_acquire (&id_lock);
+  fid = next_fid++;
+  lock_release (&id_lock);
+  return fid;
 }
 
 /* Allocate a new mapid for a file */
@@ -448,7 +475,12 @@ static mapid_t
 allocate_mapid (void)
 {
   static mapid_t next_mapid = 0;
-  return next_mapid++;
+  mapid_t mapid;
+
+  lock_acquire (&id_lock);
+  mapid = next_mapid++;
+  lock_release (&id_lock);
+  return mapid;
 }
 
 /* Returns the file with the given fid from the current thread's files */
@@ -477,9 +509,6 @@ syscall_exit (void)
   struct list_elem *e;
 	struct thread *t = thread_current ();
 
-  if (lock_held_by_current_thread (&thread_filesys_lock))
-    lock_release (&thread_filesys_lock);
-
 	/* close all opened files of the thread */
 	while (!list_empty (&t->files) )
 		{
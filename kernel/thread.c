@@ -37,9 +37,6 @@ static struct thread *initial_thread;
 /* Lock used by allocate_tid(). */
 static struct lock tid_lock;
 
-/* Lock used by threads when accessing file system code. */
-struct lock thread_filesys_lock;
-
 /* Stack frame for kernel_thread(). */
 struct kernel_thread_frame 
   {
@@ -93,7 +90,6 @@ thread_init (void)
   ASSERT (intr_get_level () == INTR_OFF);
 
   lock_init (&tid_lock);
-  lock_init (&thread_filesys_lock);
   list_init (&ready_list);
   list_init (&all_list);
 
@@ -301,6 +297,7 @@ thread_exit (void)
 #ifdef USERPROG
   process_exit ();
 #endif
+  malloc_thread_exit ();
 
   /* Remove thread from all threads list, set our status to dying,
      and schedule another process.  That process will destroy us
@@ -401,7 +398,12 @@ thread_get_recent_cpu (void)
    to it to enable thread_start() to continue, and immediately
    blocks.  After that, the idle thread never appears in the
    ready list.  It is returned by next_thread_to_run() as a
-   special case when the ready list is empty. */
+   special case when the ready list is empty.
+
+   Before halting, the idle thread spends the otherwise wasted
+   cycles filling the page allocator's stashes of pre-zeroed
+   pages, one page at a time, for as long as no other thread
+   becomes ready. */
 static void
 idle (void *idle_started_ UNUSED) 
 {
@@ -415,6 +417,14 @@ idle (void *idle_started_ UNUSED)
       intr_disable ();
       thread_block ();
 
+      /* Nobody else is ready, so zero free pages ahead of time. */
+      intr_enable ();
+      while (list_empty (&ready_list) && palloc_prezero_page ())
+        continue;
+      intr_disable ();
+      if (!list_empty (&ready_list))
+        continue;
+
       /* Re-enable interrupts and wait for the next one.
 
          The `sti' instruction disables interrupts until the
@@ -566,9 +576,6 @@ thread_schedule_tail (struct thread *prev)
     {
       ASSERT (prev != cur);
 
-      if (prev->exec_file != NULL)
-        file_close (prev->exec_file);
-
       struct list_elem *trav;
 
       for (trav = list_begin (&prev->live_children); trav != list_end (&prev->live_children);
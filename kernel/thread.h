@@ -5,6 +5,7 @@
 #include <list.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "kernel/malloc.h"
 #include "kernel/synch.h"
 #include "filesys/file.h"
 
@@ -17,10 +18,6 @@ enum thread_status
     THREAD_DYING        /* About to be destroyed. */
   };
 
-/* Lock used by threads when accessing file system code.
-   This variable is declared and initialized in thread.c. */
-extern struct lock thread_filesys_lock;
-
 /* Struct that represents a file mapping:
       - contains a variable (used) to state whether an instance of
         this struct is currently being used as a valid file mapping
@@ -97,12 +94,13 @@ typedef int tid_t;
    value, triggering the assertion.  (So don't add elements below 
    THREAD_MAGIC.)
 */
-/* The `elem' member has a dual purpose.  It can be an element in
-   the run queue (thread.c), or it can be an element in a
-   semaphore wait list (synch.c).  It can be used these two ways
-   only because they are mutually exclusive: only a thread in the
-   ready state is on the run queue, whereas only a thread in the
-   blocked state is on a semaphore wait list. */
+/* The `elem' member has a triple purpose.  It can be an element
+   in the run queue (thread.c), in a semaphore wait list
+   (synch.c), or in the list of threads in timer_sleep()
+   (timer.c).  It can be used these ways only because they are
+   mutually exclusive: only a thread in the ready state is on the
+   run queue, whereas only a thread in the blocked state is on a
+   semaphore wait list or sleeping, and never both at once. */
 struct thread
   {
     /* Owned by thread.c. */
@@ -113,7 +111,7 @@ struct thread
     int priority;                       /* Priority. */
     struct list_elem allelem;           /* List element for all threads list. */
 
-    /* Shared between thread.c and synch.c. */
+    /* Shared between thread.c, synch.c, and timer.c. */
     struct list_elem elem;              /* List element. */
 
     struct thread *parent;              /* Pointer to this thread's parent. */
@@ -136,6 +134,18 @@ struct thread
     uint32_t *pagedir;                  /* Page directory. */
 #endif
 
+    /* Owned by devices/timer.c. */
+    int64_t wake_tick;                  /* When to wake from timer_sleep(). */
+
+#ifdef FILESYS
+    /* Owned by filesys/journal.c. */
+    int journal_depth;                  /* Nesting of journal_begin(). */
+    int journal_credits;                /* Sectors reserved, unused. */
+#endif
+
+    /* Owned by malloc.c. */
+    struct magazine magazines[MALLOC_CLASS_CNT]; /* Free block caches. */
+
     /* Owned by thread.c. */
     unsigned magic;                     /* Detects stack overflow. */
   };
@@ -0,0 +1,204 @@
+#include "kernel/vmalloc.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "kernel/init.h"
+#include "kernel/loader.h"
+#include "kernel/palloc.h"
+#include "kernel/pte.h"
+#include "kernel/synch.h"
+#include "kernel/vaddr.h"
+
+/* Virtually contiguous kernel allocations.
+
+   palloc_get_multiple() can only satisfy a multi-page request
+   with physically contiguous pages, which a fragmented kernel
+   pool may not have even when plenty of pages are free.
+   vmalloc() instead takes single pages from the kernel pool and
+   maps them at consecutive addresses in a range of kernel
+   virtual memory, VMALLOC_START to VMALLOC_END, that lies above
+   the direct mapping of physical memory.
+
+   The page tables for the whole range are allocated once, at
+   boot, and installed in init_page_dir before any other page
+   directory exists.  Every page directory is a copy of
+   init_page_dir (see pagedir_create()), so all of them share
+   these page tables, and a mapping added or removed here is
+   immediately visible in every process.
+
+   Each area is followed by one unmapped guard page, which both
+   catches overruns and marks where the area ends, so vfree()
+   needs no other record of the area's size. */
+
+/* Number of pages in the vmalloc range. */
+#define VMALLOC_PAGES \
+  (((uintptr_t) VMALLOC_END - (uintptr_t) VMALLOC_START) / PGSIZE)
+
+static struct lock vmalloc_lock;        /* Protects everything below. */
+static struct bitmap *used_map;         /* Pages in use, incl. guards. */
+static uint32_t *vmalloc_pts;           /* First of the range's page tables,
+                                           all contiguous in PTEs. */
+static size_t area_cnt;                 /* Number of live areas. */
+static size_t mapped_cnt;               /* Number of mapped pages. */
+
+static size_t unmap_area (uint8_t *area);
+static uint32_t *lookup_pte (const void *vaddr);
+
+/* Allocates the page tables for the vmalloc range and installs
+   them in init_page_dir.  Must be called after paging_init()
+   and before any process page directory is created. */
+void
+vmalloc_init (void)
+{
+  uint8_t *vaddr;
+
+  ASSERT (init_page_dir != NULL);
+  ASSERT ((uintptr_t) ptov (init_ram_pages * PGSIZE)
+          <= (uintptr_t) VMALLOC_START);
+  ASSERT (pg_ofs (VMALLOC_START) == 0 && pt_no (VMALLOC_START) == 0);
+
+  lock_init (&vmalloc_lock);
+  used_map = bitmap_create (VMALLOC_PAGES);
+  if (used_map == NULL)
+    PANIC ("vmalloc_init: out of memory");
+
+  /* Allocate the page tables as one block so that the PTEs for
+     the whole range can be indexed directly. */
+  vmalloc_pts = palloc_get_multiple (PAL_ASSERT | PAL_ZERO,
+                                     DIV_ROUND_UP (VMALLOC_PAGES, PGSIZE
+                                                   / sizeof (uint32_t)));
+  for (vaddr = VMALLOC_START; vaddr < (uint8_t *) VMALLOC_END;
+       vaddr += PGSIZE * (PGSIZE / sizeof (uint32_t)))
+    {
+      uint32_t *pte = lookup_pte (vaddr);
+      ASSERT (init_page_dir[pd_no (vaddr)] == 0);
+      init_page_dir[pd_no (vaddr)] = pde_create (pte);
+    }
+}
+
+/* Allocates SIZE bytes of virtually contiguous kernel memory
+   and returns its address, which is page-aligned.  Returns a
+   null pointer if there is not enough memory or address space. */
+void *
+vmalloc (size_t size)
+{
+  size_t page_cnt = DIV_ROUND_UP (size, PGSIZE);
+  size_t start, i;
+  uint8_t *area;
+
+  if (page_cnt == 0)
+    return NULL;
+
+  /* Reserve address space for the area and its guard page. */
+  lock_acquire (&vmalloc_lock);
+  start = bitmap_scan_and_flip (used_map, 0, page_cnt + 1, false);
+  lock_release (&vmalloc_lock);
+  if (start == BITMAP_ERROR)
+    return NULL;
+  area = (uint8_t *) VMALLOC_START + start * PGSIZE;
+
+  /* Back it with pages.  The PTEs were not present, so there is
+     nothing to flush from the TLB. */
+  for (i = 0; i < page_cnt; i++)
+    {
+      void *page = palloc_get_page (0);
+      if (page == NULL)
+        {
+          unmap_area (area);
+          lock_acquire (&vmalloc_lock);
+          bitmap_set_multiple (used_map, start, page_cnt + 1, false);
+          lock_release (&vmalloc_lock);
+          return NULL;
+        }
+      *lookup_pte (area + i * PGSIZE) = pte_create_kernel (page, true);
+    }
+
+  lock_acquire (&vmalloc_lock);
+  area_cnt++;
+  mapped_cnt += page_cnt;
+  lock_release (&vmalloc_lock);
+  return area;
+}
+
+/* Frees AREA, which must have been returned by vmalloc(). */
+void
+vfree (void *area)
+{
+  size_t start, page_cnt;
+
+  if (area == NULL)
+    return;
+  ASSERT (is_vmalloc_vaddr (area));
+  ASSERT (pg_ofs (area) == 0);
+
+  page_cnt = unmap_area (area);
+  ASSERT (page_cnt > 0);
+
+  start = ((uint8_t *) area - (uint8_t *) VMALLOC_START) / PGSIZE;
+  lock_acquire (&vmalloc_lock);
+  ASSERT (bitmap_all (used_map, start, page_cnt + 1));
+  bitmap_set_multiple (used_map, start, page_cnt + 1, false);
+  area_cnt--;
+  mapped_cnt -= page_cnt;
+  lock_release (&vmalloc_lock);
+}
+
+/* Returns true if VADDR lies in the vmalloc range. */
+bool
+is_vmalloc_vaddr (const void *vaddr)
+{
+  return vaddr >= VMALLOC_START && vaddr < VMALLOC_END;
+}
+
+/* Returns the physical address at which VADDR, which must lie
+   in a mapped page of the vmalloc range, is mapped.  Unlike the
+   direct mapping, consecutive pages of an area are generally not
+   physically contiguous. */
+uintptr_t
+vmalloc_vtop (const void *vaddr)
+{
+  uint32_t pte = *lookup_pte (vaddr);
+
+  ASSERT ((pte & PTE_P) != 0);
+  return vtop (pte_get_page (pte)) + pg_ofs (vaddr);
+}
+
+/* Prints vmalloc statistics. */
+void
+vmalloc_print_stats (void)
+{
+  printf ("Vmalloc: %zu areas, %zu of %zu pages mapped\n",
+          area_cnt, mapped_cnt, (size_t) VMALLOC_PAGES);
+}
+
+/* Unmaps the pages of AREA up to the first unmapped page and
+   returns them to the page allocator.  Returns the number of
+   pages unmapped. */
+static size_t
+unmap_area (uint8_t *area)
+{
+  uint8_t *vaddr;
+  uint32_t *pte;
+
+  for (vaddr = area; (*(pte = lookup_pte (vaddr)) & PTE_P) != 0;
+       vaddr += PGSIZE)
+    {
+      void *page = pte_get_page (*pte);
+      *pte = 0;
+      asm volatile ("invlpg (%0)" : : "r" (vaddr) : "memory");
+      palloc_free_page (page);
+    }
+  return (vaddr - area) / PGSIZE;
+}
+
+/* Returns the PTE for VADDR, which must be in the vmalloc
+   range. */
+static uint32_t *
+lookup_pte (const void *vaddr)
+{
+  ASSERT (is_vmalloc_vaddr (vaddr));
+  return vmalloc_pts + ((uintptr_t) vaddr - (uintptr_t) VMALLOC_START)
+                       / PGSIZE;
+}
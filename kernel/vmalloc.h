@@ -0,0 +1,19 @@
+#ifndef KERNEL_VMALLOC_H
+#define KERNEL_VMALLOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Reserved range of kernel virtual addresses for vmalloc(). */
+#define VMALLOC_START ((void *) 0xf0000000)
+#define VMALLOC_END ((void *) 0xf2000000)
+
+void vmalloc_init (void);
+void *vmalloc (size_t size) __attribute__ ((malloc));
+void vfree (void *);
+bool is_vmalloc_vaddr (const void *);
+uintptr_t vmalloc_vtop (const void *);
+void vmalloc_print_stats (void);
+
+#endif /* kernel/vmalloc.h */
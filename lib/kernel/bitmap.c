@@ -310,6 +310,30 @@ bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
   return BITMAP_ERROR;
 }
 
+/* Returns the index of the first bit in B at or after START
+   that is set to VALUE, or BITMAP_ERROR if there is none.
+   Skips over whole elements whose bits are all !VALUE, so a
+   long run of such bits costs one test per element. */
+size_t
+bitmap_next (const struct bitmap *b, size_t start, bool value)
+{
+  elem_type skip = value ? 0 : (elem_type) -1;
+  size_t i = start;
+
+  ASSERT (b != NULL);
+
+  while (i < b->bit_cnt)
+    {
+      if (i % ELEM_BITS == 0 && b->bits[elem_idx (i)] == skip)
+        i += ELEM_BITS;
+      else if (bitmap_test (b, i) == value)
+        return i;
+      else
+        i++;
+    }
+  return BITMAP_ERROR;
+}
+
 /* Finds the first group of CNT consecutive bits in B at or after
    START that are all set to VALUE, flips them all to !VALUE,
    and returns the index of the first bit in the group.
@@ -359,6 +383,46 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Reads the SIZE bytes of B that start at byte OFS, which must
+   be a multiple of the bitmap's element size, from the same
+   bytes of FILE.  Bytes past the end of B are ignored.  Returns
+   true if successful, false otherwise. */
+bool
+bitmap_read_part (struct bitmap *b, struct file *file, off_t ofs, off_t size)
+{
+  off_t total = byte_cnt (b->bit_cnt);
+  bool success = true;
+
+  ASSERT (ofs % sizeof (elem_type) == 0);
+  if (size > total - ofs)
+    size = total - ofs;
+  if (size > 0)
+    {
+      success = file_read_at (file, (uint8_t *) b->bits + ofs, size, ofs)
+                == size;
+      b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
+    }
+  return success;
+}
+
+/* Writes the SIZE bytes of B that start at byte OFS, which must
+   be a multiple of the bitmap's element size, to the same bytes
+   of FILE.  Bytes past the end of B are ignored.  Returns true
+   if successful, false otherwise. */
+bool
+bitmap_write_part (const struct bitmap *b, struct file *file,
+                   off_t ofs, off_t size)
+{
+  off_t total = byte_cnt (b->bit_cnt);
+
+  ASSERT (ofs % sizeof (elem_type) == 0);
+  if (size > total - ofs)
+    size = total - ofs;
+  return (size <= 0
+          || file_write_at (file, (const uint8_t *) b->bits + ofs, size, ofs)
+             == size);
+}
 #endif /* FILESYS */
 
 /* Debugging. */
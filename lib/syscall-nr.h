@@ -28,7 +28,14 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+
+    /* Buffer cache. */
+    SYS_FSYNC,                  /* Writes a file's cached data to disk. */
+    SYS_SYNC,                   /* Writes all cached data to disk. */
+
+    /* Block devices. */
+    SYS_IOSTAT                  /* Prints block device statistics. */
   };
 
 #endif /* lib/syscall-nr.h */
@@ -45,4 +45,11 @@ bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
 
+/* Buffer cache. */
+int fsync (int fd);
+void sync (void);
+
+/* Block devices. */
+void iostat (void);
+
 #endif /* lib/user/syscall.h */
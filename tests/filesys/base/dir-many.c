@@ -0,0 +1,97 @@
+/* Creates a few hundred files in the root directory, which
+   makes it convert to an indexed directory and split its leaves
+   many times over, plus a batch of files whose names all hash to
+   the same leaf, which must be extended with overflow leaves.
+   Then opens every file, removes half of them and checks that
+   only the other half can still be opened, and finally removes
+   the rest. */
+
+#include <stdio.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+/* Number of files with ordinary names, and of files whose names
+   collide. */
+#define PLAIN_CNT 300
+#define COLLIDE_CNT 40
+#define FILE_CNT (PLAIN_CNT + COLLIDE_CNT)
+
+/* Hash bits that the directory index uses at most. */
+#define INDEX_BITS 7
+
+static char names[FILE_CNT][16];
+
+/* Returns the hash of NAME that the directory index uses. */
+static unsigned
+name_hash (const char *name)
+{
+  unsigned hash = 2166136261u;
+
+  while (*name != '\0')
+    hash = (hash * 16777619u) ^ (unsigned char) *name++;
+  return hash;
+}
+
+/* Opens file I and returns true if that succeeds, closing it
+   again. */
+static bool
+can_open (size_t i)
+{
+  int fd = open (names[i]);
+
+  if (fd < 0)
+    return false;
+  if (fd < 2)
+    fail ("open \"%s\" returned fd %d", names[i], fd);
+  close (fd);
+  return true;
+}
+
+void
+test_main (void) 
+{
+  unsigned seed;
+  size_t i;
+
+  for (i = 0; i < PLAIN_CNT; i++)
+    snprintf (names[i], sizeof names[i], "file%zu", i);
+  for (seed = 0; i < FILE_CNT; seed++)
+    {
+      snprintf (names[i], sizeof names[i], "clash%u", seed);
+      if ((name_hash (names[i]) & ((1u << INDEX_BITS) - 1)) == 0)
+        i++;
+    }
+
+  msg ("create %d files", FILE_CNT);
+  for (i = 0; i < FILE_CNT; i++)
+    if (!create (names[i], 0))
+      fail ("create \"%s\" failed", names[i]);
+
+  msg ("open each file");
+  for (i = 0; i < FILE_CNT; i++)
+    if (!can_open (i))
+      fail ("open \"%s\" failed", names[i]);
+
+  msg ("remove every other file");
+  for (i = 0; i < FILE_CNT; i += 2)
+    if (!remove (names[i]))
+      fail ("remove \"%s\" failed", names[i]);
+
+  msg ("open each file again");
+  for (i = 0; i < FILE_CNT; i++)
+    if (can_open (i) != (i % 2 == 1))
+      fail ("open \"%s\" %s after removing every other file",
+            names[i], i % 2 == 1 ? "failed" : "succeeded");
+
+  msg ("remove the rest");
+  for (i = 1; i < FILE_CNT; i += 2)
+    if (!remove (names[i]))
+      fail ("remove \"%s\" failed", names[i]);
+  for (i = 0; i < FILE_CNT; i++)
+    if (can_open (i))
+      fail ("open \"%s\" succeeded after removing it", names[i]);
+
+  CHECK (create (names[0], 0), "create \"%s\" again", names[0]);
+  CHECK (can_open (0), "open \"%s\"", names[0]);
+}
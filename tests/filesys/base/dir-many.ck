@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(dir-many) begin
+(dir-many) create 340 files
+(dir-many) open each file
+(dir-many) remove every other file
+(dir-many) open each file again
+(dir-many) remove the rest
+(dir-many) create "file0" again
+(dir-many) open "file0"
+(dir-many) end
+EOF
+pass;
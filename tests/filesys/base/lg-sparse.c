@@ -0,0 +1,35 @@
+/* Creates an empty file, seeks far past its end, and writes a
+   block there, leaving a hole in front of it.  Verifies that the
+   file's size takes in the hole and that the hole reads back as
+   zeros. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define HOLE_SIZE 98765
+#define BLOCK_SIZE 1234
+#define TEST_SIZE (HOLE_SIZE + BLOCK_SIZE)
+
+static char buf[TEST_SIZE];
+
+void
+test_main (void) 
+{
+  const char *file_name = "sparse";
+  int fd;
+
+  random_bytes (buf + HOLE_SIZE, BLOCK_SIZE);
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  msg ("seek \"%s\" to %d", file_name, HOLE_SIZE);
+  seek (fd, HOLE_SIZE);
+  CHECK (write (fd, buf + HOLE_SIZE, BLOCK_SIZE) == BLOCK_SIZE,
+         "write %d bytes to \"%s\"", BLOCK_SIZE, file_name);
+  CHECK (filesize (fd) == TEST_SIZE, "filesize \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  check_file (file_name, buf, TEST_SIZE);
+}
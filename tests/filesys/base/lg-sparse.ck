@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(lg-sparse) begin
+(lg-sparse) create "sparse"
+(lg-sparse) open "sparse"
+(lg-sparse) seek "sparse" to 98765
+(lg-sparse) write 1234 bytes to "sparse"
+(lg-sparse) filesize "sparse"
+(lg-sparse) close "sparse"
+(lg-sparse) open "sparse" for verification
+(lg-sparse) verified contents of "sparse"
+(lg-sparse) close "sparse"
+(lg-sparse) end
+EOF
+pass;
@@ -0,0 +1,45 @@
+/* Writes a small file in many small pieces, calling fsync()
+   after each one and sync() at the end, and then verifies the
+   file's contents. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define TEST_SIZE 3210
+#define CHUNK_SIZE 37
+
+static char buf[TEST_SIZE];
+
+void
+test_main (void) 
+{
+  const char *file_name = "synced";
+  size_t ofs;
+  int fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create (file_name, TEST_SIZE), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+
+  msg ("write and fsync \"%s\"", file_name);
+  for (ofs = 0; ofs < TEST_SIZE; ofs += CHUNK_SIZE)
+    {
+      size_t size = TEST_SIZE - ofs < CHUNK_SIZE ? TEST_SIZE - ofs : CHUNK_SIZE;
+
+      if (write (fd, buf + ofs, size) != (int) size)
+        fail ("write %zu bytes at offset %zu in \"%s\" failed",
+              size, ofs, file_name);
+      if (fsync (fd) != 0)
+        fail ("fsync \"%s\" at offset %zu failed", file_name, ofs);
+    }
+  CHECK (fsync (fd + 1) == -1, "fsync unopened fd");
+
+  msg ("sync");
+  sync ();
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  check_file (file_name, buf, TEST_SIZE);
+}
@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(sm-fsync) begin
+(sm-fsync) create "synced"
+(sm-fsync) open "synced"
+(sm-fsync) write and fsync "synced"
+(sm-fsync) fsync unopened fd
+(sm-fsync) sync
+(sm-fsync) close "synced"
+(sm-fsync) open "synced" for verification
+(sm-fsync) verified contents of "synced"
+(sm-fsync) close "synced"
+(sm-fsync) end
+EOF
+pass;
@@ -0,0 +1,41 @@
+/* Writes a file small enough to be stored inside its inode,
+   closes it, then reopens it and appends enough to make it
+   outgrow the inode, and verifies the file's contents. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SMALL_SIZE 300
+#define TEST_SIZE 1234
+
+static char buf[TEST_SIZE];
+
+void
+test_main (void) 
+{
+  const char *file_name = "growing";
+  int fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, SMALL_SIZE) == SMALL_SIZE,
+         "write %d bytes to \"%s\"", SMALL_SIZE, file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  check_file (file_name, buf, SMALL_SIZE);
+
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  seek (fd, SMALL_SIZE);
+  CHECK (write (fd, buf + SMALL_SIZE, TEST_SIZE - SMALL_SIZE)
+         == TEST_SIZE - SMALL_SIZE,
+         "write %d more bytes to \"%s\"", TEST_SIZE - SMALL_SIZE, file_name);
+  CHECK (filesize (fd) == TEST_SIZE, "filesize \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  check_file (file_name, buf, TEST_SIZE);
+}
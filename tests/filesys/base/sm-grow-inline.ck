@@ -0,0 +1,23 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(sm-grow-inline) begin
+(sm-grow-inline) create "growing"
+(sm-grow-inline) open "growing"
+(sm-grow-inline) write 300 bytes to "growing"
+(sm-grow-inline) close "growing"
+(sm-grow-inline) open "growing" for verification
+(sm-grow-inline) verified contents of "growing"
+(sm-grow-inline) close "growing"
+(sm-grow-inline) open "growing"
+(sm-grow-inline) write 934 more bytes to "growing"
+(sm-grow-inline) filesize "growing"
+(sm-grow-inline) close "growing"
+(sm-grow-inline) open "growing" for verification
+(sm-grow-inline) verified contents of "growing"
+(sm-grow-inline) close "growing"
+(sm-grow-inline) end
+EOF
+pass;
@@ -2,7 +2,7 @@
 #include <stdio.h>
 #include "kernel/syscall.h"
 #include "kernel/pagedir.h"
-#include "kernel/malloc.h"
+#include "kernel/slab.h"
 #include "kernel/synch.h"
 
 static struct lock lock_frame;
@@ -10,6 +10,9 @@ static struct lock lock_evict;
 static struct hash frames;
 static struct list frames_list;
 static struct list_elem *next;
+/* frame objects */
+static struct kmem_cache *frame_cache;
+static void frame_ctor (void *);
 static unsigned frame_hash (const struct hash_elem *, void *);
 static bool frame_less (const struct hash_elem *, const struct hash_elem *, void *);
 static struct frame *frame_find (void *);
@@ -28,6 +31,16 @@ void frame_init ()
 		lock_init (&lock_evict);
 		hash_init (&frames, frame_hash, frame_less, NULL);
 		list_init (&frames_list);
+		frame_cache = kmem_cache_create ("frame", sizeof (struct frame), frame_ctor);
+	}
+
+/* fresh frame: no pages mapped, pinned until frame_page */
+static void frame_ctor (void *obj)
+	{
+		struct frame *f = obj;
+		list_init (&f->pages);
+		lock_init (&f->lock_list);
+		f->pin = true;
 	}
 
 void *frame_new (enum palloc_flags flags)
@@ -36,13 +49,10 @@ void *frame_new (enum palloc_flags flags)
 		if (address != NULL) 
 			{
 		  	struct frame *f;
-		  	f = (struct frame *) malloc (sizeof (struct frame));
+		  	f = kmem_cache_alloc (frame_cache);
 		  	if (f == NULL)
 		    	return false;
-		  	list_init (&f->pages);
-				lock_init (&f->lock_list);
 				f->address = address;
-				f->pin = true;
 				lock_acquire (&lock_frame);
 				list_push_back (&frames_list, &f->list_elem);
 				hash_insert (&frames, &f->hash_elem);   
@@ -190,7 +200,7 @@ static void frame_remove (struct frame *f)
 		pointer_rem (f);
 		hash_delete (&frames, &f->hash_elem);
 		list_remove (&f->list_elem);
-		free (f);
+		kmem_cache_free (frame_cache, f);
 		lock_release (&lock_frame);
 	}
 
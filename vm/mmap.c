@@ -1,12 +1,14 @@
 #include "vm/mmap.h"
 #include <hash.h>
 #include <list.h>
-#include "kernel/malloc.h"
+#include "kernel/slab.h"
 #include "kernel/thread.h"
 #include "kernel/synch.h"
 
 static struct lock lock_mfile;
 static struct hash mfiles;
+/* mfile objects */
+static struct kmem_cache *mfile_cache;
 static bool mfile_less (const struct hash_elem *, const struct hash_elem *, void *);
 static unsigned mfile_hash (const struct hash_elem *, void *);
 
@@ -14,6 +16,7 @@ void mfile_init (void)
 	{
 		lock_init (&lock_mfile);
 		hash_init (&mfiles, mfile_hash, mfile_less, NULL);
+		mfile_cache = kmem_cache_create ("mfile", sizeof (struct mfile), NULL);
 	}
 
 static unsigned mfile_hash (const struct hash_elem *mfi, void *aux UNUSED)
@@ -40,14 +43,14 @@ bool mfile_rem (mapid_t mapid)
 		lock_acquire (&lock_mfile);
 		hash_delete (&mfiles, &mf->hash_elem);
 		list_remove (&mf->thread_elem);
-		free (mf);
+		kmem_cache_free (mfile_cache, mf);
 		lock_release (&lock_mfile);
 		return true; 
 	}
 
 void mfile_add (mapid_t mapid, int fid, void *addr_init, void *addr_fin)
 	{
-		struct mfile *mf = (struct mfile *) malloc (sizeof (struct mfile));
+		struct mfile *mf = kmem_cache_alloc (mfile_cache);
 		mf->fid = fid;
 		mf->mapid = mapid;
 		mf->addr_init = addr_init;
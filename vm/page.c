@@ -3,7 +3,7 @@
 #include <string.h>
 #include "kernel/pagedir.h"
 #include "kernel/syscall.h"
-#include "kernel/malloc.h"
+#include "kernel/slab.h"
 #include "kernel/palloc.h"
 #include "kernel/thread.h"
 #include "kernel/synch.h"
@@ -15,7 +15,6 @@
 #include "filesys/inode.h"
 
 static int c = 0;
-static void zero_in_page (uint8_t *kpage);
 static void swap_in_page (uint8_t *kpage, struct page *p);
 static bool file_in (uint8_t *kpage, struct page *p);
 static void add_page (struct page *p);
@@ -23,15 +22,18 @@ static void add_page (struct page *p);
 /* in out lock*/
 static struct lock lock_in;
 static struct lock lock_out;
+/* page objects */
+static struct kmem_cache *page_cache;
 void page_init (void)
 	{
 		lock_init (&lock_in);
 		lock_init (&lock_out);
+		page_cache = kmem_cache_create ("page", sizeof (struct page), NULL);
 	}
 
 struct page* page_file (void *address, struct file *file, off_t ofs, size_t read_bytes, size_t zero_bytes, bool writable, off_t bid)
 	{
-		struct page *p = (struct page*) malloc (sizeof (struct page));
+		struct page *p = kmem_cache_alloc (page_cache);
 		if (p == NULL)
 		  return NULL;		
 		p->loaded = false;
@@ -51,7 +53,7 @@ struct page* page_file (void *address, struct file *file, off_t ofs, size_t read
 
 struct page* page_zero (void *address, bool writable)
 	{
-		struct page *p = (struct page*) malloc (sizeof (struct page));
+		struct page *p = kmem_cache_alloc (page_cache);
 		if (p == NULL)
 		  return NULL; 
 		p->loaded = false;
@@ -71,8 +73,9 @@ bool page_in (struct page *p, bool pin)
 		if (p->type == FILE && p->file_info.bid != -1)
 		  p->kpage = frame_lookup (p->file_info.bid);
 		
+		/* zero pages come pre-zeroed from the page allocator. */
 		if (p->kpage == NULL)
-		  p->kpage = frame_new (PAL_USER);
+		  p->kpage = frame_new (p->type == ZERO ? PAL_USER | PAL_ZERO : PAL_USER);
 
 		lock_release (&lock_in);
 		frame_page (p->kpage, p);
@@ -80,9 +83,7 @@ bool page_in (struct page *p, bool pin)
 		bool ok = true;
 		if (p->type == FILE)
 		  ok = file_in (p->kpage, p);
-		else if (p->type == ZERO)
-		  zero_in_page (p->kpage);
-		else
+		else if (p->type == SWAP)
 		  swap_in_page (p->kpage, p);
 
 		if (!ok)
@@ -117,11 +118,8 @@ page_out (struct page *p, void *kpage)
 		  {
 		    /* page back to file */
 		    frame_pin (kpage);
-		    lock_acquire (&thread_filesys_lock);
-
-		    file_seek (p->file_info.file, p->file_info.ofs);
-		    file_write (p->file_info.file, kpage, p->file_info.read_bytes);
-		    lock_release (&thread_filesys_lock);
+		    file_write_at (p->file_info.file, kpage,
+		                   p->file_info.read_bytes, p->file_info.ofs);
 		    frame_unpin (kpage);
 		  }
 		else if (p->type == SWAP || pagedir_is_dirty (p->pagedir, p->address))
@@ -141,12 +139,10 @@ static bool file_in (uint8_t *kpage, struct page *p)
 	{
 		/* reading the page from file. */
 
-		lock_acquire (&thread_filesys_lock);
-		file_seek (p->file_info.file, p->file_info.ofs);
-		size_t temp = file_read (p->file_info.file, kpage, 
-		                        p->file_info.read_bytes);
-		lock_release (&thread_filesys_lock);
-		 
+		size_t temp = file_read_at (p->file_info.file, kpage,
+		                            p->file_info.read_bytes,
+		                            p->file_info.ofs);
+
 		if (temp != p->file_info.read_bytes)
 		  {
 		    frame_free (kpage, p->pagedir);
@@ -158,11 +154,6 @@ static bool file_in (uint8_t *kpage, struct page *p)
 		return true;
 	}
 
-static void zero_in_page (uint8_t *kpage)
-	{
-		memset (kpage, 0, PGSIZE);
-	}
-
 static void
 swap_in_page (uint8_t *kpage, struct page *p)
 	{
@@ -195,7 +186,7 @@ void page_free (struct page *p)
 
 		/* clear mapping */
 		pagedir_clear_page (p->pagedir, p->address);
-		free (p);
+		kmem_cache_free (page_cache, p);
 		--c;
 	}
 
@@ -25,15 +25,11 @@ void swap_init ()
 void swap_in (size_t idx, void *address)
 	{
 		lock_acquire (&lock_swap);
-		size_t ofs; 
-		for (ofs = 0; ofs < BPP; ++ofs)
-		  {
-		    ASSERT (idx < ssize);
-		    ASSERT ( bitmap_test (sm, idx) );
+		ASSERT (idx + BPP <= ssize);
+		ASSERT (bitmap_all (sm, idx, BPP) );
 
-		    block_read (sb, idx, address + ofs * BPP);
-		    ++idx;
-		  }
+		/* one request for the whole page. */
+		block_read_multiple (sb, idx, address, BPP);
 		lock_release (&lock_swap); 
 	}
 
@@ -44,15 +40,10 @@ size_t swap_save (void *address)
 
 		ASSERT (idx != BITMAP_ERROR);
 
-		size_t ofs, ix = idx;
-		for (ofs = 0; ofs < BPP; ++ofs)
-		  {
-		    ASSERT (idx < ssize);
-		    ASSERT (bitmap_test (sm, ix));
+		ASSERT (idx + BPP <= ssize);
 
-		    block_write (sb, ix, address + ofs * BPP);
-		    ++ix;
-		  }
+		/* one request for the whole page. */
+		block_write_multiple (sb, idx, address, BPP);
 		lock_release (&lock_swap);
 
 		return idx;